@@ -0,0 +1,213 @@
+/*
+
+Copyright (c) 2015, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "json_writer.hpp"
+#include "escape_json.hpp"
+#include "response_buffer.hpp" // for appendf
+#include "libtorrent/torrent_status.hpp"
+#include "libtorrent/aux_/escape_string.hpp" // for to_hex
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cinttypes>
+
+using namespace libtorrent;
+
+// formats a uTorrent torrent list (list=1) the way send_torrent_list did
+// with appendf, and with json_writer, and reports the time and size of
+// each. The rows have the same fields as the version 1 list.
+
+namespace {
+
+torrent_status make_status(int i)
+{
+	torrent_status st;
+	for (int k = 0; k < 20; ++k)
+		st.info_hash[k] = (i >> ((k % 4) * 8)) ^ k;
+	char name[100];
+	snprintf(name, sizeof(name), "Some.Linux.Distribution.%d.x86_64.DVD.iso", i);
+	st.name = name;
+	// some names aren't plain ASCII
+	if (i % 10 == 0) st.name += " \xc3\xa5\xc3\xa4\xc3\xb6";
+	st.save_path = "/srv/torrents/downloads/complete";
+	st.state = torrent_status::downloading;
+	st.progress_ppm = (i * 7919) % 1000000;
+	st.total_wanted = std::int64_t(i) * 16384 + 4000000000LL;
+	st.total_wanted_done = st.total_wanted / 3;
+	st.all_time_download = st.total_wanted_done;
+	st.all_time_upload = std::int64_t(i) * 1234;
+	st.download_payload_rate = i % 100000;
+	st.upload_payload_rate = i % 30000;
+	st.num_peers = i % 50;
+	st.num_seeds = i % 7;
+	st.list_peers = i % 200;
+	st.list_seeds = i % 20;
+	st.added_time = 1400000000 + i;
+	st.queue_position = i;
+	return st;
+}
+
+void list_appendf(std::vector<char>& response, std::vector<torrent_status> const& torrents)
+{
+	appendf(response, ",\"torrents\":[");
+	int first = 1;
+	for (std::vector<torrent_status>::const_iterator i = torrents.begin()
+		, end(torrents.end()); i != end; ++i)
+	{
+		appendf(response, ",[\"%s\",%d,\"%s\",%" PRId64 ",%d,%" PRId64 ",%" PRId64 ",%f,%d,%d,%d,\"%s\",%d,%d,%d,%d,%d,%d,%" PRId64 "" + first
+			, to_hex(i->info_hash.to_string()).c_str()
+			, 201
+			, escape_json(i->name).c_str()
+			, i->total_wanted
+			, i->progress_ppm / 1000
+			, i->all_time_download
+			, i->all_time_upload
+			, i->all_time_download == 0 ? 0 : float(i->all_time_upload) * 1000.f / i->all_time_download
+			, i->upload_payload_rate
+			, i->download_payload_rate
+			, i->download_payload_rate == 0 ? 0 : int((i->total_wanted - i->total_wanted_done) / i->download_payload_rate)
+			, ""
+			, i->num_peers - i->num_seeds
+			, i->list_peers - i->list_seeds
+			, i->num_seeds
+			, i->list_seeds
+			, 0
+			, i->queue_position
+			, i->total_wanted - i->total_wanted_done);
+
+		appendf(response, ",\"%s\",\"%s\",\"%s\",\"%s\",%" PRId64 ",%" PRId64 ",\"%s\",\"%s\",%d,\"%s\"]"
+			, "", ""
+			, escape_json(std::string("Downloading")).c_str()
+			, to_hex(i->info_hash.to_string()).c_str()
+			, std::int64_t(i->added_time)
+			, std::int64_t(i->completed_time)
+			, ""
+			, escape_json(i->save_path).c_str()
+			, 0
+			, "");
+		first = 0;
+	}
+	appendf(response, "]");
+}
+
+void list_json_writer(std::vector<char>& response, std::vector<torrent_status> const& torrents)
+{
+	json_writer w(response, true);
+	w.reserve(int(torrents.size()) * 400);
+	w.key("torrents").begin_array();
+	for (std::vector<torrent_status>::const_iterator i = torrents.begin()
+		, end(torrents.end()); i != end; ++i)
+	{
+		w.begin_array()
+			.hex(i->info_hash)
+			.integer(201)
+			.string(i->name)
+			.integer(i->total_wanted)
+			.integer(i->progress_ppm / 1000)
+			.integer(i->all_time_download)
+			.integer(i->all_time_upload)
+			.number(i->all_time_download == 0 ? 0 : float(i->all_time_upload) * 1000.f / i->all_time_download)
+			.integer(i->upload_payload_rate)
+			.integer(i->download_payload_rate)
+			.integer(i->download_payload_rate == 0 ? 0 : (i->total_wanted - i->total_wanted_done) / i->download_payload_rate)
+			.string("", 0)
+			.integer(i->num_peers - i->num_seeds)
+			.integer(i->list_peers - i->list_seeds)
+			.integer(i->num_seeds)
+			.integer(i->list_seeds)
+			.integer(0)
+			.integer(i->queue_position)
+			.integer(i->total_wanted - i->total_wanted_done)
+			.string("", 0)
+			.string("", 0)
+			.string("Downloading")
+			.hex(i->info_hash)
+			.integer(i->added_time)
+			.integer(i->completed_time)
+			.string("", 0)
+			.string(i->save_path)
+			.integer(0)
+			.string("", 0)
+			.end_array();
+	}
+	w.end_array();
+}
+
+std::int64_t elapsed_us(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now() - start).count();
+}
+
+} // anonymous namespace
+
+int main(int argc, char* argv[])
+{
+	int num_torrents = 50000;
+	if (argc > 1) num_torrents = atoi(argv[1]);
+	int const rounds = 10;
+
+	std::vector<torrent_status> torrents;
+	torrents.reserve(num_torrents);
+	for (int i = 0; i < num_torrents; ++i)
+		torrents.push_back(make_status(i));
+
+	std::int64_t appendf_time = 0;
+	std::int64_t writer_time = 0;
+	std::size_t appendf_size = 0;
+	std::size_t writer_size = 0;
+	for (int r = 0; r < rounds; ++r)
+	{
+		std::vector<char> response;
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		list_appendf(response, torrents);
+		appendf_time += elapsed_us(start);
+		appendf_size = response.size();
+
+		response.clear();
+		response.shrink_to_fit();
+		start = std::chrono::steady_clock::now();
+		list_json_writer(response, torrents);
+		writer_time += elapsed_us(start);
+		writer_size = response.size();
+	}
+
+	printf("torrents: %d  rounds: %d\n", num_torrents, rounds);
+	printf("%-12s %12s %12s\n", "formatter", "time (ms)", "size (kiB)");
+	printf("%-12s %12.1f %12d\n", "appendf", appendf_time / 1000.0 / rounds
+		, int(appendf_size / 1024));
+	printf("%-12s %12.1f %12d\n", "json_writer", writer_time / 1000.0 / rounds
+		, int(writer_size / 1024));
+
+	return 0;
+}
+
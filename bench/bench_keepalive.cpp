@@ -0,0 +1,251 @@
+/*
+
+Copyright (c) 2015, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "webui.hpp"
+#include "local_mongoose.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+using namespace libtorrent;
+
+// starts a web server and connects thousands of keep-alive clients to it,
+// each polling a small API response at a fixed interval, the way web UIs
+// poll for updates. It reports the request rate, the response latency and
+// the number of threads in the process. With idle keep-alive connections
+// parked in the server's epoll set, the thread count stays at the size of
+// the worker pool regardless of the number of clients.
+
+namespace {
+
+typedef std::chrono::steady_clock clock_type;
+
+struct poll_handler : http_handler
+{
+	virtual bool handle_http(mg_connection* conn
+		, mg_request_info const* request_info)
+	{
+		if (strcmp(request_info->uri, "/poll") != 0) return false;
+		mg_printf(conn, "HTTP/1.1 200 OK\r\n"
+			"Content-Type: application/json\r\n"
+			"Content-Length: 2\r\n\r\n{}");
+		return true;
+	}
+};
+
+struct client
+{
+	client() : sock(-1), received(0), in_flight(false) {}
+	int sock;
+	int received;
+	bool in_flight;
+	clock_type::time_point sent;
+	clock_type::time_point next;
+};
+
+char const request[] = "GET /poll HTTP/1.1\r\nHost: localhost\r\n"
+	"Connection: keep-alive\r\n\r\n";
+
+int num_threads()
+{
+	FILE* f = fopen("/proc/self/status", "r");
+	if (f == NULL) return -1;
+	char line[200];
+	int ret = -1;
+	while (fgets(line, sizeof(line), f))
+	{
+		if (strncmp(line, "Threads:", 8) == 0) ret = atoi(line + 8);
+	}
+	fclose(f);
+	return ret;
+}
+
+int connect_client(int port)
+{
+	int s = socket(AF_INET, SOCK_STREAM, 0);
+	if (s < 0) return -1;
+	int one = 1;
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (connect(s, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0)
+	{
+		close(s);
+		return -1;
+	}
+	fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+	return s;
+}
+
+} // anonymous namespace
+
+int main(int argc, char* argv[])
+{
+	int num_clients = 5000;
+	int interval_ms = 1000;
+	int duration = 10;
+	int const port = 18090;
+	if (argc > 1) num_clients = atoi(argv[1]);
+	if (argc > 2) interval_ms = atoi(argv[2]);
+	if (argc > 3) duration = atoi(argv[3]);
+
+	rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+	{
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	poll_handler handler;
+	webui_base webport;
+	webport.add_handler(&handler);
+	webport.start(port);
+	if (!webport.is_running())
+	{
+		fprintf(stderr, "failed to start web server\n");
+		return 1;
+	}
+
+	int ep = epoll_create1(0);
+	std::vector<client> clients(num_clients);
+	clock_type::time_point const start = clock_type::now();
+	for (int i = 0; i < num_clients; ++i)
+	{
+		client& c = clients[i];
+		c.sock = connect_client(port);
+		if (c.sock < 0)
+		{
+			fprintf(stderr, "connect failed after %d clients: %s\n"
+				, i, strerror(errno));
+			return 1;
+		}
+		// spread the polls evenly across the interval
+		c.next = start + std::chrono::milliseconds(
+			std::int64_t(interval_ms) * i / num_clients);
+		epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.u32 = i;
+		epoll_ctl(ep, EPOLL_CTL_ADD, c.sock, &ev);
+	}
+
+	int const response_len = strlen("HTTP/1.1 200 OK\r\n"
+		"Content-Type: application/json\r\n"
+		"Content-Length: 2\r\n\r\n{}");
+
+	std::vector<int> latency;
+	int errors = 0;
+	int max_threads = num_threads();
+	clock_type::time_point const end = start + std::chrono::seconds(duration);
+	std::vector<epoll_event> events(256);
+	clock_type::time_point next_sample = start;
+	while (clock_type::now() < end)
+	{
+		clock_type::time_point const now = clock_type::now();
+		for (client& c : clients)
+		{
+			if (c.in_flight || c.sock < 0 || c.next > now) continue;
+			if (send(c.sock, request, sizeof(request) - 1, MSG_NOSIGNAL)
+				!= int(sizeof(request) - 1))
+			{
+				++errors;
+				close(c.sock);
+				c.sock = -1;
+				continue;
+			}
+			c.in_flight = true;
+			c.received = 0;
+			c.sent = now;
+			c.next += std::chrono::milliseconds(interval_ms);
+		}
+
+		int const n = epoll_wait(ep, &events[0], events.size(), 1);
+		for (int i = 0; i < n; ++i)
+		{
+			client& c = clients[events[i].data.u32];
+			char buf[1024];
+			int const ret = recv(c.sock, buf, sizeof(buf), 0);
+			if (ret <= 0)
+			{
+				if (ret < 0 && errno == EAGAIN) continue;
+				++errors;
+				close(c.sock);
+				c.sock = -1;
+				continue;
+			}
+			c.received += ret;
+			if (c.received < response_len) continue;
+			c.in_flight = false;
+			latency.push_back(int(std::chrono::duration_cast<std::chrono::microseconds>(
+				clock_type::now() - c.sent).count()));
+		}
+		if (clock_type::now() >= next_sample)
+		{
+			max_threads = (std::max)(max_threads, num_threads());
+			next_sample += std::chrono::seconds(1);
+		}
+	}
+
+	for (client& c : clients) if (c.sock >= 0) close(c.sock);
+	close(ep);
+	webport.stop();
+
+	std::sort(latency.begin(), latency.end());
+	int const num = int(latency.size());
+	printf("clients: %d  interval: %d ms  duration: %d s\n"
+		, num_clients, interval_ms, duration);
+	printf("requests: %d (%d/s)  errors: %d  max threads: %d\n"
+		, num, num / duration, errors, max_threads);
+	if (num > 0)
+	{
+		printf("latency (us)  p50: %d  p99: %d  max: %d\n"
+			, latency[num / 2], latency[num * 99 / 100], latency[num - 1]);
+	}
+
+	return 0;
+}
@@ -0,0 +1,226 @@
+/*
+
+Copyright (c) 2015, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "torrent_history.hpp"
+#include <boost/bimap.hpp>
+#include <boost/bimap/list_of.hpp>
+#include <boost/bimap/unordered_set_of.hpp>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <malloc.h>
+
+using namespace libtorrent;
+
+// compares the column store in torrent_history against the layout it
+// replaced, a boost::bimap of full torrent_status copies. It reports the
+// heap used to hold the torrents and the time it takes to scan for the
+// fields a get-torrent-updates client asks for.
+
+namespace {
+
+// the old layout
+struct row_entry
+{
+	torrent_status status;
+	int frame[torrent_history_entry::num_fields];
+	bool operator==(row_entry const& e) const { return e.status.info_hash == status.info_hash; }
+};
+
+std::size_t hash_value(row_entry const& e) { return hash_value(e.status.info_hash); }
+
+typedef boost::bimap<boost::bimaps::list_of<int>
+	, boost::bimaps::unordered_set_of<row_entry> > row_store;
+
+void update_row(row_entry& e, torrent_status const& s, int f)
+{
+#define CMP_SET(x) if (s.x != e.status.x) e.frame[int(torrent_history_entry::x)] = f;
+	TORRENT_HISTORY_FIELDS(CMP_SET)
+#undef CMP_SET
+	e.status = s;
+}
+
+std::size_t heap_in_use()
+{
+	struct mallinfo mi = mallinfo();
+	return std::size_t(unsigned(mi.uordblks)) + std::size_t(unsigned(mi.hblkhd));
+}
+
+std::int64_t elapsed_us(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now() - start).count();
+}
+
+torrent_status make_status(int i)
+{
+	torrent_status st;
+	for (int k = 0; k < 20; ++k)
+		st.info_hash[k] = (i >> ((k % 4) * 8)) ^ k;
+	char name[100];
+	snprintf(name, sizeof(name), "Some.Linux.Distribution.%d.x86_64.DVD.iso", i);
+	st.name = name;
+	st.save_path = "/srv/torrents/downloads/complete";
+	st.current_tracker = "http://tracker.example.com:6969/announce";
+	st.state = torrent_status::seeding;
+	st.progress = 1.f;
+	st.progress_ppm = 1000000;
+	st.total_wanted = st.total_wanted_done = std::int64_t(i) * 16384;
+	st.added_time = 1400000000 + i;
+	st.queue_position = i;
+	// the session posts state updates with all query flags set, which
+	// includes the piece bitfields
+	st.pieces.resize(2000, true);
+	st.verified_pieces.resize(2000, true);
+	return st;
+}
+
+} // anonymous namespace
+
+int main(int argc, char* argv[])
+{
+	int num_torrents = 100000;
+	if (argc > 1) num_torrents = atoi(argv[1]);
+	int const num_frames = 20;
+	// every frame, this fraction of the torrents (1 / n) report new rates
+	int const active_ratio = 10;
+
+	std::vector<torrent_status> torrents;
+	torrents.reserve(num_torrents);
+	for (int i = 0; i < num_torrents; ++i)
+		torrents.push_back(make_status(i));
+
+	// the fields a typical get-torrent-updates client asks for
+	torrent_history_entry::field_mask fields;
+	fields.set(torrent_history_entry::name);
+	fields.set(torrent_history_entry::state);
+	fields.set(torrent_history_entry::progress_ppm);
+	fields.set(torrent_history_entry::download_rate);
+	fields.set(torrent_history_entry::upload_rate);
+	fields.set(torrent_history_entry::num_peers);
+	fields.set(torrent_history_entry::num_seeds);
+	fields.set(torrent_history_entry::queue_position);
+
+	std::int64_t row_update = 0;
+	std::int64_t row_scan = 0;
+	std::size_t row_memory = 0;
+	{
+		std::size_t base = heap_in_use();
+		row_store store;
+		for (int i = 0; i < num_torrents; ++i)
+		{
+			row_entry e;
+			e.status = torrents[i];
+			for (int k = 0; k < torrent_history_entry::num_fields; ++k)
+				e.frame[k] = 1;
+			store.left.push_front(std::make_pair(1, e));
+		}
+		row_memory = heap_in_use() - base;
+
+		for (int f = 2; f < num_frames + 2; ++f)
+		{
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			for (int i = f % active_ratio; i < num_torrents; i += active_ratio)
+			{
+				torrent_status& st = torrents[i];
+				st.download_rate = f * 1000;
+				st.upload_rate = f * 100;
+				row_entry e;
+				e.status.info_hash = st.info_hash;
+				row_store::right_iterator it = store.right.find(e);
+				if (it == store.right.end()) continue;
+				update_row(const_cast<row_entry&>(it->first), st, f);
+				store.right.replace_data(it, f);
+				store.left.relocate(store.left.begin(), store.project_left(it));
+			}
+			row_update += elapsed_us(start);
+
+			start = std::chrono::steady_clock::now();
+			std::vector<row_entry> result;
+			for (row_store::left_const_iterator i = store.left.begin()
+				, end(store.left.end()); i != end; ++i)
+			{
+				if (i->first <= f - 1) break;
+				result.push_back(i->second);
+			}
+			row_scan += elapsed_us(start);
+		}
+	}
+
+	std::int64_t column_update = 0;
+	std::int64_t column_scan = 0;
+	std::size_t column_memory = 0;
+	int num_changed = 0;
+	{
+		std::size_t base = heap_in_use();
+		torrent_history_columns store;
+		for (int i = 0; i < num_torrents; ++i)
+			store.add(torrents[i], 1);
+		column_memory = heap_in_use() - base;
+
+		// torrent_history publishes a copy every frame, which readers may
+		// hold on to. Modifying the store then has to copy the chunks it
+		// touches
+		torrent_history_columns published = store;
+
+		for (int f = 2; f < num_frames + 2; ++f)
+		{
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			for (int i = f % active_ratio; i < num_torrents; i += active_ratio)
+			{
+				torrent_status& st = torrents[i];
+				st.download_rate = f * 1000 + 1;
+				st.upload_rate = f * 100 + 1;
+				store.update(st, f);
+			}
+			published = store;
+			column_update += elapsed_us(start);
+
+			start = std::chrono::steady_clock::now();
+			std::vector<torrent_history_entry> result;
+			published.updated_fields_since(f - 1, fields, result);
+			column_scan += elapsed_us(start);
+			num_changed = int(result.size());
+		}
+	}
+
+	printf("torrents: %d  changed per frame: %d  frames: %d\n"
+		, num_torrents, num_changed, num_frames);
+	printf("%-8s %12s %14s %14s\n", "layout", "memory (kiB)", "update (us)", "scan (us)");
+	printf("%-8s %12d %14d %14d\n", "rows", int(row_memory / 1024)
+		, int(row_update / num_frames), int(row_scan / num_frames));
+	printf("%-8s %12d %14d %14d\n", "columns", int(column_memory / 1024)
+		, int(column_update / num_frames), int(column_scan / num_frames));
+
+	return 0;
+}
+
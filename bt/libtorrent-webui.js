@@ -66,45 +66,86 @@ function _check_error(e, callback)
 	if (typeof(callback) !== 'undefined') callback(error);
 }
 
-libtorrent_connection = function(url, callback)
+function _handle_message(self, view)
 {
-	var self = this;
+	var fun = view.getUint8(0);
+	var tid = view.getUint16(1);
 
-	this._socket = new WebSocket(url);
-	this._socket.onopen = function(ev) { callback("OK"); };
-	this._socket.onerror = function(ev) { callback(ev.data); };
-	this._socket.onmessage = function(ev)
+	if (fun >= 128)
 	{
-		var view = new DataView(ev.data);
-		var fun = view.getUint8(0);
-		var tid = view.getUint16(1);
+		var e = view.getUint8(3);
+		fun &= 0x7f;
+		console.log('RESPONSE: fun: ' + fun + ' tid: ' + tid + ' error: ' + e);
 
-		if (fun >= 128)
+		if (fun == 21 && e == 0)
 		{
-			var e = view.getUint8(3);
-			fun &= 0x7f;
-			console.log('RESPONSE: fun: ' + fun + ' tid: ' + tid + ' error: ' + e);
+			// batch. The responses to the calls it carried follow, each
+			// prefixed by its size
+			var offset = 4;
+			while (offset + 4 <= view.byteLength)
+			{
+				var len = view.getUint32(offset);
+				offset += 4;
+				_handle_message(self, new DataView(view.buffer, view.byteOffset + offset, len));
+				offset += len;
+			}
+			return;
+		}
 
-			if (!self._transactions.hasOwnProperty(tid)) return;
+		if (!self._transactions.hasOwnProperty(tid)) return;
 
-			var handler = self._transactions[tid];
-			delete self._transactions[tid];
+		var handler = self._transactions[tid];
+		delete self._transactions[tid];
 
-			// this handler will deal with parsing out the remaining
-			// return value and pass it on to the user supplied
-			// callback function
-			handler(view, fun, e);
-		}
-		else
+		// this handler will deal with parsing out the remaining
+		// return value and pass it on to the user supplied
+		// callback function
+		handler(view, fun, e);
+	}
+	else
+	{
+		// This is a function call
+		switch (fun)
 		{
-			// This is a function call
-
+			case 20: // subscribe-torrent-updates
+				if (self._subscription == null) break;
+				// calls don't have an error code, the arguments
+				// start one byte earlier than in the response
+				self._subscription(_parse_torrent_updates(self, view, 3));
+				break;
 		}
+	}
+}
+
+// sends an RPC call, unless we're in the middle of building a batch, in which
+// case it's added to it
+function _send_call(self, call)
+{
+	if (self._batch != null)
+	{
+		self._batch.push(call);
+		return;
+	}
+	self._socket.send(call);
+}
 
+libtorrent_connection = function(url, callback)
+{
+	var self = this;
+
+	this._socket = new WebSocket(url);
+	this._socket.onopen = function(ev) { callback("OK"); };
+	this._socket.onerror = function(ev) { callback(ev.data); };
+	this._socket.onmessage = function(ev)
+	{
+		_handle_message(self, new DataView(ev.data));
 	};
 	this._socket.binaryType = "arraybuffer";
 	this._frame = 0;
 	this._stats_frame = 0;
+	this._file_frames = {};
+	this._subscription = null;
+	this._batch = null;
 	this._transactions = {}
 	this._tid = 0;
 }
@@ -174,7 +215,7 @@ libtorrent_connection.prototype['list_settings'] = function(callback)
 	view.setUint16(1, tid);
 
 	console.log('CALL list_settings() tid = ' + tid);
-	this._socket.send(call);
+	_send_call(this, call);
 }
 
 libtorrent_connection.prototype['get_settings'] = function(settings, callback)
@@ -257,7 +298,7 @@ libtorrent_connection.prototype['get_settings'] = function(settings, callback)
 	}
 
 	console.log('CALL get_settings( num: ' + settings.length + ' ) tid = ' + tid);
-	this._socket.send(call);
+	_send_call(this, call);
 }
 
 // settings is an object mapping settings-id -> value
@@ -346,7 +387,152 @@ libtorrent_connection.prototype['set_settings'] = function(settings, callback)
 	}
 
 	console.log('CALL set_settings( settings: ' + Object.keys(settings).length + ') tid = ' + tid);
-	this._socket.send(call);
+	_send_call(this, call);
+}
+
+// parses the torrent updates returned by get-torrent-updates, and pushed to
+// subscribers. offset is where the frame-number is
+function _parse_torrent_updates(self, view, offset)
+{
+	self._frame = view.getUint32(offset);
+	var flags = view.getUint8(offset + 4);
+	var num_torrents = view.getUint32(offset + 5);
+	var num_removed_torrents = view.getUint32(offset + 9);
+	console.log('frame: ' + self._frame + ' flags: ' + flags + ' num-torrents: ' + num_torrents + ' num-removed-torrents: ' + num_removed_torrents);
+	var ret = {};
+	offset += 13;
+	for (var i = 0; i < num_torrents; ++i)
+	{
+		var infohash = read_infohash(view, offset);
+		offset += 20;
+		var torrent = {};
+
+//			var mask_high = view.getUint32(offset);
+		offset += 4;
+		var mask_low = view.getUint32(offset);
+		offset += 4;
+
+		for (var field = 0; field < 32; ++field)
+		{
+			var mask = 1 << field;
+			if ((mask_low & mask) == 0) continue;
+			switch (field)
+			{
+				case 0: // flags
+					// skip high bytes, since we can't
+					// represent 64 bits in one field anyway
+					offset += 4;
+					torrent['flags'] = view.getUint32(offset);
+					offset += 4;
+					break;
+				case 1: // name
+					var name = read_string16(view, offset);
+					offset += 2 + name.length;
+					torrent['name'] = name;
+					break;
+				case 2: // total-uploaded
+					torrent['total-uploaded'] = read_uint64(view, offset);
+					offset += 8;
+					break;
+				case 3: // total-downloaded
+					torrent['total-downloaded'] = read_uint64(view, offset);
+					offset += 8;
+					break;
+				case 4: // added-time
+					torrent['added-time'] = read_uint64(view, offset);
+					offset += 8;
+					break;
+				case 5: // completed-time
+					torrent['completed-time'] = read_uint64(view, offset);
+					offset += 8;
+					break;
+				case 6: // upload-rate
+					torrent['upload-rate'] = view.getUint32(offset);
+					offset += 4;
+					break;
+				case 7: // download-rate
+					torrent['download-rate'] = view.getUint32(offset);
+					offset += 4;
+					break;
+				case 8: // progress
+					torrent['progress'] = view.getUint32(offset);
+					offset += 4;
+					break;
+				case 9: // error
+					var e = read_string16(view, offset);
+					offset += 2 + e.length;
+					torrent['error'] = e;
+					break;
+				case 10: // connected-peers
+					torrent['connected-peers'] = view.getUint32(offset);
+					offset += 4;
+					break;
+				case 11: // connected-seeds
+					torrent['connected-seeds'] = view.getUint32(offset);
+					offset += 4;
+					break;
+				case 12: // downloaded-pieces
+					torrent['downloaded-pieces'] = view.getUint32(offset);
+					offset += 4;
+					break;
+				case 13: // total-done
+					torrent['total-done'] = read_uint64(view, offset);
+					offset += 8;
+					break;
+				case 14: // distributed-copies
+					var integer = view.getUint32(offset);
+					offset += 4;
+					var fraction = view.getUint32(offset);
+					offset += 4;
+					torrent['distributed-copies'] = integer + (fraction / 1000.0);
+					break;
+				case 15: // all-time-upload
+					torrent['all-time-upload'] = read_uint64(view, offset);
+					offset += 8;
+					break;
+				case 16: // all-time-download
+					torrent['all-time-download'] = read_uint64(view, offset);
+					offset += 8;
+					break;
+				case 17: // unchoked-peers
+					torrent['unchoked-peers'] = view.getUint32(offset);
+					offset += 4;
+					break;
+				case 18: // num-connections
+					torrent['num-connections'] = view.getUint32(offset);
+					offset += 4;
+					break;
+				case 19: // queue-position
+					torrent['queue-position'] = view.getUint32(offset);
+					offset += 4;
+					break;
+				case 20: // state
+					torrent['state'] = view.getUint8(offset);
+					offset += 1;
+					break;
+				case 21: // failed-bytes
+					torrent['failed-bytes'] = read_uint64(view, offset);
+					offset += 8;
+					break;
+				case 22: // redundant-bytes
+					torrent['redundant-bytes'] = read_uint64(view, offset);
+					offset += 8;
+					break;
+			}
+		}
+		ret[infohash] = torrent;
+	}
+
+	var removed = [];
+	for (var i = 0; i < num_removed_torrents; ++i)
+	{
+		removed.push(read_infohash(view, offset));
+		offset += 20;
+	}
+	ret['removed'] = removed;
+	// when this is set, any torrent not in this update has been removed
+	ret['resync'] = (flags & 1) != 0;
+	return ret;
 }
 
 libtorrent_connection.prototype['get_updates'] = function(mask, callback)
@@ -368,149 +554,59 @@ libtorrent_connection.prototype['get_updates'] = function(mask, callback)
 	{
 		if (_check_error(e, callback)) return;
 
-		self._frame = view.getUint32(4);
-		var num_torrents = view.getUint32(8);
-		var num_removed_torrents = view.getUint32(12);
-		console.log('frame: ' + self._frame + ' num-torrents: ' + num_torrents + ' num-removed-torrents: ' + num_removed_torrents);
-		ret = {};
-		var offset = 16;
-		for (var i = 0; i < num_torrents; ++i)
-		{
-			var infohash = read_infohash(view, offset);
-			offset += 20;
-			var torrent = {};
+		var ret = _parse_torrent_updates(self, view, 4);
 
-//			var mask_high = view.getUint32(offset);
-			offset += 4;
-			var mask_low = view.getUint32(offset);
-			offset += 4;
+		if (typeof(callback) !== 'undefined') callback(ret);
+	};
 
-			for (var field = 0; field < 32; ++field)
-			{
-				var mask = 1 << field;
-				if ((mask_low & mask) == 0) continue;
-				switch (field)
-				{
-					case 0: // flags
-						// skip high bytes, since we can't
-						// represent 64 bits in one field anyway
-						offset += 4;
-						torrent['flags'] = view.getUint32(offset);
-						offset += 4;
-						break;
-					case 1: // name
-						var name = read_string16(view, offset);
-						offset += 2 + name.length;
-						torrent['name'] = name;
-						break;
-					case 2: // total-uploaded
-						torrent['total-uploaded'] = read_uint64(view, offset);
-						offset += 8;
-						break;
-					case 3: // total-downloaded
-						torrent['total-downloaded'] = read_uint64(view, offset);
-						offset += 8;
-						break;
-					case 4: // added-time
-						torrent['added-time'] = read_uint64(view, offset);
-						offset += 8;
-						break;
-					case 5: // completed-time
-						torrent['completed-time'] = read_uint64(view, offset);
-						offset += 8;
-						break;
-					case 6: // upload-rate
-						torrent['upload-rate'] = view.getUint32(offset);
-						offset += 4;
-						break;
-					case 7: // download-rate
-						torrent['download-rate'] = view.getUint32(offset);
-						offset += 4;
-						break;
-					case 8: // progress
-						torrent['progress'] = view.getUint32(offset);
-						offset += 4;
-						break;
-					case 9: // error
-						var e = read_string16(view, offset);
-						offset += 2 + e.length;
-						torrent['error'] = e;
-						break;
-					case 10: // connected-peers
-						torrent['connected-peers'] = view.getUint32(offset);
-						offset += 4;
-						break;
-					case 11: // connected-seeds
-						torrent['connected-seeds'] = view.getUint32(offset);
-						offset += 4;
-						break;
-					case 12: // downloaded-pieces
-						torrent['downloaded-pieces'] = view.getUint32(offset);
-						offset += 4;
-						break;
-					case 13: // total-done
-						torrent['total-done'] = read_uint64(view, offset);
-						offset += 8;
-						break;
-					case 14: // distributed-copies
-						var integer = view.getUint32(offset);
-						offset += 4;
-						var fraction = view.getUint32(offset);
-						offset += 4;
-						torrent['distributed-copies'] = integer + (fraction / 1000.0);
-						break;
-					case 15: // all-time-upload
-						torrent['all-time-upload'] = read_uint64(view, offset);
-						offset += 8;
-						break;
-					case 16: // all-time-download
-						torrent['all-time-download'] = read_uint64(view, offset);
-						offset += 8;
-						break;
-					case 17: // unchoked-peers
-						torrent['unchoked-peers'] = view.getUint32(offset);
-						offset += 4;
-						break;
-					case 18: // num-connections
-						torrent['num-connections'] = view.getUint32(offset);
-						offset += 4;
-						break;
-					case 19: // queue-position
-						torrent['queue-position'] = view.getUint32(offset);
-						offset += 4;
-						break;
-					case 20: // state
-						torrent['state'] = view.getUint8(offset);
-						offset += 1;
-						break;
-					case 21: // failed-bytes
-						torrent['failed-bytes'] = read_uint64(view, offset);
-						offset += 8;
-						break;
-					case 22: // redundant-bytes
-						torrent['redundant-bytes'] = read_uint64(view, offset);
-						offset += 8;
-						break;
-				}
-			}
-			ret[infohash] = torrent;
-		}
+	var call = new ArrayBuffer(15);
+	var view = new DataView(call);
+	// function 0
+	view.setUint8(0, 0);
+	// transaction-id
+	view.setUint16(1, tid);
+	// frame-number
+	view.setUint32(3, this._frame);
+	view.setUint32(7, 0);
+	view.setUint32(11, mask);
+
+	console.log('CALL get_updates( frame: ' + this._frame + ' mask: ' + mask.toString(16) + ' ) tid = ' + tid);
+	_send_call(this, call);
+}
+
+// the callback is called with the same updates as get_updates(), first with
+// the response to this call, and then every time the bittorrent client
+// pushes new updates. A mask of 0 cancels the subscription.
+libtorrent_connection.prototype['subscribe_updates'] = function(mask, callback)
+{
+	if (this._socket.readyState != WebSocket.OPEN)
+	{
+		window.setTimeout( function() { callback("socket closed"); }, 0);
+		return;
+	}
+
+	var tid = this._tid++;
+	if (this._tid > 65535) this._tid = 0;
 
-		var removed = [];
-		for (var i = 0; i < num_removed_torrents; ++i)
+	var self = this;
+	this._subscription = mask == 0 ? null : callback;
+	this._transactions[tid] = function(view, fun, e)
+	{
+		if (_check_error(e, callback))
 		{
-			removed.push(read_infohash(view, offset));
-			offset += 20;
+			self._subscription = null;
+			return;
 		}
-		ret['removed'] = removed;
+
+		var ret = _parse_torrent_updates(self, view, 4);
 
 		if (typeof(callback) !== 'undefined') callback(ret);
 	};
 
 	var call = new ArrayBuffer(15);
 	var view = new DataView(call);
-	// function 0
-	view.setUint8(0, 0);
+	// function 20
+	view.setUint8(0, 20);
 	// transaction-id
 	view.setUint16(1, tid);
 	// frame-number
@@ -518,7 +614,47 @@ libtorrent_connection.prototype['get_updates'] = function(mask, callback)
 	view.setUint32(7, 0);
 	view.setUint32(11, mask);
 
-	console.log('CALL get_updates( frame: ' + this._frame + ' mask: ' + mask.toString(16) + ' ) tid = ' + tid);
+	console.log('CALL subscribe_updates( frame: ' + this._frame + ' mask: ' + mask.toString(16) + ' ) tid = ' + tid);
+	_send_call(this, call);
+}
+
+// any calls made from within fun() are sent together, in a single message.
+// Their responses are also returned in a single message, and passed on to
+// the callbacks of each call
+libtorrent_connection.prototype['batch'] = function(fun)
+{
+	this._batch = [];
+	fun();
+	var calls = this._batch;
+	this._batch = null;
+
+	if (calls.length == 0) return;
+	if (this._socket.readyState != WebSocket.OPEN) return;
+
+	var size = 3;
+	for (var i = 0; i < calls.length; ++i)
+		size += 4 + calls[i].byteLength;
+
+	var tid = this._tid++;
+	if (this._tid > 65535) this._tid = 0;
+
+	var call = new ArrayBuffer(size);
+	var view = new DataView(call);
+	var bytes = new Uint8Array(call);
+	// function 21
+	view.setUint8(0, 21);
+	// transaction-id
+	view.setUint16(1, tid);
+	var offset = 3;
+	for (var i = 0; i < calls.length; ++i)
+	{
+		view.setUint32(offset, calls[i].byteLength);
+		offset += 4;
+		bytes.set(new Uint8Array(calls[i]), offset);
+		offset += calls[i].byteLength;
+	}
+
+	console.log('CALL batch( ' + calls.length + ' calls ) tid = ' + tid);
 	this._socket.send(call);
 }
 
@@ -566,7 +702,7 @@ libtorrent_connection.prototype['list_stats'] = function(callback)
 	view.setUint16(1, tid);
 
 	console.log('CALL list_stats () tid = ' + tid);
-	this._socket.send(call);
+	_send_call(this, call);
 }
 
 libtorrent_connection.prototype['get_stats'] = function(stats, callback)
@@ -628,7 +764,7 @@ libtorrent_connection.prototype['get_stats'] = function(stats, callback)
 	}
 
 	console.log('CALL get_stats () tid = ' + tid);
-	this._socket.send(call);
+	_send_call(this, call);
 }
 
 libtorrent_connection.prototype['get_file_updates'] = function(ih, callback)
@@ -651,6 +787,7 @@ libtorrent_connection.prototype['get_file_updates'] = function(ih, callback)
 		if (_check_error(e, callback)) return;
 
 		var frame = view.getUint32(4);
+		self._file_frames[ih] = frame;
 		var num_files = view.getUint32(8);
 		console.log('frame: ' + frame + ' num-files: ' + num_files);
 		ret = [];
@@ -697,6 +834,10 @@ libtorrent_connection.prototype['get_file_updates'] = function(ih, callback)
 						file['downloaded'] = read_uint64(view, offset);
 						offset += 8;
 						break;
+					case 4: // priority
+						file['priority'] = view.getUint8(offset);
+						offset += 1;
+						break;
 				}
 			}
 			ret.push(file);
@@ -720,11 +861,13 @@ libtorrent_connection.prototype['get_file_updates'] = function(ih, callback)
 		offset += 1;
 	}
 
-	// frame-number
-	view.setUint32(offset, 0);
+	// frame-number. Only files that changed since the last update of this
+	// torrent are returned
+	var frame = this._file_frames.hasOwnProperty(ih) ? this._file_frames[ih] : 0;
+	view.setUint32(offset, frame);
 
-	console.log('CALL get_file_updates() tid = ' + tid);
-	this._socket.send(call);
+	console.log('CALL get_file_updates( frame: ' + frame + ' ) tid = ' + tid);
+	_send_call(this, call);
 }
 libtorrent_connection.prototype['start'] = function(info_hashes, callback)
 { this._send_simple_call(1, info_hashes, callback); };
@@ -809,7 +952,7 @@ libtorrent_connection.prototype._send_simple_call = function(fun_id, info_hashes
 		if (typeof(callback) !== 'undefined') callback(num_torrents);
 	};
 
-	this._socket.send(call);
+	_send_call(this, call);
 }
 
 fields =
@@ -0,0 +1,295 @@
+/*
+
+Copyright (c) 2015, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "chunked_response.hpp"
+
+#include <stdio.h> // for snprintf
+#include <string.h> // for strcmp
+#include <stdlib.h> // for atof
+#include <ctype.h> // for tolower
+#include <zlib.h>
+#include <algorithm> // for min
+
+extern "C" {
+#include "local_mongoose.h"
+}
+
+namespace libtorrent
+{
+
+namespace
+{
+	bool equal_no_case(char const* a, char const* b, int len)
+	{
+		for (int i = 0; i < len; ++i)
+			if (tolower(a[i]) != tolower(b[i])) return false;
+		return true;
+	}
+
+	// returns true if the Accept-Encoding header lists the encoding,
+	// without a q-value of 0
+	bool accepts(char const* header, char const* encoding)
+	{
+		int const len = int(strlen(encoding));
+		char const* p = header;
+		while (*p)
+		{
+			while (*p == ' ' || *p == ',') ++p;
+			char const* token = p;
+			while (*p && *p != ',' && *p != ';' && *p != ' ') ++p;
+			bool const match = p - token == len && equal_no_case(token, encoding, len);
+
+			// parameters, the only one we care about is q
+			double q = 1.;
+			while (*p && *p != ',')
+			{
+				if (*p == ';')
+				{
+					++p;
+					while (*p == ' ') ++p;
+					if (*p == 'q' && p[1] == '=') q = atof(p + 2);
+					continue;
+				}
+				++p;
+			}
+			if (match) return q > 0.;
+		}
+		return false;
+	}
+
+	// a gzip and a deflate stream for every thread sending replies.
+	// They're reset between replies instead of being allocated again
+	struct thread_streams
+	{
+		thread_streams() : out(64 * 1024)
+		{
+			level[0] = level[1] = -1;
+		}
+
+		~thread_streams()
+		{
+			for (int i = 0; i < 2; ++i)
+				if (level[i] != -1) deflateEnd(&stream[i]);
+		}
+
+		// index 0 is gzip, 1 is deflate (zlib format)
+		z_stream stream[2];
+		int level[2];
+
+		// compressed output is produced into this buffer
+		std::vector<char> out;
+	};
+
+	thread_local thread_streams streams;
+
+	z_stream* get_stream(int index, int level)
+	{
+		z_stream* s = &streams.stream[index];
+		if (streams.level[index] == -1)
+		{
+			memset(s, 0, sizeof(z_stream));
+			// gzip is asked for by adding 16 to the window bits
+			int const window_bits = index == 0 ? 15 + 16 : 15;
+			if (deflateInit2(s, level, Z_DEFLATED, window_bits, 8
+				, Z_DEFAULT_STRATEGY) != Z_OK)
+				return NULL;
+			streams.level[index] = level;
+			return s;
+		}
+
+		deflateReset(s);
+		if (streams.level[index] != level)
+		{
+			if (deflateParams(s, level, Z_DEFAULT_STRATEGY) != Z_OK)
+				return NULL;
+			streams.level[index] = level;
+		}
+		return s;
+	}
+}
+
+chunked_response::chunked_response(mg_connection* conn
+	, mg_request_info const* request_info, char const* content_type
+	, http_compression const* compression, int flush_threshold)
+	: m_conn(conn)
+	, m_content_type(content_type)
+	, m_threshold(flush_threshold)
+	, m_accepted(encoding_identity)
+	, m_compress(false)
+	, m_level(0)
+	, m_min_size(0)
+	, m_zstream(NULL)
+	, m_chunked(request_info->http_version != NULL
+		&& strcmp(request_info->http_version, "1.0") != 0)
+	, m_headers_sent(false)
+	, m_finished(false)
+{
+	m_buffer.reserve(m_chunked ? flush_threshold + flush_threshold / 4 : flush_threshold);
+
+	if (compression == NULL || compression->level <= 0) return;
+	m_level = (std::min)(compression->level, 9);
+	m_min_size = compression->min_size;
+	char const* accept = mg_get_header(conn, "Accept-Encoding");
+	if (accept == NULL) return;
+	if (accepts(accept, "gzip")) m_accepted = encoding_gzip;
+	else if (accepts(accept, "deflate")) m_accepted = encoding_deflate;
+}
+
+chunked_response::~chunked_response()
+{
+	if (!m_finished) finish();
+}
+
+void chunked_response::send_headers(int content_length)
+{
+	m_headers_sent = true;
+
+	char const* encoding = "";
+	if (m_compress)
+	{
+		encoding = m_accepted == encoding_gzip
+			? "Content-Encoding: gzip\r\n"
+			: "Content-Encoding: deflate\r\n";
+	}
+	// caches must not hand a compressed reply to a client that didn't
+	// ask for it
+	char const* vary = m_level > 0 ? "Vary: Accept-Encoding\r\n" : "";
+
+	if (m_chunked)
+	{
+		mg_printf(m_conn, "HTTP/1.1 200 OK\r\n"
+			"Content-Type: %s\r\n"
+			"%s%s"
+			"Transfer-Encoding: chunked\r\n\r\n", m_content_type, encoding, vary);
+	}
+	else
+	{
+		mg_printf(m_conn, "HTTP/1.1 200 OK\r\n"
+			"Content-Type: %s\r\n"
+			"%s%s"
+			"Content-Length: %d\r\n\r\n", m_content_type, encoding, vary
+			, content_length);
+	}
+}
+
+void chunked_response::send_body(char const* buf, int len)
+{
+	if (len == 0) return;
+	if (!m_chunked)
+	{
+		m_body.insert(m_body.end(), buf, buf + len);
+		return;
+	}
+
+	char header[20];
+	int const header_len = snprintf(header, sizeof(header), "%x\r\n", len);
+	mg_write(m_conn, header, header_len);
+	mg_write(m_conn, buf, len);
+	mg_write(m_conn, "\r\n", 2);
+}
+
+void chunked_response::start_body(int size)
+{
+	m_compress = m_accepted != encoding_identity && size >= m_min_size;
+	if (m_compress)
+	{
+		m_zstream = get_stream(m_accepted == encoding_gzip ? 0 : 1, m_level);
+		// if zlib fails, the reply is sent as it is
+		if (m_zstream == NULL) m_compress = false;
+	}
+	if (m_chunked) send_headers(0);
+}
+
+void chunked_response::send_buffer(bool last)
+{
+	if (!m_compress)
+	{
+		// the whole reply is sent at once
+		if (!m_chunked && m_body.empty())
+		{
+			m_body.swap(m_buffer);
+			return;
+		}
+		if (!m_buffer.empty()) send_body(&m_buffer[0], int(m_buffer.size()));
+		m_buffer.clear();
+		return;
+	}
+
+	z_stream* s = m_zstream;
+	std::vector<char>& out = streams.out;
+	s->next_in = m_buffer.empty() ? NULL : (Bytef*)&m_buffer[0];
+	s->avail_in = m_buffer.size();
+	for (;;)
+	{
+		s->next_out = (Bytef*)&out[0];
+		s->avail_out = out.size();
+		int const ret = deflate(s, last ? Z_FINISH : Z_NO_FLUSH);
+		send_body(&out[0], int(out.size() - s->avail_out));
+		if (ret == Z_STREAM_ERROR) break;
+		if (last ? ret == Z_STREAM_END : (s->avail_in == 0 && s->avail_out != 0))
+			break;
+	}
+	m_buffer.clear();
+}
+
+void chunked_response::flush()
+{
+	// without chunked encoding, nothing can be sent until we know the
+	// size of the whole reply
+	if (!m_chunked || m_buffer.empty()) return;
+
+	if (!m_headers_sent) start_body(int(m_buffer.size()));
+	send_buffer(false);
+}
+
+void chunked_response::finish()
+{
+	if (m_finished) return;
+	m_finished = true;
+
+	if (!m_headers_sent) start_body(int(m_buffer.size()));
+	send_buffer(true);
+
+	if (!m_chunked)
+	{
+		send_headers(int(m_body.size()));
+		if (!m_body.empty()) mg_write(m_conn, &m_body[0], m_body.size());
+		m_body.clear();
+		return;
+	}
+
+	// the last chunk is empty
+	mg_write(m_conn, "0\r\n\r\n", 5);
+}
+
+}
+
@@ -0,0 +1,134 @@
+/*
+
+Copyright (c) 2015, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_CHUNKED_RESPONSE_HPP
+#define TORRENT_CHUNKED_RESPONSE_HPP
+
+#include <vector>
+#include <cstddef> // for NULL
+
+struct mg_connection;
+struct mg_request_info;
+struct z_stream_s;
+
+namespace libtorrent
+{
+	// how replies are compressed, for clients that send Accept-Encoding
+	// with gzip or deflate
+	struct http_compression
+	{
+		http_compression() : level(6), min_size(1024) {}
+
+		// the zlib compression level, 1-9. 0 turns compression off
+		int level;
+
+		// replies smaller than this are sent uncompressed
+		int min_size;
+	};
+
+	// a 200 reply that's sent while it's being generated. Handlers append
+	// to buffer(), and once it has grown past the flush threshold,
+	// maybe_flush() sends it as one chunk (Transfer-Encoding: chunked) and
+	// empties it. This bounds the memory used per request and gets the
+	// first bytes out before the whole reply is formatted.
+	// HTTP/1.0 clients don't understand chunked encoding. For them, the
+	// whole reply is buffered and sent with a Content-Length.
+	// If compression is enabled and the client accepts it, the reply is
+	// compressed as it's sent, using zlib streams that are kept per thread
+	// and reused from one reply to the next.
+	struct chunked_response
+	{
+		chunked_response(mg_connection* conn, mg_request_info const* request_info
+			, char const* content_type, http_compression const* compression = NULL
+			, int flush_threshold = 64 * 1024);
+		~chunked_response();
+
+		std::vector<char>& buffer() { return m_buffer; }
+
+		// sends the buffer if it's grown past the threshold
+		void maybe_flush()
+		{
+			if (int(m_buffer.size()) >= m_threshold) flush();
+		}
+
+		// sends the rest of the buffer and ends the reply. This is also
+		// done by the destructor, if it hasn't been called
+		void finish();
+
+		// the number of bytes the buffer is flushed at
+		int flush_threshold() const { return m_threshold; }
+
+	private:
+
+		enum encoding_t { encoding_identity, encoding_gzip, encoding_deflate };
+
+		// decides whether to compress, now that we know the reply is at
+		// least size bytes
+		void start_body(int size);
+
+		void flush();
+		void send_headers(int content_length);
+
+		// sends the buffer, compressed if we decided to compress
+		void send_buffer(bool last);
+
+		// sends a piece of the body, framed as a chunk if we're chunking,
+		// otherwise it's held in m_body until the size is known
+		void send_body(char const* buf, int len);
+
+		mg_connection* m_conn;
+		char const* m_content_type;
+		std::vector<char> m_buffer;
+		int m_threshold;
+
+		// the encoding the client accepts, and whether we've decided to use
+		// it. That's decided once the headers are sent
+		encoding_t m_accepted;
+		bool m_compress;
+		int m_level;
+		int m_min_size;
+
+		// this thread's zlib stream, if we're compressing
+		z_stream_s* m_zstream;
+
+		// the body, when it can't be chunked and has to be sent in one go
+		std::vector<char> m_body;
+
+		// false for clients that can't take chunked encoding
+		bool m_chunked;
+		bool m_headers_sent;
+		bool m_finished;
+	};
+}
+
+#endif
+
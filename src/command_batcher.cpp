@@ -0,0 +1,151 @@
+/*
+
+Copyright (c) 2015, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "command_batcher.hpp"
+
+#include "libtorrent/session.hpp"
+#include "libtorrent/torrent.hpp"
+#include "libtorrent/aux_/session_interface.hpp"
+#include <boost/bind.hpp>
+#include <limits>
+#include <algorithm>
+
+namespace libtorrent
+{
+	namespace
+	{
+		// runs on the network thread
+		void apply(boost::shared_ptr<std::vector<command_batcher::command> > cmds)
+		{
+			for (std::vector<command_batcher::command>::const_iterator i = cmds->begin()
+				, end(cmds->end()); i != end; ++i)
+			{
+				shared_ptr<torrent> t = i->handle.native_handle();
+				if (!t) continue;
+
+				int const a = i->actions;
+				if (a & command_batcher::clear_error) t->clear_error();
+				if (a & command_batcher::clear_upload_mode) t->set_upload_mode(false);
+				if (a & command_batcher::set_auto_managed) t->auto_managed(true);
+				if (a & command_batcher::clear_auto_managed) t->auto_managed(false);
+				if (a & command_batcher::set_sequential) t->set_sequential_download(true);
+				if (a & command_batcher::clear_sequential) t->set_sequential_download(false);
+
+				if (!i->file_prio.empty() || i->all_file_prio != -1)
+				{
+					std::vector<int> prio;
+					t->file_priorities(&prio);
+					if (i->all_file_prio != -1)
+						std::fill(prio.begin(), prio.end(), i->all_file_prio);
+					for (std::vector<std::pair<int, int> >::const_iterator j
+						= i->file_prio.begin(), end(i->file_prio.end()); j != end; ++j)
+					{
+						if (j->first < 0 || j->first >= int(prio.size())) continue;
+						prio[j->first] = j->second;
+					}
+					t->prioritize_files(prio);
+				}
+
+				if (a & command_batcher::force_recheck) t->force_recheck();
+				if (a & command_batcher::pause_torrent) t->pause();
+				if (a & command_batcher::resume_torrent) t->resume();
+
+				// torrents that aren't queued (seeds) have position -1
+				int const pos = t->queue_position();
+				if (pos >= 0)
+				{
+					if (a & command_batcher::queue_up) t->set_queue_position(pos == 0 ? 0 : pos - 1);
+					if (a & command_batcher::queue_down) t->set_queue_position(pos + 1);
+					if (a & command_batcher::queue_top) t->set_queue_position(0);
+					if (a & command_batcher::queue_bottom)
+						t->set_queue_position((std::numeric_limits<int>::max)());
+				}
+
+				if (a & command_batcher::remove_torrent)
+				{
+					t->session().remove_torrent(i->handle
+						, (a & command_batcher::delete_files) ? session::delete_files : 0);
+				}
+			}
+		}
+	}
+
+	command_batcher::command_batcher()
+		: m_commands(new std::vector<command>)
+	{}
+
+	command_batcher::~command_batcher()
+	{
+		flush();
+	}
+
+	command_batcher::command& command_batcher::get(torrent_handle const& h)
+	{
+		// requests list each torrent once, so it's enough to merge with the
+		// last command
+		if (m_commands->empty() || m_commands->back().handle != h)
+		{
+			m_commands->push_back(command());
+			m_commands->back().handle = h;
+		}
+		return m_commands->back();
+	}
+
+	void command_batcher::add(torrent_handle const& h, int actions)
+	{
+		get(h).actions |= actions;
+	}
+
+	void command_batcher::prioritize_files(torrent_handle const& h
+		, std::vector<std::pair<int, int> > const& prio, int all)
+	{
+		command& c = get(h);
+		c.file_prio.insert(c.file_prio.end(), prio.begin(), prio.end());
+		if (all != -1) c.all_file_prio = all;
+	}
+
+	void command_batcher::flush()
+	{
+		if (m_commands->empty()) return;
+
+		// the torrents' session is the one whose io_service runs the
+		// network thread. Any torrent still alive will do
+		shared_ptr<torrent> t;
+		for (std::vector<command>::iterator i = m_commands->begin()
+			, end(m_commands->end()); i != end && !t; ++i)
+			t = i->handle.native_handle();
+
+		if (t) t->session().get_io_service().post(boost::bind(&apply, m_commands));
+		m_commands.reset(new std::vector<command>);
+	}
+}
+
@@ -0,0 +1,107 @@
+/*
+
+Copyright (c) 2015, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_COMMAND_BATCHER_HPP
+#define TORRENT_COMMAND_BATCHER_HPP
+
+#include "libtorrent/torrent_handle.hpp"
+#include <boost/shared_ptr.hpp>
+#include <vector>
+#include <utility>
+
+namespace libtorrent
+{
+	// collects the actions a request applies to its torrents, and applies
+	// all of them on the network thread in a single posted job. Every
+	// torrent_handle call posts a job of its own, so stopping thousands of
+	// torrents one call at a time means thousands of wake-ups of the network
+	// thread. The job is posted by flush(), or when the batcher is destructed.
+	struct command_batcher
+	{
+		// actions are applied in the order they are declared here, regardless
+		// of the order they were added in
+		enum action_t
+		{
+			clear_error = 0x1,
+			clear_upload_mode = 0x2,
+			set_auto_managed = 0x4,
+			clear_auto_managed = 0x8,
+			set_sequential = 0x10,
+			clear_sequential = 0x20,
+			force_recheck = 0x40,
+			pause_torrent = 0x80,
+			resume_torrent = 0x100,
+			queue_up = 0x200,
+			queue_down = 0x400,
+			queue_top = 0x800,
+			queue_bottom = 0x1000,
+			remove_torrent = 0x2000,
+			// together with remove_torrent, also deletes the torrent's files
+			delete_files = 0x4000
+		};
+
+		command_batcher();
+		~command_batcher();
+
+		// adds the action_t flags in actions to the torrent
+		void add(torrent_handle const& h, int actions);
+
+		// sets the priority of the files in prio, as (file, priority) pairs.
+		// Files out of range are ignored. If all is not -1, all other files
+		// are set to that priority. The torrent's current priorities are
+		// read on the network thread, so the torrent gets a single
+		// prioritize_files() call
+		void prioritize_files(torrent_handle const& h
+			, std::vector<std::pair<int, int> > const& prio, int all = -1);
+
+		// posts the job for everything added so far
+		void flush();
+
+		struct command
+		{
+			command() : actions(0), all_file_prio(-1) {}
+			torrent_handle handle;
+			int actions;
+			std::vector<std::pair<int, int> > file_prio;
+			int all_file_prio;
+		};
+
+	private:
+
+		command& get(torrent_handle const& h);
+
+		boost::shared_ptr<std::vector<command> > m_commands;
+	};
+}
+
+#endif
+
@@ -36,7 +36,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <mutex>
 
 #include "libtorrent/session.hpp"
-#include "libtorrent/session_status.hpp"
+#include "stats_sampler.hpp"
 #include "libtorrent/torrent_info.hpp"
 #include "libtorrent/socket.hpp"
 #include "libtorrent/io.hpp"
@@ -60,9 +60,12 @@ enum rpc_type_t
 	RPC_EVENT = 3
 };
 
-deluge::deluge(session& s, std::string pem_path, auth_interface const* auth)
+deluge::deluge(session& s, std::string pem_path, stats_sampler const* stats
+	, auth_interface const* auth, torrent_limits const* limits)
 	: m_ses(s)
+	, m_stats(stats)
 	, m_auth(auth)
+	, m_limits(limits)
 	, m_listen_socket(nullptr)
 	, m_context(m_ios, boost::asio::ssl::context::sslv23)
 	, m_shutdown(false)
@@ -458,12 +461,12 @@ void deluge::handle_get_num_connections(conn_state* st)
 
 	// [ RPC_RESPONSE, req-id, [num-connections] ]
 
-	session_status sst = m_ses.status();
+	std::shared_ptr<stats_sample const> sst = m_stats->sample();
 
 	out.append_list(3);
 	out.append_int(RPC_RESPONSE);
 	out.append_int(id);
-	out.append_int(sst.num_peers);
+	out.append_int(sst->num_peers);
 }
 
 char const* deluge_state_str(torrent_status const& st)
@@ -658,16 +661,16 @@ void deluge::handle_get_torrents_status(conn_state* st)
 		MAYBE_ADD(out.append_bool(i->is_finished));
 
 		MAYBE_ADD(out.append_int(i->connections_limit));
-		MAYBE_ADD(out.append_int(i->handle.download_limit()));
+		MAYBE_ADD(out.append_int(torrent_limits::get(m_limits, i->handle).download_limit));
 		MAYBE_ADD(out.append_int(i->uploads_limit));
-		MAYBE_ADD(out.append_int(i->handle.upload_limit()));
+		MAYBE_ADD(out.append_int(torrent_limits::get(m_limits, i->handle).upload_limit));
 		MAYBE_ADD(out.append_string(i->error));
 
 		MAYBE_ADD(out.append_string("")); // move on completed path
 		MAYBE_ADD(out.append_bool(false)); // move on completed
 		MAYBE_ADD(out.append_string("")); // move completed path
 		MAYBE_ADD(out.append_bool(false)); // move completed
-		MAYBE_ADD(out.append_string(i->handle.name()));
+		MAYBE_ADD(out.append_string(i->name));
 
 		MAYBE_ADD(out.append_int(total_seconds(i->next_announce)));
 		MAYBE_ADD(out.append_int(i->num_peers));
@@ -678,7 +681,7 @@ void deluge::handle_get_torrents_status(conn_state* st)
 		MAYBE_ADD(out.append_float(i->progress));
 		MAYBE_ADD(out.append_int(i->queue_position));
 		MAYBE_ADD(out.append_bool(false)); // remove at ratio
-		MAYBE_ADD(out.append_string(i->handle.save_path()));
+		MAYBE_ADD(out.append_string(i->save_path));
 		MAYBE_ADD(out.append_int(i->seeding_time));
 
 		MAYBE_ADD(out.append_int(0)); // seeds peers ratio
@@ -814,7 +817,7 @@ void deluge::handle_get_filter_tree(conn_state* st)
 
 	int id = tokens[1].integer(buf);
 
-	session_status sst = m_ses.status();
+	std::shared_ptr<stats_sample const> sst = m_stats->sample();
 
 	out.append_list(3);
 	out.append_int(RPC_RESPONSE);
@@ -825,11 +828,11 @@ void deluge::handle_get_filter_tree(conn_state* st)
 
 	out.append_list(2);
 	out.append_string("All");
-	out.append_int(sst.num_torrents);
+	out.append_int(sst->num_torrents);
 
 	out.append_list(2);
 	out.append_string("Paused");
-	out.append_int(sst.num_paused_torrents);
+	out.append_int(sst->num_paused_torrents);
 }
 
 void deluge::handle_get_config_values(conn_state* st)
@@ -884,7 +887,7 @@ void deluge::handle_get_session_status(conn_state* st)
 	int num_keys = keys->num_items();
 	++keys;
 
-	session_status sst = m_ses.status();
+	std::shared_ptr<stats_sample const> sst = m_stats->sample();
 
 	out.append_list(3);
 	out.append_int(RPC_RESPONSE);
@@ -898,19 +901,19 @@ void deluge::handle_get_session_status(conn_state* st)
 		out.append_string(k);
 
 		if (k == "payload_upload_rate")
-			out.append_int(sst.payload_upload_rate);
+			out.append_int(sst->payload_upload_rate);
 		else if (k == "payload_download_rate")
-			out.append_int(sst.payload_download_rate);
+			out.append_int(sst->payload_download_rate);
 		else if (k == "payload_download_rate")
-			out.append_int(sst.payload_download_rate);
+			out.append_int(sst->payload_download_rate);
 		else if (k == "download_rate")
-			out.append_int(sst.download_rate);
+			out.append_int(sst->download_rate);
 		else if (k == "upload_rate")
-			out.append_int(sst.upload_rate);
+			out.append_int(sst->upload_rate);
 		else if (k == "has_incoming_connections")
-			out.append_bool(sst.has_incoming_connections);
+			out.append_bool(sst->has_incoming_connections);
 		else if (k == "dht_nodes")
-			out.append_int(sst.dht_nodes);
+			out.append_int(sst->dht_nodes);
 		else
 			out.append_none();
 	}
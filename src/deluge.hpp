@@ -41,6 +41,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/socket.hpp"
 #include "libtorrent/io_service.hpp"
 #include "libtorrent/settings_pack.hpp"
+#include "torrent_limits.hpp"
 
 #include <boost/asio/ssl.hpp>
 
@@ -53,10 +54,13 @@ namespace libtorrent
 	struct rencoder;
 	struct permissions_interface;
 	struct auth_interface;
+	struct stats_sampler;
 
 	struct deluge
 	{
-		deluge(session& s, std::string pem_path, auth_interface const* auth = NULL);
+		deluge(session& s, std::string pem_path, stats_sampler const* stats
+			, auth_interface const* auth = NULL
+			, torrent_limits const* limits = NULL);
 		~deluge();
 
 		void start(int port);
@@ -104,7 +108,9 @@ namespace libtorrent
 		void on_accept(error_code const& ec, ssl_socket* sock);
 
 		session& m_ses;
+		stats_sampler const* m_stats;
 		auth_interface const* m_auth;
+		torrent_limits const* m_limits;
 		add_torrent_params m_params_model;
 		io_service m_ios;
 		tcp::acceptor* m_listen_socket;
@@ -32,6 +32,9 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include "webui.hpp"
 #include "file_downloader.hpp"
+#include "file_requests.hpp"
+#include "piece_cache.hpp"
+#include "priority_arbiter.hpp"
 #include "no_auth.hpp"
 #include "auth.hpp"
 
@@ -43,10 +46,13 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/aux_/escape_string.hpp" // for escape_string
 
 #include <boost/shared_array.hpp>
+#include <algorithm> // for sort
 #include <map>
-#include <queue>
+#include <set>
 #include <mutex>
-#include <condition_variable>
+#include <atomic>
+#include <fcntl.h> // for open
+#include <unistd.h> // for close
 
 extern "C" {
 #include "local_mongoose.h"
@@ -54,31 +60,96 @@ extern "C" {
 
 namespace libtorrent
 {
-	struct piece_entry
+	// sizes the read-ahead window of a stream and spaces out its piece
+	// deadlines. It measures the rate the client reads the stream at, and
+	// the rate the swarm delivers pieces at. The window covers the next few
+	// seconds of reading, but no more than the swarm can deliver in that
+	// time, to not hog the swarm for pieces that won't be needed for a while.
+	struct read_ahead
 	{
-		boost::shared_array<char> buffer;
-		int size;
-		int piece;
-		// we want ascending order!
-		bool operator<(piece_entry const& rhs) const { return piece > rhs.piece; }
-	};
+		read_ahead(int piece_size, int max_window)
+			: consume_rate(0)
+			, delivery_rate(0)
+			, m_piece_size(piece_size)
+			, m_max_window(max_window)
+			, m_consumed(0)
+			, m_delivered(0)
+			, m_consume_start(clock_type::now())
+			, m_delivery_start(m_consume_start)
+		{}
+
+		// the number of seconds of the stream to keep requested ahead of
+		// the client
+		enum { lead_seconds = 8 };
+
+		// called when bytes have been written to the client
+		void sent(std::int64_t bytes, time_point now)
+		{
+			m_consumed += bytes;
+			update(consume_rate, m_consumed, m_consume_start, now);
+		}
 
-	struct torrent_piece_queue
-	{
-		// this is the range of pieces we're interested in
-		int begin;
-		int end;
-		// end may not progress past this. This is end of file
-		// or end of request
-		int finish;
-		std::priority_queue<piece_entry> queue;
-		std::condition_variable cond;
-		std::mutex queue_mutex;
+		// called when a piece posted by libtorrent at the given time was
+		// picked up
+		void delivered(int bytes, time_point received)
+		{
+			m_delivered += bytes;
+			update(delivery_rate, m_delivered, m_delivery_start, received);
+		}
+
+		// the number of pieces to keep requested ahead of the one the client
+		// is reading
+		int window() const
+		{
+			std::int64_t rate = consume_rate;
+			if (delivery_rate > 0 && (rate == 0 || delivery_rate < rate))
+				rate = delivery_rate;
+
+			// until we know anything, ask for a few MiB to get started
+			std::int64_t bytes = rate > 0 ? rate * lead_seconds : 4 * 1024 * 1024;
+			bytes = (std::min)(bytes, std::int64_t(m_max_window));
+			return (std::max)(int(bytes / m_piece_size), 2);
+		}
+
+		// the deadline, in milliseconds from now, of the piece that is
+		// distance pieces ahead of the one the client is reading
+		int deadline(int distance) const
+		{
+			// we don't know how fast the client reads yet
+			if (consume_rate == 0) return 100 * distance;
+			return int(std::int64_t(distance) * m_piece_size * 1000 / consume_rate);
+		}
+
+		// bytes per second, or 0 if not known yet
+		int consume_rate;
+		int delivery_rate;
+
+	private:
+
+		// folds the bytes accumulated since start into rate, once the
+		// sample covers at least half a second
+		static void update(int& rate, std::int64_t& bytes, time_point& start, time_point now)
+		{
+			int const ms = total_milliseconds(now - start);
+			if (ms < 500) return;
+			int const sample = int(bytes * 1000 / ms);
+			rate = rate == 0 ? sample : (rate * 3 + sample) / 4;
+			bytes = 0;
+			start = now;
+		}
+
+		int m_piece_size;
+		int m_max_window;
+		std::int64_t m_consumed;
+		std::int64_t m_delivered;
+		time_point m_consume_start;
+		time_point m_delivery_start;
 	};
 
 	struct request_t
 	{
-		request_t(std::string filename, std::set<request_t*>& list, std::mutex& m)
+		request_t(std::string filename, std::set<request_t*>& list, std::mutex& m
+			, int piece_size, int max_window)
 			: start_time(clock_type::now())
 			, file(filename)
 			, request_size(0)
@@ -87,6 +158,9 @@ namespace libtorrent
 			, bytes_sent(0)
 			, piece(-1)
 			, state(0)
+			, window(0)
+			, ra(piece_size, max_window)
+			, cancelled(false)
 			, m_requests(list)
 			, m_mutex(m)
 		{
@@ -124,9 +198,10 @@ namespace libtorrent
 			invprogress[pos_end] = 0;
 			suffix[progress_width-start-pos-pos_end] = 0;
 
-			printf("%4.1f [%s%s%s%s] [p: %4d] [s: %d] %s\n"
+			printf("%4.1f [%s%s%s%s] [p: %4d] [s: %d] [w: %3d] [c: %6d kB/s] [d: %6d kB/s] %s\n"
 				, total_milliseconds(now - start_time) / 1000.f
-				, prefix, progress, invprogress, suffix, piece, state, file.c_str());
+				, prefix, progress, invprogress, suffix, piece, state, window
+				, ra.consume_rate / 1000, ra.delivery_rate / 1000, file.c_str());
 		}
 
 		enum state_t
@@ -143,103 +218,272 @@ namespace libtorrent
 		int piece;
 		int state;
 
+		// the number of pieces requested ahead of the client
+		int window;
+		read_ahead ra;
+
+		// set by cancel_all(). The stream stops at the next piece, or
+		// within a second if it's waiting for one
+		std::atomic<bool> cancelled;
+
 	private:
 		std::set<request_t*>& m_requests;
 		std::mutex& m_mutex;
 	};
 
-	// TODO: replace this with file_requests class
-	struct piece_alert_dispatch : plugin
+	namespace
 	{
-		void on_alert(alert const* a)
+		// a piece is in the have bitfield as soon as it passed the hash
+		// check, which may be before libtorrent has flushed it from its
+		// write cache to the file. This clears those pieces from have, to
+		// have them read with read_piece instead. The cache is queried
+		// after the status, so a piece that's flushed in between is fine
+		void clear_unflushed(session& ses, torrent_handle const& h, bitfield& have)
 		{
-			read_piece_alert const* p = alert_cast<read_piece_alert>(a);
-			if (p == NULL) return;
-
-//			fprintf(stderr, "piece: %d\n", p->piece);
-
-			std::unique_lock<std::mutex> l(m_mutex);
-			typedef std::multimap<sha1_hash, torrent_piece_queue*>::iterator iter;
-			shared_ptr<torrent> t = p->handle.native_handle();
-
-			std::pair<iter, iter> range = m_torrents.equal_range(t->info_hash());
-			if (range.first == m_torrents.end()) return;
+			cache_status cs;
+			ses.get_cache_info(&cs, h);
+			for (std::vector<cached_piece_info>::const_iterator i = cs.pieces.begin()
+				, end(cs.pieces.end()); i != end; ++i)
+			{
+				if (i->kind != cached_piece_info::write_cache) continue;
+				if (i->piece < have.size()) have.clear_bit(i->piece);
+			}
+		}
 
-			for (iter i = range.first; i != range.second; ++i)
+		// the number of milliseconds a stream waits for a piece before
+		// asking for it again. Pieces keep their priority for as long as
+		// they're asked for, so this bounds how long they keep it after the
+		// client goes away
+		int const piece_timeout = 20000;
+
+		// asks for the pieces in wanted, which are (piece, deadline) pairs
+		// in piece order. Runs of consecutive pieces are asked for in one
+		// go. file_requests answers straight from the cache for pieces
+		// another stream already read. The others get their deadline
+		// claimed, and are added to claimed, to be released once the piece
+		// arrives, or when the stream ends
+		void request_pieces(file_requests& requests, priority_arbiter& arbiter
+			, torrent_handle const& h, std::vector<std::pair<int, int> > const& wanted
+			, std::map<int, std::shared_future<piece_entry> >& reads
+			, std::set<int>& claimed)
+		{
+			int i = 0;
+			while (i < int(wanted.size()))
 			{
-				std::unique_lock<std::mutex> l2(i->second->queue_mutex);
-				if (p->piece < i->second->begin || p->piece >= i->second->end)
-					continue;
-				piece_entry pe;
-				pe.buffer = p->buffer;
-				pe.piece = p->piece;
-				pe.size = p->size;
+				int n = 1;
+				while (i + n < int(wanted.size())
+					&& wanted[i + n].first == wanted[i].first + n)
+					++n;
+
+				std::vector<std::shared_future<piece_entry> > f
+					= requests.read_pieces(h, wanted[i].first, n, piece_timeout);
+				for (int k = 0; k < n; ++k, ++i)
+				{
+					int const piece = wanted[i].first;
+					reads[piece] = f[k];
+					if (f[k].wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+						continue;
 
-				i->second->queue.push(pe);
-				if (pe.piece == i->second->begin)
-					i->second->cond.notify_all();
+					// file_requests reads the piece once it's downloaded,
+					// libtorrent doesn't have to
+					arbiter.claim_deadline(h, piece, wanted[i].second, 0);
+					claimed.insert(piece);
+				}
 			}
 		}
 
-		void subscribe(sha1_hash const& ih, torrent_piece_queue* pq)
+		// writes the whole buffer to the client. Returns false if the
+		// connection failed
+		bool write_all(mg_connection* conn, char const* buf, int len)
 		{
-			std::unique_lock<std::mutex> l(m_mutex);
-			m_torrents.insert(std::make_pair(ih, pq));
+			while (len > 0)
+			{
+				int const ret = mg_write(conn, buf, len);
+				if (ret <= 0)
+				{
+					fprintf(stderr, "interrupted (%d) errno: (%d) %s\n", ret, errno
+						, strerror(errno));
+					if (ret < 0 && errno == EAGAIN) {
+						usleep(100000);
+						continue;
+					}
+					return false;
+				}
+				buf += ret;
+				len -= ret;
+			}
+			return true;
 		}
 
-		// if the pieces pointer is specified, it's filled in with pieces
-		// that were part of the 'pq' request, and are also still parts of
-		// other requests, that are still outstanding
-		void unsubscribe(sha1_hash const& ih, torrent_piece_queue* pq
-			, std::set<int>* pieces = NULL)
+		// sends the byte ranges of a request as the pieces covering them
+		// come in. With more than one range, each one is sent as a part of a
+		// multipart/byteranges body
+		struct range_sender
 		{
-			std::unique_lock<std::mutex> l(m_mutex);
-			typedef std::multimap<sha1_hash, torrent_piece_queue*>::iterator iter;
+			range_sender(std::vector<std::pair<std::int64_t, std::int64_t> > const& r
+				, std::int64_t size, char const* type, std::string const& b)
+				: ranges(r)
+				, cur(0)
+				, pos(r.front().first)
+				, file_size(size)
+				, content_type(type)
+				, boundary(b)
+			{}
+
+			bool multipart() const { return ranges.size() > 1; }
+			bool done() const { return cur == int(ranges.size()); }
+
+			// the header preceding part i of a multipart body
+			std::string part_header(int i) const
+			{
+				char buf[300];
+				snprintf(buf, sizeof(buf), "\r\n--%s\r\n"
+					"Content-Type: %s\r\n"
+					"Content-Range: bytes %" PRId64 "-%" PRId64 "/%" PRId64 "\r\n\r\n"
+					, boundary.c_str(), content_type, ranges[i].first
+					, ranges[i].second, file_size);
+				return buf;
+			}
 
-			std::pair<iter, iter> range = m_torrents.equal_range(ih);
-			if (range.first == m_torrents.end()) return;
+			std::string trailer() const
+			{ return "\r\n--" + boundary + "--\r\n"; }
 
-			iter to_delete = m_torrents.end();
+			// the size of the response body
+			std::int64_t content_length() const
+			{
+				std::int64_t ret = 0;
+				for (int i = 0; i < int(ranges.size()); ++i)
+				{
+					ret += ranges[i].second - ranges[i].first + 1;
+					if (multipart()) ret += part_header(i).size();
+				}
+				if (multipart()) ret += trailer().size();
+				return ret;
+			}
 
-			for (iter i = range.first; i != range.second; ++i)
+			// sends what the ranges cover of the file up to end. The data
+			// comes either from buf, holding the file starting at
+			// buf_start, or from the open file fd
+			bool send(mg_connection* conn, request_t& r, std::int64_t end
+				, char const* buf, std::int64_t buf_start, int fd)
 			{
-				if (i->second != pq)
+				while (!done() && pos < end)
 				{
-					if (pieces)
+					if (multipart() && pos == ranges[cur].first)
 					{
-						for (int k = (std::max)(pq->begin, i->second->begin)
-							, end((std::min)(pq->end, i->second->end)); k < end; ++k)
-						{
-							pieces->insert(k);
-						}
+						std::string const h = part_header(cur);
+						if (!write_all(conn, h.c_str(), h.size())) return false;
+					}
+
+					std::int64_t const n = (std::min)(ranges[cur].second + 1, end) - pos;
+					r.state = request_t::writing_to_socket;
+					if (buf)
+					{
+						TORRENT_ASSERT(pos >= buf_start);
+						if (!write_all(conn, buf + (pos - buf_start), n)) return false;
+					}
+					else if (mg_write_file(conn, fd, pos, n) != n)
+					{
+						fprintf(stderr, "interrupted, errno: (%d) %s\n", errno
+							, strerror(errno));
+						return false;
+					}
+					TORRENT_ASSERT(r.bytes_sent + n <= r.request_size);
+					r.bytes_sent += n;
+					r.ra.sent(n, clock_type::now());
+					r.state = request_t::waiting_for_libtorrent;
+					pos += n;
+
+					if (pos <= ranges[cur].second) continue;
+					++cur;
+					if (!done())
+					{
+						pos = ranges[cur].first;
+					}
+					else if (multipart())
+					{
+						std::string const t = trailer();
+						if (!write_all(conn, t.c_str(), t.size())) return false;
 					}
-					continue;
 				}
+				return true;
+			}
 
-				to_delete = i;
+			std::vector<std::pair<std::int64_t, std::int64_t> > const& ranges;
+			// the range being sent
+			int cur;
+			// the next byte of the file to send
+			std::int64_t pos;
+			std::int64_t file_size;
+			char const* content_type;
+			std::string boundary;
+		};
+	}
 
-				// if we want to know the pieces that are still in use, we need to
-				// continue and iterate over all other torrents
-				if (!pieces) break;
-			}
+	bool parse_ranges(char const* header, std::int64_t file_size
+		, std::vector<std::pair<std::int64_t, std::int64_t> >& ranges)
+	{
+		if (header == NULL) return false;
+		header = strstr(header, "bytes=");
+		if (header == NULL) return false;
+		header += 6; // skip bytes=
 
-			if (to_delete != m_torrents.end())
-				m_torrents.erase(to_delete);
-		}
+		bool valid = false;
+		while (*header != '\0')
+		{
+			while (*header == ' ' || *header == ',') ++header;
+			if (*header == '\0') break;
 
-	private:
+			char const* divider = strchr(header, '-');
+			if (divider == NULL) return false;
+			valid = true;
+
+			std::int64_t first;
+			std::int64_t last = file_size - 1;
+			if (divider == header)
+			{
+				// a suffix range, the last n bytes of the file
+				first = file_size - strtoll(divider + 1, NULL, 10);
+				if (first < 0) first = 0;
+			}
+			else
+			{
+				first = strtoll(header, NULL, 10);
+				// if the end of a range is not specified, the end of file
+				// is implied
+				if (divider[1] != '\0' && divider[1] != ',')
+					last = (std::min)(last, std::int64_t(strtoll(divider + 1, NULL, 10)));
+			}
 
-		std::mutex m_mutex;
-		std::multimap<sha1_hash, torrent_piece_queue*> m_torrents;
+			if (first <= last && first < file_size)
+				ranges.push_back(std::make_pair(first, last));
 
-	};
+			header = strchr(divider, ',');
+			if (header == NULL) break;
+		}
+
+		// serve the ranges in file order, in a single pass. Overlapping
+		// and adjacent ranges are merged
+		std::sort(ranges.begin(), ranges.end());
+		std::vector<std::pair<std::int64_t, std::int64_t> > merged;
+		for (int i = 0; i < int(ranges.size()); ++i)
+		{
+			if (!merged.empty() && ranges[i].first <= merged.back().second + 1)
+				merged.back().second = (std::max)(merged.back().second, ranges[i].second);
+			else
+				merged.push_back(ranges[i]);
+		}
+		ranges.swap(merged);
+		return valid;
+	}
 
-	file_downloader::file_downloader(session& s, auth_interface const* auth)
+	file_downloader::file_downloader(session& s, piece_cache* cache
+		, priority_arbiter* arbiter, auth_interface const* auth)
 		: m_ses(s)
 		, m_auth(auth)
-		, m_dispatch(new piece_alert_dispatch())
-// TODO: this number needs to be proportional to the rate at which a file
-// is downloaded
+		, m_cache(cache)
+		, m_arbiter(arbiter)
+		, m_file_requests(new file_requests(cache, arbiter))
 		, m_queue_size(20 * 1024 * 1024)
 		, m_attachment(true)
 	{
@@ -249,7 +493,7 @@ namespace libtorrent
 			m_auth = &n;
 		}
 
-		m_ses.add_extension(boost::static_pointer_cast<libtorrent::plugin>(m_dispatch));
+		m_ses.add_extension(boost::static_pointer_cast<libtorrent::plugin>(m_file_requests));
 	}
 
 	bool file_downloader::handle_http(mg_connection* conn,
@@ -314,214 +558,260 @@ namespace libtorrent
 		}
 
 		std::int64_t const file_size = ti->files().file_size(file);
-		std::int64_t range_first_byte = 0;
-		std::int64_t range_last_byte = file_size - 1;
-		bool range_request = false;
-
-		char const* range = mg_get_header(conn, "range");
-		if (range)
-		{
-			range = strstr(range, "bytes=");
-			if (range)
-			{
-				range += 6; // skip bytes=
-				char const* divider = strchr(range, '-');
-				if (divider)
-				{
-					range_first_byte = strtoll(range, NULL, 10);
-
-					// if the end of a range is not specified, the end of file
-					// is implied
-					if (divider[1] != '\0')
-						range_last_byte = strtoll(divider+1, NULL, 10);
-					else
-						range_last_byte = file_size - 1;
-
-					range_request = true;
-				}
-			}
-		}
 
-		peer_request req = ti->map_file(file, range_first_byte, 0);
-		int piece_size = ti->piece_length();
-		int first_piece = req.piece;
-		int end_piece = ti->map_file(file, range_last_byte, 0).piece + 1;
-		std::uint64_t offset = req.start;
+		std::vector<std::pair<std::int64_t, std::int64_t> > ranges;
+		bool const range_request = parse_ranges(mg_get_header(conn, "range")
+			, file_size, ranges);
 
-		if (range_request && (range_first_byte > range_last_byte
-			|| range_last_byte >= file_size
-			|| range_first_byte < 0))
+		if (range_request && ranges.empty())
 		{
 			mg_printf(conn, "HTTP/1.1 416 Requested Range Not Satisfiable\r\n"
-				"Content-Length: %" PRId64 "\r\n\r\n"
+				"Content-Range: bytes */%" PRId64 "\r\n"
+				"Content-Length: 0\r\n\r\n"
 				, file_size);
 			return true;
 		}
 
-		printf("GET range: %" PRId64 " - %" PRId64 "\n", range_first_byte, range_last_byte);
+		if (!range_request)
+			ranges.push_back(std::make_pair(std::int64_t(0), file_size - 1));
 
-		torrent_piece_queue pq;
-		pq.begin = first_piece;
-		pq.finish = end_piece;
-		pq.end = (std::min)(first_piece + (std::max)(m_queue_size / ti->piece_length(), 1), pq.finish);
+		// a HEAD request is answered from the file_storage alone, without
+		// touching piece priorities
+		bool const body = strcmp(request_info->request_method, "HEAD") != 0
+			&& file_size > 0;
 
-		m_dispatch->subscribe(info_hash, &pq);
+		// the body may take as long as the torrent takes to download. The
+		// worker pool the API is served from shouldn't have to wait for it.
+		// The number of threads streams may take is limited though
+		if (body && !mg_detach_worker(conn))
+		{
+			mg_printf(conn, "HTTP/1.1 503 Service Unavailable\r\n"
+				"Retry-After: 10\r\n"
+				"Content-Length: 0\r\n\r\n");
+			return true;
+		}
 
-		int priority_cursor = pq.begin;
+		std::string fname = ti->files().file_name(file);
+		char const* content_type = mg_get_builtin_mime_type(fname.c_str());
 
-		request_t r(ti->files().file_path(file), m_requests, m_mutex);
-		r.request_size = range_last_byte - range_first_byte + 1;
-		r.file_size = ti->files().file_size(file);
-		r.start_offset = range_first_byte;
+		char boundary[40];
+		snprintf(boundary, sizeof(boundary), "%016" PRIx64
+			, std::int64_t(total_microseconds(clock_type::now().time_since_epoch())));
+		range_sender sender(ranges, file_size, content_type, boundary);
 
-		std::string fname = ti->files().file_name(file);
-		r.state = request_t::writing_to_socket;
 		mg_printf(conn, "HTTP/1.1 %s\r\n"
 			"Content-Length: %" PRId64 "\r\n"
-			"Content-Type: %s\r\n"
+			"Content-Type: %s%s\r\n"
 			"%s%s%s"
 			"Accept-Ranges: bytes\r\n"
 			, range_request ? "206 Partial Content" : "200 OK"
-			, range_last_byte - range_first_byte + 1
-			, mg_get_builtin_mime_type(ti->files().file_name(file).c_str())
+			, sender.content_length()
+			, sender.multipart() ? "multipart/byteranges; boundary=" : ""
+			, sender.multipart() ? boundary : content_type
 			, m_attachment ? "Content-Disposition: attachment; filename=" : ""
 			, m_attachment ? escape_string(fname.c_str(), fname.size()).c_str() : ""
 			, m_attachment ? "\r\n" : "");
 
-		if (range_request)
+		if (range_request && !sender.multipart())
 		{
 			mg_printf(conn, "Content-Range: bytes %" PRId64 "-%" PRId64 "/%" PRId64 "\r\n\r\n"
-				, range_first_byte, range_last_byte, file_size);
+				, ranges[0].first, ranges[0].second, file_size);
 		}
 		else
 		{
 			mg_printf(conn, "\r\n");
 		}
-		r.state = request_t::waiting_for_libtorrent;
 
-		std::int64_t left_to_send = range_last_byte - range_first_byte + 1;
-//		printf("left_to_send: %" PRId64 " bytes\n", left_to_send);
+		if (!body) return true;
+
+		printf("GET %d range(s): %" PRId64 " - %" PRId64 "\n", int(ranges.size())
+			, ranges.front().first, ranges.back().second);
+
+		// the pieces covering the ranges, in order
+		int const piece_size = ti->piece_length();
+		std::vector<int> pieces;
+		for (int i = 0; i < int(ranges.size()); ++i)
+		{
+			int first = ti->map_file(file, ranges[i].first, 0).piece;
+			int const last = ti->map_file(file, ranges[i].second, 0).piece;
+			if (!pieces.empty() && first <= pieces.back()) first = pieces.back() + 1;
+			for (int k = first; k <= last; ++k) pieces.push_back(k);
+		}
 
-		// increase the priority of this range to 5
-		std::vector<std::pair<int, int> > pieces_in_req;
-		pieces_in_req.resize(pq.finish - pq.begin);
-		int p = pq.begin;
-		for (int i = 0; i < pieces_in_req.size(); ++i)
+		request_t r(ti->files().file_path(file), m_requests, m_mutex
+			, piece_size, m_queue_size);
+		r.file_size = file_size;
+		r.start_offset = ranges.front().first;
+		for (int i = 0; i < int(ranges.size()); ++i)
+			r.request_size += ranges[i].second - ranges[i].first + 1;
+
+		// cursor is the index into pieces of the next piece to send.
+		// window_end is the index of the first piece past the window
+		int cursor = 0;
+		int const num_pieces = int(pieces.size());
+		int window_end = (std::min)(r.ra.window(), num_pieces);
+		r.window = window_end;
+
+		// pieces we already have are sent straight from the file on disk,
+		// without going through read_piece
+		torrent_status const st = h.status(torrent_handle::query_pieces
+			| torrent_handle::query_save_path);
+		bitfield have = st.pieces;
+		clear_unflushed(m_ses, h, have);
+		std::int64_t const file_offset = ti->files().file_offset(file);
+		int fd = -1;
+		for (int i = 0; i < num_pieces; ++i)
 		{
-			pieces_in_req[i] = std::make_pair(p, 5);
-			++p;
+			if (pieces[i] >= have.size() || !have.get_bit(pieces[i])) continue;
+			fd = open(ti->files().file_path(file, st.save_path).c_str(), O_RDONLY);
+			break;
 		}
-		h.prioritize_pieces(pieces_in_req);
 
-		while (priority_cursor < pq.end)
+		// increase the priority of the pieces to 5, for as long as we're
+		// streaming
+		int const stream_priority = 5;
+		m_arbiter->claim(h, pieces, stream_priority);
+		std::set<int> deadlines;
+
+		// the pieces in the window that are read through file_requests
+		std::map<int, std::shared_future<piece_entry> > reads;
+
+		int priority_cursor = 0;
+		std::vector<std::pair<int, int> > wanted;
+		while (priority_cursor < window_end)
 		{
-//			printf("set_piece_deadline: %d\n", priority_cursor);
-			h.set_piece_deadline(priority_cursor
-				, 100 * (priority_cursor - pq.begin)
-				, torrent_handle::alert_when_available);
+			int const p = pieces[priority_cursor];
+			if (fd < 0 || p >= have.size() || !have.get_bit(p))
+				wanted.push_back(std::make_pair(p, r.ra.deadline(priority_cursor)));
 			++priority_cursor;
 		}
+		request_pieces(*m_file_requests, *m_arbiter, h, wanted, reads, deadlines);
 
-		for (int i = pq.begin; i < pq.finish; ++i)
+		while (cursor < num_pieces && !r.cancelled)
 		{
-			std::unique_lock<std::mutex> l(pq.queue_mutex);
+			int const i = pieces[cursor];
+			int span_end = cursor + 1;
 
-			// TODO: come up with some way to abort
-			while (pq.queue.empty() || pq.queue.top().piece > i)
+			if (fd >= 0 && i < have.size() && have.get_bit(i))
 			{
-				pq.cond.wait(l);
-				// TODO: we may have woken up because of a SIGPIPE and this
-				// connection may have been broken. Test to see if our connection
-				// to the client is still open, and if it isn't, abort
+				// send the whole run of pieces we have in one go
+				while (span_end < num_pieces && pieces[span_end] < have.size()
+					&& have.get_bit(pieces[span_end]))
+					++span_end;
+
+				r.piece = i;
+				if (!sender.send(conn, r, std::int64_t(pieces[span_end - 1] + 1)
+					* piece_size - file_offset, NULL, 0, fd))
+					break;
 			}
-
-			piece_entry pe = pq.queue.top();
-			pq.queue.pop();
-
-			if (pe.piece < i)
+			else
 			{
-				--i; // we don't want to increment i in this case. Just ignore
-				// the piece we got in from the queue
-				continue;
-			}
+				std::map<int, std::shared_future<piece_entry> >::iterator ri
+					= reads.find(i);
+				TORRENT_ASSERT(ri != reads.end());
+
+				// while waiting, check every now and then whether the client
+				// is still there. If not, give up the pieces we asked for, so
+				// other streams get the bandwidth
+				bool abandoned = false;
+				while (ri->second.wait_for(std::chrono::seconds(1))
+					!= std::future_status::ready)
+				{
+					if (r.cancelled)
+					{
+						abandoned = true;
+						break;
+					}
+					if (!mg_is_connected(conn))
+					{
+						printf("interrupted (client disconnected)\n");
+						abandoned = true;
+						break;
+					}
+				}
+				if (abandoned) break;
 
-			pq.end = (std::min)(pq.end + 1, pq.finish);
-			pq.begin = (std::min)(pq.begin + 1, pq.end);
+				piece_entry pe;
+				try
+				{
+					pe = ri->second.get();
+				}
+				catch (std::future_error const&)
+				{
+					// the request timed out, or the torrent was paused or
+					// removed. Keep asking for as long as the torrent is
+					// around
+					if (!h.is_valid())
+					{
+						printf("interrupted (torrent removed)\n");
+						break;
+					}
+					ri->second = m_file_requests->read_piece(h, i, piece_timeout);
+					continue;
+				}
+				reads.erase(ri);
 
-			l.unlock();
+				// the piece is here, libtorrent doesn't need to hurry for it
+				// on our behalf anymore
+				if (deadlines.erase(i))
+					m_arbiter->release_deadline(h, i);
 
-			while (priority_cursor < pq.end)
-			{
-//				printf("set_piece_deadline: %d\n", priority_cursor);
-				h.set_piece_deadline(priority_cursor
-					, 100 * (priority_cursor - i)
-					, torrent_handle::alert_when_available);
-				++priority_cursor;
-			}
+				r.ra.delivered(pe.size, pe.received);
+				r.piece = i;
 
-			r.piece = pe.piece;
+				if (pe.size == 0)
+				{
+					printf("interrupted (zero bytes read)\n");
+					break;
+				}
 
-			if (pe.size == 0)
-			{
-				printf("interrupted (zero bytes read)\n");
-				break;
+				std::int64_t const piece_start = std::int64_t(i) * piece_size - file_offset;
+				if (!sender.send(conn, r, piece_start + pe.size
+					, pe.buffer.get(), piece_start, -1))
+					break;
 			}
 
-			int ret = -1;
-			int amount_to_send = (std::min)(std::int64_t(pe.size - offset), left_to_send);
-//			fprintf(stderr, "[%p] amount_to_send: 0x%x bytes [p: %d] [l: %" PRId64 "]\n"
-//				, &r, amount_to_send, pq.finish - i, left_to_send);
+			cursor = span_end;
+			if (cursor == num_pieces) break;
 
-			while (amount_to_send > 0)
+			window_end = (std::max)(window_end
+				, (std::min)(cursor + r.ra.window(), num_pieces));
+			r.window = window_end - cursor;
+
+			wanted.clear();
+			while (priority_cursor < window_end)
 			{
-				r.state = request_t::writing_to_socket;
-				TORRENT_ASSERT(offset >= 0);
-				TORRENT_ASSERT(offset + amount_to_send <= pe.size);
-				ret = mg_write(conn, &pe.buffer[offset], amount_to_send);
-				if (ret <= 0)
-				{
-					fprintf(stderr, "interrupted (%d) errno: (%d) %s\n", ret, errno
-						, strerror(errno));
-					if (ret < 0 && errno == EAGAIN) {
-						usleep(100000);
-						continue;
-					}
-					break;
-				}
-				TORRENT_ASSERT(r.bytes_sent + ret<= r.request_size);
-				r.bytes_sent += ret;
-				r.state = request_t::waiting_for_libtorrent;
-
-				left_to_send -= ret;
-//				printf("sent: %d bytes [%d]\n", amount_to_send, i);
-				offset += ret;
-				amount_to_send -= ret;
+				int const p = pieces[priority_cursor];
+				if (fd < 0 || p >= have.size() || !have.get_bit(p))
+					wanted.push_back(std::make_pair(p
+						, r.ra.deadline(priority_cursor - cursor)));
+				++priority_cursor;
 			}
-			if (ret <= 0) break;
-			offset = 0;
+			request_pieces(*m_file_requests, *m_arbiter, h, wanted, reads, deadlines);
 		}
 
-		std::set<int> still_in_use;
-		m_dispatch->unsubscribe(info_hash, &pq, &still_in_use);
+		if (fd >= 0) close(fd);
 
-		for (int k = pq.begin; k < priority_cursor; ++k)
-		{
-			if (still_in_use.count(k)) continue;
-			printf("reset_piece_deadline: %d\n", k);
-			h.reset_piece_deadline(k);
-		}
+		// other streams may still want some of these pieces. The arbiter
+		// only resets what nobody else claims
+		for (std::set<int>::iterator k = deadlines.begin(); k != deadlines.end(); ++k)
+			m_arbiter->release_deadline(h, *k);
+		m_arbiter->release(h, pieces, stream_priority);
 //		printf("done, sent %" PRId64 " bytes\n", r.bytes_sent);
 
-		// TODO: this doesn't work right if there are overlapping requests
-
-		// restore piece priorities
-		for (int i = 0; i < pieces_in_req.size(); ++i)
-			pieces_in_req[i].second = 1;
-		h.prioritize_pieces(pieces_in_req);
-
 		return true;
 	}
 
+	void file_downloader::cancel_all()
+	{
+		std::unique_lock<std::mutex> l(m_mutex);
+		for (std::set<request_t*>::iterator i = m_requests.begin()
+			, end(m_requests.end()); i != end; ++i)
+		{
+			(*i)->cancelled = true;
+		}
+	}
+
 	void file_downloader::debug_print_requests() const
 	{
 		time_point now = clock_type::now();
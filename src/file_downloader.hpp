@@ -38,17 +38,31 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "webui.hpp"
 #include <mutex>
 #include <set>
+#include <vector>
+#include <utility>
+#include <cstdint>
+
+struct file_requests;
 
 namespace libtorrent
 {
-	struct piece_alert_dispatch;
+	struct piece_cache;
+	struct priority_arbiter;
 	struct auth_interface;
 	struct request_t;
 	class session;
 
+	// parses the Range header into a sorted list of non-overlapping,
+	// inclusive byte ranges. Ranges that don't overlap the file are
+	// dropped. Returns false if the header isn't a byte range request,
+	// in which case the whole file is sent
+	bool parse_ranges(char const* header, std::int64_t file_size
+		, std::vector<std::pair<std::int64_t, std::int64_t> >& ranges);
+
 	struct file_downloader : http_handler
 	{
-		file_downloader(session& s, auth_interface const* auth = NULL);
+		file_downloader(session& s, piece_cache* cache
+			, priority_arbiter* arbiter, auth_interface const* auth = NULL);
 
 		virtual bool handle_http(mg_connection* conn,
 			mg_request_info const* request_info);
@@ -56,13 +70,26 @@ namespace libtorrent
 		void set_disposition(bool attachment) { m_attachment = attachment; }
 		void debug_print_requests() const;
 
+		// stops all streams in progress. Their piece deadlines and
+		// priorities are released as soon as they notice, which is within
+		// a second
+		void cancel_all();
+
 	private:
 
 		session& m_ses;
 		auth_interface const* m_auth;
 
-		libtorrent::shared_ptr<piece_alert_dispatch> m_dispatch;
+		// pieces read by any stream
+		piece_cache* m_cache;
+
+		// the piece priorities and deadlines claimed by all streams
+		priority_arbiter* m_arbiter;
+
+		// reads the pieces of all streams, through m_cache and m_arbiter
+		libtorrent::shared_ptr<file_requests> m_file_requests;
 
+		// the largest read-ahead window, in bytes, a stream may grow to
 		int m_queue_size;
 
 		// controls the content disposition of files. Defaults to true
@@ -0,0 +1,137 @@
+/*
+
+Copyright (c) 2015, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "file_history.hpp"
+#include "libtorrent/torrent_info.hpp"
+
+namespace libtorrent
+{
+	file_history::file_history(time_duration refresh_interval)
+		: m_refresh_interval(refresh_interval)
+		, m_frame(0)
+	{}
+
+	std::shared_ptr<torrent_files> file_history::get(torrent_handle const& h
+		, std::unique_lock<std::mutex>& l)
+	{
+		time_point const now = time_now();
+		std::shared_ptr<torrent_files> f;
+		{
+			std::unique_lock<std::mutex> l2(m_mutex);
+
+			// forget about torrents nobody has been looking at in a while
+			for (boost::unordered_map<sha1_hash, std::shared_ptr<torrent_files> >::iterator i
+				= m_torrents.begin(); i != m_torrents.end();)
+			{
+				std::unique_lock<std::mutex> l3(i->second->mutex, std::try_to_lock);
+				if (l3.owns_lock() && now - i->second->last_refresh > minutes(5))
+				{
+					l3.unlock();
+					i = m_torrents.erase(i);
+				}
+				else ++i;
+			}
+
+			std::shared_ptr<torrent_files>& e = m_torrents[h.info_hash()];
+			if (!e)
+			{
+				e = std::make_shared<torrent_files>();
+				e->frame = 0;
+				e->static_frame = 0;
+			}
+			f = e;
+		}
+
+		l = std::unique_lock<std::mutex>(f->mutex);
+		if (!f->torrent_file || now - f->last_refresh >= m_refresh_interval)
+		{
+			refresh(*f, h);
+			f->last_refresh = now;
+		}
+
+		if (!f->torrent_file)
+		{
+			l.unlock();
+			return std::shared_ptr<torrent_files>();
+		}
+		return f;
+	}
+
+	void file_history::refresh(torrent_files& f, torrent_handle const& h)
+	{
+		boost::shared_ptr<const torrent_info> t = h.torrent_file();
+		if (!t) return;
+
+		int const num_files = t->files().num_files();
+
+		std::vector<std::int64_t> progress;
+		h.file_progress(progress, torrent_handle::piece_granularity);
+		progress.resize(num_files, 0);
+
+		std::vector<int> prio = h.file_priorities();
+		prio.resize(num_files, 0);
+
+		if (t != f.torrent_file)
+		{
+			// this is either the first time we look at this torrent, or its
+			// metadata has changed. Everything needs to be sent again
+			std::uint32_t const frame = next_frame();
+			f.torrent_file = t;
+			f.frame = frame;
+			f.static_frame = frame;
+			f.progress.swap(progress);
+			f.priority.assign(prio.begin(), prio.end());
+			f.progress_frame.assign(num_files, frame);
+			f.priority_frame.assign(num_files, frame);
+			return;
+		}
+
+		std::uint32_t frame = 0;
+		for (int i = 0; i < num_files; ++i)
+		{
+			if (f.progress[i] != progress[i])
+			{
+				if (frame == 0) frame = next_frame();
+				f.progress[i] = progress[i];
+				f.progress_frame[i] = frame;
+			}
+			if (f.priority[i] != prio[i])
+			{
+				if (frame == 0) frame = next_frame();
+				f.priority[i] = std::uint8_t(prio[i]);
+				f.priority_frame[i] = frame;
+			}
+		}
+		if (frame != 0) f.frame = frame;
+	}
+}
+
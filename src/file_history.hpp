@@ -0,0 +1,109 @@
+/*
+
+Copyright (c) 2015, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_FILE_HISTORY_HPP
+#define TORRENT_FILE_HISTORY_HPP
+
+#include "libtorrent/torrent_handle.hpp"
+#include "libtorrent/time.hpp"
+#include <boost/unordered_map.hpp>
+#include <boost/shared_ptr.hpp>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+
+namespace libtorrent
+{
+	class torrent_info;
+
+	// the state of the files of one torrent, and the frame each of their
+	// fields last changed in. The static fields (flags, name and size)
+	// only change if the torrent's metadata does.
+	struct torrent_files
+	{
+		// must be held while accessing any of the other fields
+		std::mutex mutex;
+
+		// the latest frame any field changed in
+		std::uint32_t frame;
+
+		// the frame the static fields of all files were last set in
+		std::uint32_t static_frame;
+
+		// the last time the state was read from the torrent
+		time_point last_refresh;
+
+		boost::shared_ptr<const torrent_info> torrent_file;
+
+		std::vector<std::int64_t> progress;
+		std::vector<std::uint8_t> priority;
+
+		std::vector<std::uint32_t> progress_frame;
+		std::vector<std::uint32_t> priority_frame;
+	};
+
+	// keeps track of the file progress and priorities of the torrents that
+	// are being looked at, to only send the files that have changed. A
+	// torrent is dropped once it hasn't been asked for in a while.
+	struct file_history
+	{
+		file_history(time_duration refresh_interval = seconds(1));
+
+		// returns the file state of the torrent, refreshed from the torrent
+		// if it's older than the refresh interval. The state is returned
+		// locked, by l. Returns an empty pointer if the torrent doesn't
+		// have metadata yet.
+		std::shared_ptr<torrent_files> get(torrent_handle const& h
+			, std::unique_lock<std::mutex>& l);
+
+	private:
+
+		void refresh(torrent_files& f, torrent_handle const& h);
+
+		// frame numbers are unique across all torrents, to not confuse a
+		// client holding a frame number of a torrent that was dropped and
+		// later picked up again
+		std::uint32_t next_frame() { return ++m_frame; }
+
+		time_duration m_refresh_interval;
+
+		std::mutex m_mutex;
+		boost::unordered_map<sha1_hash, std::shared_ptr<torrent_files> > m_torrents;
+
+		std::atomic<std::uint32_t> m_frame;
+	};
+}
+
+#endif
+
@@ -31,6 +31,8 @@ POSSIBILITY OF SUCH DAMAGE.
 */
 
 #include "file_requests.hpp"
+#include "piece_cache.hpp"
+#include "priority_arbiter.hpp"
 
 #include "libtorrent/alert_types.hpp"
 #include "libtorrent/torrent.hpp"
@@ -40,53 +42,83 @@ POSSIBILITY OF SUCH DAMAGE.
 
 using namespace libtorrent;
 
-std::size_t file_requests::hash_value(piece_request const& r) const
+namespace
 {
-	sha1_hash const& h = r.info_hash;
-	return (h[0] | (h[1] << 8) | (h[2] << 16) | (h[3] << 24)) ^ r.piece;
+	// the priority of pieces someone is waiting for
+	int const request_priority = 7;
 }
 
-file_requests::file_requests()
-	: m_next_timeout(m_requests.begin())
+file_requests::file_requests(piece_cache* cache, priority_arbiter* arbiter)
+	: m_cache(cache)
+	, m_arbiter(arbiter)
+	, m_timers(clock_type::now())
 {
 }
 
+void file_requests::finish_request(torrent_requests& t, request_ptr const& r
+	, std::vector<request_ptr>& finished)
+{
+	r->done = true;
+	finished.push_back(r);
+
+	std::unordered_map<int, request_ptr>::iterator i = t.pieces.find(r->piece);
+	if (i != t.pieces.end() && i->second == r) t.pieces.erase(i);
+}
+
+void file_requests::release(std::vector<request_ptr>& finished)
+{
+	// requests of the same torrent are released together
+	std::vector<int> pieces;
+	for (int i = 0; i < int(finished.size()); ++i)
+	{
+		pieces.push_back(finished[i]->piece);
+		if (i + 1 < int(finished.size())
+			&& finished[i + 1]->info_hash == finished[i]->info_hash)
+			continue;
+		m_arbiter->release(finished[i]->handle, pieces, request_priority);
+		pieces.clear();
+	}
+
+	// dropping the promises breaks them for everyone waiting
+	finished.clear();
+}
+
 void file_requests::on_alert(alert const* a)
 {
 	read_piece_alert const* p = alert_cast<read_piece_alert>(a);
 	if (p)
 	{
 		shared_ptr<torrent> t = p->handle.native_handle();
-
-		piece_request rq;
-		rq.info_hash = t->info_hash();
-		rq.piece = p->piece;
-		typedef requests_t::iterator iter;
+		sha1_hash const ih = t->info_hash();
 
 		DLOG("read_piece_alert: %d (%s)\n", p->piece, p->ec.message().c_str());
-		std::unique_lock<std::mutex> l(m_mutex);
-		std::pair<iter, iter> range = m_requests.equal_range(rq);
-		if (range.first == m_requests.end()) return;
+		if (!p->ec && p->size > 0)
+			m_cache->insert(ih, p->piece, p->buffer, p->size);
 
+		std::unique_lock<std::mutex> l(m_mutex);
+		torrents_t::iterator ti = m_torrents.find(ih);
+		if (ti == m_torrents.end()) return;
+		std::unordered_map<int, request_ptr>::iterator i
+			= ti->second.pieces.find(p->piece);
+		if (i == ti->second.pieces.end()) return;
+
+		// every waiter holds the same shared future, so they all get this
+		// buffer
 		piece_entry pe;
 		pe.buffer = p->buffer;
 		pe.piece = p->piece;
 		pe.size = p->size;
-		for (iter i = range.first; i != range.second; ++i)
-		{
-			i->promise->set_value(pe);
-			if (m_next_timeout == i)
-				++m_next_timeout;
-		}
-		m_requests.erase(range.first, range.second);
+		pe.received = clock_type::now();
 
-		DLOG("outstanding requests: ");
-		for (iter i = m_requests.begin(); i != m_requests.end(); ++i)
-		{
-			TORRENT_ASSERT(i->info_hash != rq.info_hash || i->piece != rq.piece);
-			DLOG("(%02x%02x, %d) ", i->info_hash[0], i->info_hash[1], i->piece);
-		}
-		DLOG("\n");
+		request_ptr r = i->second;
+		ti->second.pieces.erase(i);
+		r->done = true;
+		DLOG("outstanding requests: %d pieces\n", int(ti->second.pieces.size()));
+		l.unlock();
+
+		r->promise.set_value(pe);
+		m_arbiter->release(r->handle, std::vector<int>(1, p->piece)
+			, request_priority);
 		return;
 	}
 
@@ -95,104 +127,202 @@ void file_requests::on_alert(alert const* a)
 	{
 		DLOG("piece_finished: %d\n", pf->piece_index);
 		libtorrent::shared_ptr<torrent> t = pf->handle.native_handle();
-		piece_request rq;
-		rq.info_hash = t->info_hash();
-		rq.piece = pf->piece_index;
-		typedef requests_t::iterator iter;
-		m_have_pieces[rq.info_hash].insert(pf->piece_index);
 
 		std::unique_lock<std::mutex> l(m_mutex);
-		std::pair<iter, iter> range = m_requests.equal_range(rq);
-		if (range.first == m_requests.end()) return;
+		// we only keep track of torrents someone has read from
+		torrents_t::iterator ti = m_torrents.find(t->info_hash());
+		if (ti == m_torrents.end()) return;
+		torrent_requests& tr = ti->second;
+		if (tr.have.size() <= pf->piece_index)
+			tr.have.resize(t->torrent_file().num_pieces(), false);
+		tr.have.set_bit(pf->piece_index);
+
+		if (tr.pieces.count(pf->piece_index) == 0) return;
 		l.unlock();
 
+		// we're on the network thread, so go straight to the torrent
+		// rather than through the handle
 		DLOG("read_piece: %d\n", pf->piece_index);
-		pf->handle.read_piece(pf->piece_index);
+		t->read_piece(pf->piece_index);
 		return;
 	}
 
-	// if a torrent is stopped or removed, abort any piece requests
-	piece_request rq;
+	// if a torrent is removed, forget about it. If it's stopped, abort any
+	// piece requests
 	torrent_removed_alert const* tr = alert_cast<torrent_removed_alert>(a);
-	torrent_paused_alert const* tp = alert_cast<torrent_paused_alert>(a);
 	if (tr)
 	{
-		rq.info_hash = tr->info_hash;
+		m_cache->evict(tr->info_hash);
+		m_arbiter->remove(tr->info_hash);
+
+		std::unique_lock<std::mutex> l(m_mutex);
+		torrents_t::iterator ti = m_torrents.find(tr->info_hash);
+		if (ti == m_torrents.end()) return;
+		for (std::unordered_map<int, request_ptr>::iterator i
+			= ti->second.pieces.begin(), end(ti->second.pieces.end()); i != end; ++i)
+		{
+			i->second->done = true;
+		}
+		m_torrents.erase(ti);
+		return;
 	}
-	else if (tp)
+
+	torrent_paused_alert const* tp = alert_cast<torrent_paused_alert>(a);
+	if (tp)
 	{
-		rq.info_hash = tp->handle.native_handle()->info_hash();
-	}
-	else return;
+		std::unique_lock<std::mutex> l(m_mutex);
+		torrents_t::iterator ti = m_torrents.find(tp->handle.native_handle()->info_hash());
+		if (ti == m_torrents.end()) return;
 
-	// remove all requests for the torrent
-	rq.piece = 0;
-	typedef requests_t::iterator iter;
+		std::vector<request_ptr> finished;
+		torrent_requests& t = ti->second;
+		while (!t.pieces.empty())
+		{
+			request_ptr r = t.pieces.begin()->second;
+			finish_request(t, r, finished);
+		}
+		l.unlock();
+		release(finished);
+	}
+}
 
+void file_requests::on_tick()
+{
+	std::vector<timer_wheel::timer_ptr> due;
+	std::vector<request_ptr> finished;
 	std::unique_lock<std::mutex> l(m_mutex);
-	iter first = m_requests.lower_bound(rq);
-	rq.piece = INT_MAX;
-	iter last = m_requests.upper_bound(rq);
-	if (first == last) return;
+	m_timers.expire(clock_type::now(), due);
 
-	for (iter i = first; i != last; ++i)
+	for (int i = 0; i < int(due.size()); ++i)
 	{
-		if (i != m_next_timeout) continue;
-		m_next_timeout = last;
-		break;
+		request_ptr const r = std::static_pointer_cast<piece_request>(due[i]);
+		DLOG("timeout: %d\n", r->piece);
+		torrents_t::iterator ti = m_torrents.find(r->info_hash);
+		if (ti == m_torrents.end()) continue;
+		finish_request(ti->second, r, finished);
 	}
-
-	m_requests.erase(first, last);
-
+	l.unlock();
+	release(finished);
 }
 
-void file_requests::on_tick()
+std::shared_future<piece_entry> file_requests::read_piece(torrent_handle const& h, int piece, int timeout_ms)
 {
-	std::unique_lock<std::mutex> l(m_mutex);
+	return read_pieces(h, piece, 1, timeout_ms).front();
+}
 
-	if (m_next_timeout == m_requests.end())
-		m_next_timeout = m_requests.begin();
+std::vector<std::shared_future<piece_entry> > file_requests::read_pieces(
+	torrent_handle const& h, int first, int num, int timeout_ms)
+{
+	TORRENT_ASSERT(first >= 0);
+	TORRENT_ASSERT(num > 0);
+	TORRENT_ASSERT(first + num <= h.torrent_file()->num_pieces());
 
-	ptime now = time_now();
+	sha1_hash const ih = h.info_hash();
+	std::vector<std::shared_future<piece_entry> > ret(num);
 
-	if (m_next_timeout != m_requests.end())
+	// pieces we don't have in the cache
+	std::vector<int> wanted;
+	for (int i = 0; i < num; ++i)
 	{
-		if (m_next_timeout->timeout < now)
+		int const piece = first + i;
+		piece_entry pe;
+		if (m_cache->find(ih, piece, pe.buffer, pe.size))
 		{
-			requests_t::iterator to_remove = m_next_timeout;
-			++m_next_timeout;
-			m_requests.erase(to_remove);
+			DLOG("cached: %d\n", piece);
+			pe.piece = piece;
+			pe.received = clock_type::now();
+			std::promise<piece_entry> p;
+			p.set_value(pe);
+			ret[i] = p.get_future().share();
+			continue;
 		}
-		else
+		wanted.push_back(piece);
+	}
+	if (wanted.empty()) return ret;
+
+	// claim the priority of all of them in one go, before any of the
+	// requests can complete, which is when it's released
+	DLOG("piece_priority: %d-%d <- %d\n", wanted.front(), wanted.back()
+		, request_priority);
+	m_arbiter->claim(h, wanted, request_priority);
+
+	std::unique_lock<std::mutex> l(m_mutex);
+	torrents_t::iterator ti = m_torrents.insert(
+		std::make_pair(ih, torrent_requests())).first;
+	if (!ti->second.seeded)
+	{
+		// from now on, piece_finished alerts for this torrent are recorded.
+		// Pieces that finished before that are picked up from the torrent's
+		// status. This is a synchronous call, so we can't hold the lock over
+		// it. Every request that comes in before the first one is done with
+		// this asks for the status too, rather than trusting a have
+		// bitfield that may still be empty
+		l.unlock();
+		torrent_status const st = h.status(torrent_handle::query_pieces);
+		l.lock();
+		ti = m_torrents.find(ih);
+		if (ti == m_torrents.end())
 		{
-			++m_next_timeout;
+			// the torrent was removed. The pieces we didn't find in the
+			// cache get a broken promise, just like a request that's
+			// dropped
+			l.unlock();
+			m_arbiter->release(h, wanted, request_priority);
+			for (int k = 0; k < int(wanted.size()); ++k)
+			{
+				std::promise<piece_entry> p;
+				ret[wanted[k] - first] = p.get_future().share();
+			}
+			return ret;
 		}
+		bitfield& have = ti->second.have;
+		if (have.size() < st.pieces.size()) have.resize(st.pieces.size(), false);
+		for (int i = 0; i < st.pieces.size(); ++i)
+			if (st.pieces.get_bit(i)) have.set_bit(i);
+		ti->second.seeded = true;
 	}
-}
 
-std::shared_future<piece_entry> file_requests::read_piece(torrent_handle const& h, int piece, int timeout_ms)
-{
-	TORRENT_ASSERT(piece >= 0);
-	TORRENT_ASSERT(piece < h.torrent_file()->num_pieces());
+	torrent_requests& t = ti->second;
+	time_point const expires = clock_type::now() + milliseconds(timeout_ms);
 
-	piece_request rq;
-	rq.info_hash = h.info_hash();
-	rq.piece = piece;
-	rq.promise.reset(new std::promise<piece_entry>());
-	rq.timeout = time_now() + milliseconds(timeout_ms);
+	// pieces someone else is already waiting for. They keep their claim
+	std::vector<int> joined;
+	// pieces we have, that need a disk read
+	std::vector<int> reads;
+	for (int k = 0; k < int(wanted.size()); ++k)
+	{
+		int const piece = wanted[k];
+		request_ptr& rq = t.pieces[piece];
+		if (rq)
+		{
+			DLOG("join: %d\n", piece);
+			m_timers.extend(rq, expires);
+			ret[piece - first] = rq->future;
+			joined.push_back(piece);
+			continue;
+		}
 
-	std::unique_lock<std::mutex> l(m_mutex);
-	m_requests.insert(rq);
+		rq = std::make_shared<piece_request>();
+		rq->info_hash = ih;
+		rq->handle = h;
+		rq->piece = piece;
+		rq->future = rq->promise.get_future().share();
+		m_timers.insert(rq, expires);
+		ret[piece - first] = rq->future;
+
+		if (piece < t.have.size() && t.have.get_bit(piece))
+			reads.push_back(piece);
+	}
 	l.unlock();
 
-	DLOG("piece_priority: %d <- 7\n", piece);
-	h.piece_priority(piece, 7);
-//	h.set_piece_deadline(piece, 0, torrent_handle::alert_when_available);
-	if (m_have_pieces[rq.info_hash].count(piece))
+	if (!joined.empty())
+		m_arbiter->release(h, joined, request_priority);
+
+	for (int k = 0; k < int(reads.size()); ++k)
 	{
-		DLOG("read_piece: %d\n", piece);
-		h.read_piece(piece);
+		DLOG("read_piece: %d\n", reads[k]);
+		h.read_piece(reads[k]);
 	}
-	return std::shared_future<piece_entry>(rq.promise->get_future());
+	return ret;
 }
 
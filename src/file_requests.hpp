@@ -34,59 +34,109 @@ POSSIBILITY OF SUCH DAMAGE.
 #define FILE_REQUESTS_HPP_
 
 #include <boost/shared_array.hpp>
+#include <boost/unordered_map.hpp>
 #include <future>
-#include <set>
-#include <boost/functional/hash.hpp>
+#include <memory>
+#include <unordered_map>
+#include <vector>
 
 #include <mutex> // for mutex
 #include "libtorrent/torrent_handle.hpp"
 #include "libtorrent/peer_id.hpp" // for sha1_hash
 #include "libtorrent/extensions.hpp" // for plugin
-#include "libtorrent/time.hpp" // for ptime
+#include "libtorrent/bitfield.hpp"
+#include "libtorrent/time.hpp" // for time_point
+#include "timer_wheel.hpp"
 
 using libtorrent::sha1_hash;
 using std::mutex;
 
+namespace libtorrent
+{
+	struct piece_cache;
+	struct priority_arbiter;
+}
+
 struct piece_entry
 {
 	boost::shared_array<char> buffer;
 	int size;
 	int piece;
+	// when the piece was read, or found in the cache
+	libtorrent::time_point received;
 };
 
 // this is a session plugin which wraps the concept of reading pieces
-// from torrents, returning futures for when those pieces are complete
+// from torrents, returning futures for when those pieces are complete.
+// file_downloader reads the pieces it streams through it
 struct file_requests : libtorrent::plugin
 {
-	file_requests();
+	file_requests(libtorrent::piece_cache* cache
+		, libtorrent::priority_arbiter* arbiter);
 	void on_alert(libtorrent::alert const* a);
 	void on_tick();
 	std::shared_future<piece_entry> read_piece(libtorrent::torrent_handle const& h
 		, int piece, int timeout_ms);
 
+	// reads num pieces starting at first. Their priorities are raised in a
+	// single call. The futures are returned in piece order
+	std::vector<std::shared_future<piece_entry> > read_pieces(
+		libtorrent::torrent_handle const& h, int first, int num, int timeout_ms);
+
 private:
 
-	struct piece_request
+	// a piece someone is waiting for. Everyone asking for the same piece
+	// shares one read and one future
+	// the timeout is pushed out when another waiter joins. The timer is
+	// marked done once the request is completed or dropped
+	struct piece_request : libtorrent::wheel_timer
 	{
 		sha1_hash info_hash;
+		libtorrent::torrent_handle handle;
 		int piece;
-		std::shared_ptr<std::promise<piece_entry> > promise;
-		libtorrent::ptime timeout;
-		bool operator==(piece_request const& rq) const
-		{ return rq.info_hash == info_hash && rq.piece == piece; }
-		bool operator<(piece_request const& rq) const
-		{ return info_hash == rq.info_hash ? piece < rq.piece : info_hash < rq.info_hash; }
+		std::promise<piece_entry> promise;
+		std::shared_future<piece_entry> future;
 	};
 
-	std::size_t hash_value(piece_request const& r) const;
+	typedef std::shared_ptr<piece_request> request_ptr;
 
-	std::mutex m_mutex;
-	typedef std::multiset<piece_request> requests_t;
-	requests_t m_requests;
-	requests_t::iterator m_next_timeout;
+	struct torrent_requests
+	{
+		torrent_requests() : seeded(false) {}
+
+		// the pieces that have passed the hash check
+		libtorrent::bitfield have;
 
-	// TOOD: figure out a way to clear out info-hashes
-	std::map<sha1_hash, std::set<int> > m_have_pieces;
+		// set once the pieces the torrent had before we started listening
+		// for piece_finished alerts have been added to have
+		bool seeded;
+
+		// outstanding requests, by piece
+		std::unordered_map<int, request_ptr> pieces;
+	};
+
+	typedef boost::unordered_map<sha1_hash, torrent_requests> torrents_t;
+
+	// marks the request as done, removes it from its torrent and adds it
+	// to finished. Must be called with m_mutex held
+	void finish_request(torrent_requests& t, request_ptr const& r
+		, std::vector<request_ptr>& finished);
+
+	// releases the priority of the finished requests and drops them.
+	// Waiters on them get a broken promise. This is called once m_mutex
+	// is released, since it's called on the network thread
+	void release(std::vector<request_ptr>& finished);
+
+	// pieces read by any request, shared with other users of read_piece
+	libtorrent::piece_cache* m_cache;
+
+	// the priority of requested pieces is claimed here, and released once
+	// the request is done
+	libtorrent::priority_arbiter* m_arbiter;
+
+	std::mutex m_mutex;
+	torrents_t m_torrents;
+	libtorrent::timer_wheel m_timers;
 };
 
 #endif // FILE_REQUESTS_HPP_
@@ -0,0 +1,328 @@
+/*
+
+Copyright (c) 2015, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "json_writer.hpp"
+#include "chunked_response.hpp"
+
+#include <cmath> // for fabs
+#include <cstring> // for strlen
+#include <cstdio> // for snprintf
+
+namespace libtorrent
+{
+
+namespace
+{
+	char const hex_chars[] = "0123456789abcdef";
+
+	std::int64_t const pow10[] = { 1, 10, 100, 1000, 10000, 100000
+		, 1000000, 10000000, 100000000, 1000000000 };
+
+	// decodes one UTF-8 sequence starting at s. Returns the number of
+	// bytes it was, or 0 if it's not valid UTF-8
+	int decode_utf8(unsigned char const* s, unsigned char const* end
+		, std::uint32_t& cp)
+	{
+		int len;
+		std::uint32_t min;
+		if (*s >= 0xc2 && *s <= 0xdf) { len = 2; cp = *s & 0x1f; min = 0x80; }
+		else if (*s >= 0xe0 && *s <= 0xef) { len = 3; cp = *s & 0x0f; min = 0x800; }
+		else if (*s >= 0xf0 && *s <= 0xf4) { len = 4; cp = *s & 0x07; min = 0x10000; }
+		else return 0;
+
+		if (end - s < len) return 0;
+		for (int i = 1; i < len; ++i)
+		{
+			if ((s[i] & 0xc0) != 0x80) return 0;
+			cp = (cp << 6) | (s[i] & 0x3f);
+		}
+		// overlong encodings, surrogates and code points past the end of
+		// unicode are not valid
+		if (cp < min || cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff))
+			return 0;
+		return len;
+	}
+}
+
+json_writer::json_writer(std::vector<char>& out, bool continued)
+	: m_out(out)
+	, m_stream(NULL)
+	, m_first(continued ? 0 : 1)
+	, m_after_key(false)
+{}
+
+json_writer::json_writer(chunked_response& out, bool continued)
+	: m_out(out.buffer())
+	, m_stream(&out)
+	, m_first(continued ? 0 : 1)
+	, m_after_key(false)
+{}
+
+void json_writer::reserve(int bytes)
+{
+	// a streamed response never holds much more than a chunk
+	if (m_stream && bytes > m_stream->flush_threshold())
+		bytes = m_stream->flush_threshold();
+	m_out.reserve(m_out.size() + bytes);
+}
+
+void json_writer::append(char const* s, int len)
+{
+	m_out.insert(m_out.end(), s, s + len);
+}
+
+void json_writer::separator()
+{
+	if (m_after_key)
+	{
+		m_after_key = false;
+		return;
+	}
+	if ((m_first & 1) == 0) m_out.push_back(',');
+	m_first &= ~std::uint64_t(1);
+}
+
+json_writer& json_writer::begin_object()
+{
+	separator();
+	m_out.push_back('{');
+	m_first = (m_first << 1) | 1;
+	return *this;
+}
+
+json_writer& json_writer::end_object()
+{
+	m_out.push_back('}');
+	m_first >>= 1;
+	if (m_stream) m_stream->maybe_flush();
+	return *this;
+}
+
+json_writer& json_writer::begin_array()
+{
+	separator();
+	m_out.push_back('[');
+	m_first = (m_first << 1) | 1;
+	return *this;
+}
+
+json_writer& json_writer::end_array()
+{
+	m_out.push_back(']');
+	m_first >>= 1;
+	if (m_stream) m_stream->maybe_flush();
+	return *this;
+}
+
+json_writer& json_writer::key(char const* k)
+{
+	separator();
+	m_out.push_back('"');
+	append(k, int(strlen(k)));
+	m_out.push_back('"');
+	m_out.push_back(':');
+	m_after_key = true;
+	return *this;
+}
+
+void json_writer::append_digits(std::uint64_t v)
+{
+	char buf[20];
+	char* end = buf + sizeof(buf);
+	char* p = end;
+	do
+	{
+		*--p = '0' + v % 10;
+		v /= 10;
+	} while (v > 0);
+	append(p, int(end - p));
+}
+
+json_writer& json_writer::integer(std::int64_t v)
+{
+	separator();
+	if (v < 0) m_out.push_back('-');
+	append_digits(v < 0 ? 0 - std::uint64_t(v) : std::uint64_t(v));
+	return *this;
+}
+
+json_writer& json_writer::number(double v, int decimals)
+{
+	if (decimals < 0) decimals = 0;
+	if (decimals > 9) decimals = 9;
+
+	// JSON has no representation of NaN or infinity
+	if (v != v || v - v != 0.)
+		return integer(0);
+
+	std::int64_t const scale = pow10[decimals];
+	double const a = std::fabs(v);
+	if (a >= 9e18 / scale)
+	{
+		// too large to scale into an integer. This doesn't happen for
+		// anything we send, but it should still come out right
+		separator();
+		char buf[400];
+		int const len = snprintf(buf, sizeof(buf), "%.*f", decimals, v);
+		append(buf, len);
+		return *this;
+	}
+
+	std::int64_t const q = std::int64_t(a * scale + 0.5);
+	separator();
+	if (v < 0 && q > 0) m_out.push_back('-');
+	append_digits(q / scale);
+	if (decimals == 0) return *this;
+
+	char buf[10];
+	buf[0] = '.';
+	std::int64_t frac = q % scale;
+	for (int i = decimals; i > 0; --i)
+	{
+		buf[i] = '0' + frac % 10;
+		frac /= 10;
+	}
+	append(buf, decimals + 1);
+	return *this;
+}
+
+json_writer& json_writer::boolean(bool v)
+{
+	separator();
+	if (v) append("true", 4);
+	else append("false", 5);
+	return *this;
+}
+
+json_writer& json_writer::string(char const* str, int len)
+{
+	separator();
+	m_out.push_back('"');
+
+	unsigned char const* s = reinterpret_cast<unsigned char const*>(str);
+	unsigned char const* end = s + len;
+	while (s < end)
+	{
+		// copy runs of characters that don't need escaping in one go
+		unsigned char const* run = s;
+		while (s < end && *s > 0x1f && *s < 0x80 && *s != '"' && *s != '\\')
+			++s;
+		append(reinterpret_cast<char const*>(run), int(s - run));
+		if (s == end) break;
+
+		std::uint32_t cp = *s;
+		switch (cp)
+		{
+			case '"': append("\\\"", 2); ++s; continue;
+			case '\\': append("\\\\", 2); ++s; continue;
+			case '\n': append("\\n", 2); ++s; continue;
+			case '\r': append("\\r", 2); ++s; continue;
+			case '\t': append("\\t", 2); ++s; continue;
+			case '\b': append("\\b", 2); ++s; continue;
+			case '\f': append("\\f", 2); ++s; continue;
+		}
+
+		if (cp < 0x80)
+		{
+			++s;
+		}
+		else
+		{
+			// invalid UTF-8 is replaced, one byte at a time
+			int const n = decode_utf8(s, end, cp);
+			if (n == 0) cp = 0xfffd;
+			s += n == 0 ? 1 : n;
+		}
+
+		// everything outside of ASCII is escaped, code points outside of
+		// the basic plane as a surrogate pair
+		std::uint32_t units[2];
+		int num_units = 1;
+		units[0] = cp;
+		if (cp >= 0x10000)
+		{
+			cp -= 0x10000;
+			units[0] = 0xd800 + (cp >> 10);
+			units[1] = 0xdc00 + (cp & 0x3ff);
+			num_units = 2;
+		}
+		for (int i = 0; i < num_units; ++i)
+		{
+			char buf[6] = { '\\', 'u'
+				, hex_chars[(units[i] >> 12) & 0xf]
+				, hex_chars[(units[i] >> 8) & 0xf]
+				, hex_chars[(units[i] >> 4) & 0xf]
+				, hex_chars[units[i] & 0xf] };
+			append(buf, 6);
+		}
+	}
+
+	m_out.push_back('"');
+	return *this;
+}
+
+json_writer& json_writer::string(char const* s)
+{
+	return string(s, int(strlen(s)));
+}
+
+json_writer& json_writer::string(std::string const& s)
+{
+	return string(s.c_str(), int(s.size()));
+}
+
+json_writer& json_writer::hex(sha1_hash const& h)
+{
+	separator();
+	char buf[42];
+	char* p = buf;
+	*p++ = '"';
+	for (unsigned char const* i = h.begin(); i != h.end(); ++i)
+	{
+		*p++ = hex_chars[*i >> 4];
+		*p++ = hex_chars[*i & 0xf];
+	}
+	*p++ = '"';
+	append(buf, int(p - buf));
+	return *this;
+}
+
+json_writer& json_writer::raw(char const* s, int len)
+{
+	separator();
+	append(s, len);
+	if (m_stream) m_stream->maybe_flush();
+	return *this;
+}
+
+}
+
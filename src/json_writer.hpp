@@ -0,0 +1,106 @@
+/*
+
+Copyright (c) 2015, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_JSON_WRITER_HPP
+#define TORRENT_JSON_WRITER_HPP
+
+#include "libtorrent/peer_id.hpp" // for sha1_hash
+#include <vector>
+#include <string>
+#include <cstdint>
+
+namespace libtorrent
+{
+	struct chunked_response;
+
+	// writes JSON straight into a response buffer. Numbers are formatted
+	// and strings escaped in place, without going through printf or
+	// temporary strings. Commas between members and array items are
+	// inserted automatically.
+	struct json_writer
+	{
+		// appends to out. If continued is true, the writer is continuing an
+		// object someone else has already written members to, and the first
+		// key is preceded by a comma
+		json_writer(std::vector<char>& out, bool continued = false);
+
+		// writes to the response's buffer, and lets it send what's been
+		// written so far every time an array or object is closed
+		json_writer(chunked_response& out, bool continued = false);
+
+		// make room for at least this many more bytes
+		void reserve(int bytes);
+
+		json_writer& begin_object();
+		json_writer& end_object();
+		json_writer& begin_array();
+		json_writer& end_array();
+
+		// the key is written as-is, it must not need escaping
+		json_writer& key(char const* k);
+
+		json_writer& integer(std::int64_t v);
+		// fixed point, like printf's %f
+		json_writer& number(double v, int decimals = 6);
+		json_writer& boolean(bool v);
+		json_writer& string(char const* s, int len);
+		json_writer& string(char const* s);
+		json_writer& string(std::string const& s);
+		// the info-hash as a hex string
+		json_writer& hex(sha1_hash const& h);
+		// a value that's already been serialized, e.g. by another writer
+		json_writer& raw(char const* s, int len);
+
+	private:
+
+		// emits a comma if this isn't the first item in the current
+		// array or object
+		void separator();
+		void append(char const* s, int len);
+		void append_digits(std::uint64_t v);
+
+		std::vector<char>& m_out;
+
+		// if set, m_out is this response's buffer
+		chunked_response* m_stream;
+
+		// one bit per nesting level, the lowest for the current one. A bit
+		// is set until the first item at that level is written
+		std::uint64_t m_first;
+
+		// true right after a key, the value doesn't take a comma
+		bool m_after_key;
+	};
+}
+
+#endif
+
@@ -40,6 +40,9 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "local_mongoose.h"
 #include "auth.hpp"
 #include "torrent_history.hpp"
+#include "stats_sampler.hpp"
+#include "file_history.hpp"
+#include "command_batcher.hpp"
 #include <string.h>
 
 #include "alert_handler.hpp"
@@ -49,15 +52,25 @@ namespace libtorrent
 	namespace io = libtorrent::detail;
 
 	libtorrent_webui::libtorrent_webui(session& ses, torrent_history const* hist
-		, auth_interface const* auth, alert_handler* alert)
+		, stats_sampler const* stats, auth_interface const* auth, alert_handler* alert)
 		: m_ses(ses)
 		, m_hist(hist)
+		, m_stats(stats)
 		, m_auth(auth)
 		, m_alert(alert)
-		, m_stats_frame(0)
-	{}
+		, m_transaction_id(0)
+		, m_update_cache_frame(0)
+	{
+		// torrent_history subscribes to state updates too. Since it's
+		// constructed before us, it will have recorded the new frame by the
+		// time we're notified, and we can push it to the subscribers
+		m_alert->subscribe(this, 0, state_update_alert::alert_type, 0);
+	}
 
-	libtorrent_webui::~libtorrent_webui() {}
+	libtorrent_webui::~libtorrent_webui()
+	{
+		m_alert->unsubscribe(this);
+	}
 
 	bool libtorrent_webui::handle_websocket_connect(mg_connection* conn,
 		mg_request_info const* request_info)
@@ -106,6 +119,8 @@ namespace libtorrent
 		{ "list-stats", &libtorrent_webui::list_stats },
 		{ "get-stats", &libtorrent_webui::get_stats },
 		{ "get-file-updates", &libtorrent_webui::get_file_updates },
+		{ "subscribe-torrent-updates", &libtorrent_webui::subscribe_torrent_updates },
+		{ "batch", &libtorrent_webui::batch },
 	};
 
 	// maps torrent field to RPC field. These fields are the ones defined in
@@ -197,21 +212,215 @@ namespace libtorrent
 		std::uint64_t user_mask = io::read_uint64(st->data);
 		st->len -= 12;
 
-		std::vector<torrent_history_entry> torrents;
-		m_hist->updated_fields_since(frame, torrents);
+		std::vector<char> response;
+		torrent_updates_response(st, frame, user_mask, response);
+		return send_response(st, &response[0], response.size());
+	}
 
-		std::vector<sha1_hash> removed_torrents;
-		m_hist->removed_since(frame, removed_torrents);
+	// builds the response to get-torrent-updates and
+	// subscribe-torrent-updates. All of it is built from the same snapshot,
+	// to make the updates, removals and frame number consistent. Returns
+	// the frame the response brings the client up to
+	std::uint32_t libtorrent_webui::torrent_updates_response(conn_state* st
+		, std::uint32_t frame, std::uint64_t user_mask
+		, std::vector<char>& response)
+	{
+		std::shared_ptr<torrent_history_snapshot const> snapshot = m_hist->snapshot();
+		std::shared_ptr<std::vector<char> const> update
+			= torrent_updates(*snapshot, frame, user_mask);
 
-		std::vector<char> response;
+		response.reserve(4 + update->size());
 		std::back_insert_iterator<std::vector<char> > ptr(response);
 
 		io::write_uint8(st->function_id | 0x80, ptr);
 		io::write_uint16(st->transaction_id, ptr);
 		io::write_uint8(no_error, ptr);
+		response.insert(response.end(), update->begin(), update->end());
+		return snapshot->frame;
+	}
+
+	bool libtorrent_webui::subscribe_torrent_updates(conn_state* st)
+	{
+		if (st->len < 12) return error(st, truncated_message);
+
+		std::uint32_t frame = io::read_uint32(st->data);
+		std::uint64_t user_mask = io::read_uint64(st->data);
+		st->len -= 12;
+
+		std::vector<char> response;
+		std::uint32_t const new_frame
+			= torrent_updates_response(st, frame, user_mask, response);
+
+		{
+			// the response brings the subscriber up to the snapshot's frame,
+			// subsequent pushes are relative to it
+			std::unique_lock<std::mutex> l(m_subscribers_mutex);
+			if (user_mask == 0)
+			{
+				m_subscribers.erase(st->conn);
+			}
+			else
+			{
+				subscription& s = m_subscribers[st->conn];
+				s.frame = new_frame;
+				s.mask = user_mask;
+			}
+		}
+
+		return send_response(st, &response[0], response.size());
+	}
+
+	void libtorrent_webui::handle_alert(alert const* a)
+	{
+		state_update_alert const* su = alert_cast<state_update_alert>(a);
+		if (su == NULL) return;
+
+		std::uint32_t const frame = m_hist->snapshot()->frame;
+
+		// the updates are sent by the threads serving the sockets, this
+		// thread mustn't wait for clients. An entry in m_subscribers means
+		// the connection hasn't ended, since that removes it first
+		std::unique_lock<std::mutex> l(m_subscribers_mutex);
+		for (subscribers_t::iterator i = m_subscribers.begin()
+			, end(m_subscribers.end()); i != end; ++i)
+		{
+			if (i->second.frame >= frame) continue;
+			mg_wakeup_websocket(i->first);
+		}
+	}
+
+	// called on the thread serving the socket, after handle_alert() woke it
+	// up or once the socket has caught up with what it was sent
+	void libtorrent_webui::handle_websocket_wakeup(mg_connection* conn)
+	{
+		// a subscriber that hasn't received the last update yet is skipped.
+		// The next update it gets covers everything since then
+		if (mg_write_pending(conn) > 0) return;
+
+		subscription sub;
+		{
+			std::unique_lock<std::mutex> l(m_subscribers_mutex);
+			subscribers_t::iterator i = m_subscribers.find(conn);
+			if (i == m_subscribers.end()) return;
+			sub = i->second;
+		}
+
+		std::shared_ptr<torrent_history_snapshot const> snapshot = m_hist->snapshot();
+		if (sub.frame >= std::uint32_t(snapshot->frame)) return;
+
+		// subscribers that are in sync with each other and asked for the
+		// same fields share the same encoded update
+		std::shared_ptr<std::vector<char> const> update
+			= torrent_updates(*snapshot, sub.frame, sub.mask);
+
+		// don't bother idle clients with updates that don't change
+		// anything
+		char const* counts = &(*update)[4];
+		bool const empty = io::read_uint8(counts) == 0
+			&& io::read_uint32(counts) == 0
+			&& io::read_uint32(counts) == 0;
+
+		bool ok = true;
+		if (!empty)
+		{
+			std::vector<char> call;
+			call.reserve(3 + update->size());
+			std::back_insert_iterator<std::vector<char> > ptr(call);
+
+			io::write_uint8(subscribe_torrent_updates_id, ptr);
+			io::write_uint16(std::uint16_t(m_transaction_id++), ptr);
+			call.insert(call.end(), update->begin(), update->end());
+
+			ok = send_packet(conn, 0x2, &call[0], call.size());
+		}
+
+		std::unique_lock<std::mutex> l(m_subscribers_mutex);
+		subscribers_t::iterator i = m_subscribers.find(conn);
+		if (i == m_subscribers.end()) return;
+		if (!ok) m_subscribers.erase(i);
+		else i->second.frame = snapshot->frame;
+	}
+
+	void libtorrent_webui::handle_end_request(mg_connection* conn)
+	{
+		{
+			std::unique_lock<std::mutex> l(m_subscribers_mutex);
+			m_subscribers.erase(conn);
+		}
+		websocket_handler::handle_end_request(conn);
+	}
+
+	// returns the encoded get-torrent-updates response for a client at the
+	// specified frame
+	std::shared_ptr<std::vector<char> const> libtorrent_webui::torrent_updates(
+		torrent_history_snapshot const& snapshot, std::uint32_t frame
+		, std::uint64_t user_mask)
+	{
+		// clients polling from the same frame with the same mask get the
+		// exact same update. Only the first one of them has to encode it
+		std::pair<std::uint32_t, std::uint64_t> const key(frame, user_mask);
+		std::shared_ptr<std::vector<char> const> cached;
+		{
+			std::unique_lock<std::mutex> l(m_update_cache_mutex);
+			if (snapshot.frame > m_update_cache_frame)
+			{
+				m_update_cache.clear();
+				m_update_cache_frame = snapshot.frame;
+			}
+			if (snapshot.frame == m_update_cache_frame)
+			{
+				update_cache_t::iterator i = m_update_cache.find(key);
+				if (i != m_update_cache.end()) cached = i->second;
+			}
+		}
+
+		if (!cached)
+		{
+			std::shared_ptr<std::vector<char> > encoded
+				= std::make_shared<std::vector<char> >();
+			encode_torrent_updates(snapshot, frame, user_mask, *encoded);
+			cached = encoded;
+
+			std::unique_lock<std::mutex> l(m_update_cache_mutex);
+			// the cache may have moved on to a newer frame while we were
+			// encoding. Don't let a single client fill it with an unbounded
+			// number of masks either
+			if (snapshot.frame == m_update_cache_frame
+				&& m_update_cache.size() < max_update_cache_size)
+				m_update_cache.insert(std::make_pair(key, cached));
+		}
+		return cached;
+	}
+
+	// encodes the get-torrent-updates response for a client at the specified
+	// frame, not including the RPC response header
+	void libtorrent_webui::encode_torrent_updates(torrent_history_snapshot const& snapshot
+		, std::uint32_t frame, std::uint64_t user_mask, std::vector<char>& response) const
+	{
+		// only scan the fields the caller asked for
+		torrent_history_entry::field_mask fields;
+		for (int k = 0; k < torrent_history_entry::num_fields; ++k)
+		{
+			int f = torrent_field_map[k];
+			if (f < 0) continue;
+			if ((user_mask & (std::uint64_t(1) << f)) == 0) continue;
+			fields.set(k);
+		}
+
+		std::vector<torrent_history_entry> torrents;
+		std::vector<sha1_hash> removed_torrents;
+		bool const resync = snapshot.updated_fields_since(frame, fields
+			, torrents, removed_torrents);
+
+		std::back_insert_iterator<std::vector<char> > ptr(response);
 
 		// frame number (uint32)
-		io::write_uint32(m_hist->frame(), ptr);
+		io::write_uint32(snapshot.frame, ptr);
+
+		// flags (uint8). If the frame the client asked for has been dropped
+		// from the journal, all torrents are sent and the client needs to
+		// forget about any torrent not in this update
+		io::write_uint8(resync ? 1 : 0, ptr);
 
 		// allocate space for torrent count
 		// this will be filled in later when we know
@@ -398,8 +607,6 @@ namespace libtorrent
 		{
 			std::copy(i->begin(), i->end(), ptr);
 		}
-
-		return send_packet(st->conn, 0x2, &response[0], response.size());
 	}
 
 	int libtorrent_webui::parse_torrent_args(std::vector<torrent_status>& torrents, conn_state* st)
@@ -434,111 +641,138 @@ namespace libtorrent
 
 	bool libtorrent_webui::start(conn_state* st)
 	{
+		command_batcher commands;
 		TORRENT_APPLY_FUN
 		{
-			i->handle.auto_managed(true);
-			i->handle.clear_error();
-			i->handle.resume();
+			commands.add(i->handle, command_batcher::clear_error
+				| command_batcher::set_auto_managed
+				| command_batcher::resume_torrent);
 		}
+		commands.flush();
 		return respond(st, 0, torrents.size());
 	}
 
 	bool libtorrent_webui::stop(conn_state* st)
 	{
+		command_batcher commands;
 		TORRENT_APPLY_FUN
 		{
-			i->handle.auto_managed(false);
-			i->handle.pause();
+			commands.add(i->handle, command_batcher::clear_auto_managed
+				| command_batcher::pause_torrent);
 		}
+		commands.flush();
 		return respond(st, 0, torrents.size());
 	}
 
 	bool libtorrent_webui::set_auto_managed(conn_state* st)
 	{
+		command_batcher commands;
 		TORRENT_APPLY_FUN
 		{
-			i->handle.auto_managed(true);
+			commands.add(i->handle, command_batcher::set_auto_managed);
 		}
+		commands.flush();
 		return respond(st, 0, torrents.size());
 	}
 	bool libtorrent_webui::clear_auto_managed(conn_state* st)
 	{
+		command_batcher commands;
 		TORRENT_APPLY_FUN
 		{
-			i->handle.auto_managed(false);
+			commands.add(i->handle, command_batcher::clear_auto_managed);
 		}
+		commands.flush();
 		return respond(st, 0, torrents.size());
 	}
 	bool libtorrent_webui::queue_up(conn_state* st)
 	{
+		command_batcher commands;
 		TORRENT_APPLY_FUN
 		{
-			i->handle.queue_position_up();
+			commands.add(i->handle, command_batcher::queue_up);
 		}
+		commands.flush();
 		return respond(st, 0, torrents.size());
 	}
 	bool libtorrent_webui::queue_down(conn_state* st)
 	{
+		command_batcher commands;
 		TORRENT_APPLY_FUN
 		{
-			i->handle.queue_position_down();
+			commands.add(i->handle, command_batcher::queue_down);
 		}
+		commands.flush();
 		return respond(st, 0, torrents.size());
 	}
 	bool libtorrent_webui::queue_top(conn_state* st)
 	{
+		command_batcher commands;
 		TORRENT_APPLY_FUN
 		{
-			i->handle.queue_position_top();
+			commands.add(i->handle, command_batcher::queue_top);
 		}
+		commands.flush();
 		return respond(st, 0, torrents.size());
 	}
 	bool libtorrent_webui::queue_bottom(conn_state* st)
 	{
+		command_batcher commands;
 		TORRENT_APPLY_FUN
 		{
-			i->handle.queue_position_bottom();
+			commands.add(i->handle, command_batcher::queue_bottom);
 		}
+		commands.flush();
 		return respond(st, 0, torrents.size());
 	}
 	bool libtorrent_webui::remove(conn_state* st)
 	{
+		command_batcher commands;
 		TORRENT_APPLY_FUN
 		{
-			m_ses.remove_torrent(i->handle);
+			commands.add(i->handle, command_batcher::remove_torrent);
 		}
+		commands.flush();
 		return respond(st, 0, torrents.size());
 	}
 	bool libtorrent_webui::remove_and_data(conn_state* st)
 	{
+		command_batcher commands;
 		TORRENT_APPLY_FUN
 		{
-			m_ses.remove_torrent(i->handle, session::delete_files);
+			commands.add(i->handle, command_batcher::remove_torrent
+				| command_batcher::delete_files);
 		}
+		commands.flush();
 		return respond(st, 0, torrents.size());
 	}
 	bool libtorrent_webui::force_recheck(conn_state* st)
 	{
+		command_batcher commands;
 		TORRENT_APPLY_FUN
 		{
-			i->handle.force_recheck();
+			commands.add(i->handle, command_batcher::force_recheck);
 		}
+		commands.flush();
 		return respond(st, 0, torrents.size());
 	}
 	bool libtorrent_webui::set_sequential_download(conn_state* st)
 	{
+		command_batcher commands;
 		TORRENT_APPLY_FUN
 		{
-			i->handle.set_sequential_download(true);
+			commands.add(i->handle, command_batcher::set_sequential);
 		}
+		commands.flush();
 		return respond(st, 0, torrents.size());
 	}
 	bool libtorrent_webui::clear_sequential_download(conn_state* st)
 	{
+		command_batcher commands;
 		TORRENT_APPLY_FUN
 		{
-			i->handle.set_sequential_download(false);
+			commands.add(i->handle, command_batcher::clear_sequential);
 		}
+		commands.flush();
 		return respond(st, 0, torrents.size());
 	}
 
@@ -592,7 +826,7 @@ namespace libtorrent
 			TORRENT_ASSERT(i < 65536);
 			io::write_uint16(i, ptr);
 		}
-		return send_packet(st->conn, 0x2, &response[0], response.size());
+		return send_response(st, &response[0], response.size());
 	}
 
 	bool libtorrent_webui::set_settings(conn_state* st)
@@ -689,7 +923,7 @@ namespace libtorrent
 			}
 		}
 
-		return send_packet(st->conn, 0x2, &response[0], response.size());
+		return send_response(st, &response[0], response.size());
 	}
 
 	bool libtorrent_webui::list_stats(conn_state* st)
@@ -715,7 +949,7 @@ namespace libtorrent
 			std::copy(i->name, i->name + len, ptr);
 		}
 
-		return send_packet(st->conn, 0x2, &response[0], response.size());
+		return send_response(st, &response[0], response.size());
 	}
 
 	bool libtorrent_webui::get_stats(conn_state* st)
@@ -735,49 +969,25 @@ namespace libtorrent
 		io::write_uint16(st->transaction_id, ptr);
 		io::write_uint8(no_error, ptr);
 
-		std::future<alert*> f
-			= m_alert->subscribe<session_stats_alert>();
-		m_ses.post_session_stats();
-		// wait for the alert to arrive
-		std::auto_ptr<session_stats_alert> ss((session_stats_alert*)f.get());
-
-		if (ss.get() == NULL) return error(st, no_such_function);
-		TORRENT_ASSERT(ss.get());
-
-		std::unique_lock<std::mutex> l(m_stats_mutex);
-		++m_stats_frame;
-		io::write_uint32(m_stats_frame, ptr);
-
-		std::uint64_t* stats = ss->values;
-
-		if (m_stats.size() < counters::num_counters)
-			m_stats.resize(counters::num_counters
-				, std::pair<std::uint64_t, std::uint32_t>(0, 0));
+		// the stats sampler keeps the latest counters and the frame each
+		// of them changed in, we never have to wait for them
+		std::shared_ptr<stats_sample const> sample = m_stats->sample();
+		io::write_uint32(sample->frame, ptr);
 
 		// we'll fill in the counter later
 		int counter_pos = response.size();
 		io::write_uint16(0, ptr);
 
-		// first update our copy of the stats, and update their frame counters
-		for (int i = 0; i < counters::num_counters; ++i)
-		{
-			if (m_stats[i].first != stats[i])
-			{
-				m_stats[i].second = m_stats_frame;
-				m_stats[i].first = stats[i];
-			}
-		}
-
 		int num_updates = 0;
 		for (int i = 0; i < num_stats; ++i)
 		{
 			int c = io::read_uint16(iptr);
-			if (c < 0 || c > m_stats.size())
+			if (c < 0 || c >= counters::num_counters)
 				return error(st, invalid_argument);
 
-			if (m_stats[c].second <= frame) continue;
+			if (sample->changed[c] <= frame) continue;
 			io::write_uint16(c, ptr);
-			io::write_uint64(m_stats[c].first, ptr);
+			io::write_uint64(sample->values[c], ptr);
 			++num_updates;
 		}
 
@@ -785,7 +995,7 @@ namespace libtorrent
 		char* counter_ptr = &response[counter_pos];
 		io::write_uint16(num_updates, counter_ptr);
 
-		return send_packet(st->conn, 0x2, &response[0], response.size());
+		return send_response(st, &response[0], response.size());
 	}
 
 	bool libtorrent_webui::get_file_updates(conn_state* st)
@@ -807,55 +1017,65 @@ namespace libtorrent
 		io::write_uint16(st->transaction_id, ptr);
 		io::write_uint8(no_error, ptr);
 
-		std::vector<std::int64_t> fp;
-		h.file_progress(fp, torrent_handle::piece_granularity);
-
-		shared_ptr<const torrent_info> t = h.torrent_file();
-		if (!t) return error(st, resource_not_found);
+		std::unique_lock<std::mutex> l;
+		std::shared_ptr<torrent_files> f = m_files.get(h, l);
+		if (!f) return error(st, resource_not_found);
 
-		file_storage const& fs = t->files();
-
-		// just in case
-		fp.resize(fs.num_files(), 0);
+		file_storage const& fs = f->torrent_file->files();
 
 		// frame number
-		io::write_uint32(0, ptr);
+		io::write_uint32(f->frame, ptr);
 
 		// number of files
 		io::write_uint32(fs.num_files(), ptr);
 
-		// TODO: we should really just send differences since last time
-		// for now, just send full updates
+		bool const send_static = f->static_frame > frame;
+
+		int mask_pos = 0;
 		for (int i = 0; i < fs.num_files(); ++i)
 		{
 			if ((i % 8) == 0)
 			{
-				std::uint8_t mask = 0xff;
-				if (fs.num_files() - i < 8)
-					mask <<= 8 - fs.num_files() + i;
-				io::write_uint8(mask, ptr);
+				// the bits are filled in as we go
+				mask_pos = response.size();
+				io::write_uint8(0, ptr);
 			}
 
-			// file update bitmask (all 4 fields)
-			io::write_uint16(0xf, ptr);
+			std::uint16_t fields = 0;
+			if (send_static) fields |= 0x7;
+			if (f->progress_frame[i] > frame) fields |= 0x8;
+			if (f->priority_frame[i] > frame) fields |= 0x10;
+			if (fields == 0) continue;
+
+			response[mask_pos] |= 0x80 >> (i % 8);
 
-			// flags
-			io::write_uint8(fs.file_flags(i), ptr);
+			// file update bitmask
+			io::write_uint16(fields, ptr);
 
-			// name
-			std::string name = fs.file_path(i);
-			if (name.size() > 65535) name.resize(65535);
-			io::write_uint16(name.size(), ptr);
-			std::copy(name.begin(), name.end(), ptr);
+			if (send_static)
+			{
+				// flags
+				io::write_uint8(fs.file_flags(i), ptr);
+
+				// name
+				std::string name = fs.file_path(i);
+				if (name.size() > 65535) name.resize(65535);
+				io::write_uint16(name.size(), ptr);
+				std::copy(name.begin(), name.end(), ptr);
 
-			// total-size
-			io::write_uint64(fs.file_size(i), ptr);
+				// total-size
+				io::write_uint64(fs.file_size(i), ptr);
+			}
 
 			// total downloaded
-			io::write_uint64(fp[i], ptr);
+			if (fields & 0x8) io::write_uint64(f->progress[i], ptr);
+
+			// priority
+			if (fields & 0x10) io::write_uint8(f->priority[i], ptr);
 		}
+		l.unlock();
 
-		return send_packet(st->conn, 0x2, &response[0], response.size());
+		return send_response(st, &response[0], response.size());
 	}
 
 	char const* fun_name(int function_id)
@@ -868,7 +1088,7 @@ namespace libtorrent
 		return functions[function_id].name;
 	}
 
-	bool libtorrent_webui::handle_websocket_data(mg_connection* conn
+	bool libtorrent_webui::handle_websocket_message(mg_connection* conn
 		, int bits, char* data, size_t length)
 	{
 		// TODO: this should really be handled at one layer below
@@ -898,6 +1118,7 @@ namespace libtorrent
 
 		conn_state st;
 		st.conn = conn;
+		st.batch = NULL;
 
 		st.data = data;
 		st.function_id = io::read_uint8(st.data);
@@ -945,7 +1166,7 @@ namespace libtorrent
 		io::write_uint8(no_error, ptr);
 		io::write_uint16(val, ptr);
 
-		return send_packet(st->conn, 0x2, rpc, 8);
+		return send_response(st, rpc, 6);
 	}
 
 	bool libtorrent_webui::error(conn_state* st, int error)
@@ -956,7 +1177,68 @@ namespace libtorrent
 		io::write_uint16(st->transaction_id, ptr);
 		io::write_uint8(error, ptr);
 
-		return send_packet(st->conn, 0x2, rpc, 4);
+		return send_response(st, rpc, 4);
+	}
+
+	bool libtorrent_webui::batch(conn_state* st)
+	{
+		// batches can't be nested
+		if (st->batch) return error(st, invalid_argument);
+
+		// make sure the whole batch is well formed before running any of
+		// the calls in it
+		char const* end = st->data + st->len;
+		for (char const* ptr = st->data; ptr != end;)
+		{
+			if (end - ptr < 4) return error(st, truncated_message);
+			std::uint32_t const len = io::read_uint32(ptr);
+			if (len < 3 || len > std::uint32_t(end - ptr))
+				return error(st, truncated_message);
+			if (std::uint8_t(*ptr) & 0x80) return error(st, invalid_argument_type);
+			ptr += len;
+		}
+
+		std::vector<char> response;
+		std::back_insert_iterator<std::vector<char> > out(response);
+		io::write_uint8(st->function_id | 0x80, out);
+		io::write_uint16(st->transaction_id, out);
+		io::write_uint8(no_error, out);
+
+		bool ret = true;
+		for (char* ptr = st->data; ptr != end;)
+		{
+			std::uint32_t const len = io::read_uint32(ptr);
+
+			conn_state call;
+			call.conn = st->conn;
+			call.perms = st->perms;
+			call.batch = &response;
+			call.data = ptr;
+			call.function_id = io::read_uint8(call.data);
+			call.transaction_id = io::read_uint16(call.data);
+			call.len = ptr + len - call.data;
+			ptr += len;
+
+			if (call.function_id < sizeof(functions)/sizeof(functions[0]))
+				ret &= (this->*functions[call.function_id].handler)(&call);
+			else
+				ret &= error(&call, no_such_function);
+		}
+
+		return send_packet(st->conn, 0x2, &response[0], response.size()) && ret;
+	}
+
+	bool libtorrent_webui::send_response(conn_state* st, char const* buffer, int len)
+	{
+		if (st->batch == NULL)
+			return send_packet(st->conn, 0x2, buffer, len);
+
+		// this is a call in a batch. Its response is sent as part of the
+		// batch's response, once all calls have been made
+		std::back_insert_iterator<std::vector<char> > ptr(*st->batch);
+		io::write_uint32(len, ptr);
+		st->batch->insert(st->batch->end(), buffer, buffer + len);
+		return true;
 	}
 
 	bool libtorrent_webui::call_rpc(mg_connection* conn, int function, char const* data, int len)
@@ -34,8 +34,14 @@ POSSIBILITY OF SUCH DAMAGE.
 #define TORRENT_LIBTORRENT_WEBUI_HPP
 
 #include "websocket_handler.hpp"
+#include "alert_observer.hpp"
+#include "file_history.hpp"
 #include "libtorrent/torrent_handle.hpp"
 #include <boost/atomic.hpp>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
 
 struct mg_connection;
 
@@ -43,20 +49,30 @@ namespace libtorrent
 {
 	struct permissions_interface;
 	struct torrent_history;
+	struct torrent_history_snapshot;
+	struct stats_sampler;
 	struct auth_interface;
 	struct alert_handler;
 	class session;
 
-	struct libtorrent_webui : websocket_handler
+	struct libtorrent_webui : websocket_handler, alert_observer
 	{
 		libtorrent_webui(session& ses, torrent_history const* hist
-			, auth_interface const* auth, alert_handler* alerts);
+			, stats_sampler const* stats, auth_interface const* auth
+			, alert_handler* alerts);
 		~libtorrent_webui();
 
 		virtual bool handle_websocket_connect(mg_connection* conn,
 			mg_request_info const* request_info);
-		virtual bool handle_websocket_data(mg_connection* conn
+		virtual bool handle_websocket_message(mg_connection* conn
 			, int bits, char* data, size_t length);
+		virtual void handle_end_request(mg_connection* conn);
+
+		// wakes up the subscribers' sockets when there's a new frame
+		virtual void handle_alert(alert const* a);
+
+		// pushes the new frame to a subscriber
+		virtual void handle_websocket_wakeup(mg_connection* conn);
 
 		struct conn_state
 		{
@@ -66,6 +82,9 @@ namespace libtorrent
 			char* data;
 			int len;
 			permissions_interface const* perms;
+			// set for calls that are part of a batch. Their responses are
+			// collected here instead of being sent
+			std::vector<char>* batch;
 		};
 
 		bool get_torrent_updates(conn_state* st);
@@ -92,11 +111,21 @@ namespace libtorrent
 
 		bool get_file_updates(conn_state* st);
 
+		bool subscribe_torrent_updates(conn_state* st);
+
+		// runs all calls carried by this call, and responds with all of
+		// their responses in one message
+		bool batch(conn_state* st);
+
 		// parse the arguments to the simple torrent commands
 		int parse_torrent_args(std::vector<torrent_status>& torrents, conn_state* st);
 
 		bool call_rpc(mg_connection* conn, int function, char const* data, int len);
 
+		// sends the response to a call, or adds it to the batch the call
+		// is part of
+		bool send_response(conn_state* st, char const* buffer, int len);
+
 		bool respond(conn_state* st, int error, int val);
 
 		// respond with an error to an RPC
@@ -115,20 +144,55 @@ namespace libtorrent
 
 	private:
 
+		// the function-id of subscribe-torrent-updates. It's also used by
+		// the calls pushing updates to the subscribers
+		enum { subscribe_torrent_updates_id = 20 };
+
+		std::uint32_t torrent_updates_response(conn_state* st
+			, std::uint32_t frame, std::uint64_t user_mask
+			, std::vector<char>& response);
+		std::shared_ptr<std::vector<char> const> torrent_updates(
+			torrent_history_snapshot const& snapshot, std::uint32_t frame
+			, std::uint64_t user_mask);
+		void encode_torrent_updates(torrent_history_snapshot const& snapshot
+			, std::uint32_t frame, std::uint64_t user_mask
+			, std::vector<char>& response) const;
+
 		session& m_ses;
 		torrent_history const* m_hist;
+		stats_sampler const* m_stats;
 		auth_interface const* m_auth;
 		alert_handler* m_alert;
 		boost::atomic<int> m_transaction_id;
 
-		std::mutex m_stats_mutex;
-		// TODO: factor this out into its own class
-		// the frame numbers where the stats counters changed
-		std::vector<std::pair<std::uint64_t, std::uint32_t> > m_stats;
-		// the current stats frame (incremented every time) stats
-		// are requested
-		std::uint32_t m_stats_frame;
+		// encoded get-torrent-updates responses (without the RPC header)
+		// for the current torrent_history frame, keyed by the frame and
+		// field mask the client asked for. Entries are shared with the
+		// connections sending them, and the whole cache is dropped once
+		// a newer frame is published
+		typedef std::map<std::pair<std::uint32_t, std::uint64_t>
+			, std::shared_ptr<std::vector<char> const> > update_cache_t;
+		enum { max_update_cache_size = 64 };
+		std::mutex m_update_cache_mutex;
+		update_cache_t m_update_cache;
+		int m_update_cache_frame;
+
+		struct subscription
+		{
+			// the frame the subscriber has been sent updates up to
+			std::uint32_t frame;
+			// the fields the subscriber wants
+			std::uint64_t mask;
+		};
+
+		// websockets that have subscribed to torrent updates
+		typedef std::map<mg_connection*, subscription> subscribers_t;
+		std::mutex m_subscribers_mutex;
+		subscribers_t m_subscribers;
 
+		// the state of the files of torrents clients are asking for, used
+		// to only send the files that changed since their last request
+		file_history m_files;
 	};
 }
 
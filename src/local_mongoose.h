@@ -23,6 +23,7 @@
 
 #include <stdio.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -94,6 +95,11 @@ struct mg_callbacks {
   int  (*websocket_data)(struct mg_connection *, int bits,
                          char *data, size_t data_len);
 
+  // Called on the thread serving a websocket after mg_wakeup_websocket()
+  // was called for it, and when data that was queued by mg_write() has
+  // been sent to the client.
+  void (*websocket_wakeup)(struct mg_connection *);
+
   // Called when mongoose tries to open a file. Used to intercept file open
   // calls, and serve file data from memory instead.
   // Parameters:
@@ -208,6 +214,40 @@ struct mg_request_info *mg_get_request_info(struct mg_connection *);
 int mg_write(struct mg_connection *, const void *buf, size_t len);
 
 
+// Send len bytes of the open file fd, starting at offset, to the client.
+// On Linux, connections without SSL or throttling use sendfile().
+// Return the number of bytes sent, or -1 on error.
+int64_t mg_write_file(struct mg_connection *, int fd, int64_t offset,
+                      int64_t len);
+
+
+// Return 0 if the client has closed the connection or the server is
+// stopping, without blocking. Data the client sent is left unread.
+int mg_is_connected(struct mg_connection *);
+
+
+// Return the number of bytes passed to mg_write() that haven't been sent yet.
+// Writes to websockets are queued rather than blocking when the client
+// doesn't keep up.
+int mg_write_pending(struct mg_connection *);
+
+
+// Have the websocket_wakeup callback called for a websocket, on the thread
+// serving it. This may be called from any thread, and doesn't block.
+void mg_wakeup_websocket(struct mg_connection *);
+
+
+// Tell mongoose the current request will take a long time, like a large
+// download. Another worker thread is started to take this one's place, and
+// this one exits once the connection is done. At most max_detached_threads
+// threads are out of the pool at a time.
+// Return:
+//   1 if this thread is out of the pool
+//   0 if the limit is reached, or the server is stopping. The request is
+//     still served on this thread, in the pool
+int mg_detach_worker(struct mg_connection *);
+
+
 // Macros for enabling compiler-specific checks for printf-like arguments.
 #undef PRINTF_FORMAT_STRING
 #if _MSC_VER >= 1400
@@ -250,6 +290,13 @@ int mg_read(struct mg_connection *, void *buf, size_t len);
 const char *mg_get_header(const struct mg_connection *, const char *name);
 
 
+// Set the Sec-WebSocket-Extensions header of the websocket handshake
+// response. This may be called from the websocket_connect callback, to
+// accept extensions offered by the client.
+void mg_set_websocket_extensions(struct mg_connection *,
+                                 const char *extensions);
+
+
 // Get a value of particular form variable.
 //
 // Parameters:
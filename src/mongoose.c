@@ -194,6 +194,9 @@ struct pollfd {
   short revents;
 };
 #define POLLIN 1
+#define POLLERR 8
+#define POLLHUP 16
+#define POLLNVAL 32
 #endif
 
 
@@ -206,6 +209,16 @@ struct pollfd {
 #include <sys/wait.h>
 #include <sys/socket.h>
 #include <sys/poll.h>
+#if defined(__linux__) && !defined(NO_EPOLL)
+// idle keep-alive connections and web sockets wait in the master thread's
+// epoll set instead of holding on to a worker thread
+#define USE_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
@@ -254,6 +267,8 @@ typedef int SOCKET;
 #define MAX_CGI_ENVIR_VARS 64
 #define MG_BUF_LEN 8192
 #define MAX_REQUEST_SIZE 16384
+// A web socket with more output than this waiting to be sent is closed
+#define MAX_WEBSOCKET_OUTPUT (64 * 1024 * 1024)
 #define ARRAY_SIZE(array) (sizeof(array) / sizeof(array[0]))
 
 #ifdef _WIN32
@@ -434,7 +449,23 @@ struct socket {
   union usa rsa;        // Remote socket address
   unsigned is_ssl:1;    // Is port SSL-ed
   unsigned ssl_redir:1; // Is port supposed to redirect everything to SSL port
+#if defined(USE_EPOLL)
+  struct mg_connection *conn; // Detached web socket queued for a worker
+#endif
+};
+
+#if defined(USE_EPOLL)
+// A connection waiting in the master thread's epoll set. Either an idle
+// keep-alive connection waiting for its next request, or a web socket
+// waiting for its next frame
+struct parked_socket {
+  struct socket so;           // The keep-alive connection
+  struct mg_connection *conn; // The web socket, NULL for keep-alive
+  time_t since;               // When the keep-alive connection was parked
+  struct parked_socket *prev; // Keep-alive connections parked before
+  struct parked_socket *next; // and after this one
 };
+#endif
 
 // NOTE(lsm): this enum shoulds be in sync with the config_options below.
 enum {
@@ -444,6 +475,7 @@ enum {
   GLOBAL_PASSWORDS_FILE, INDEX_FILES, ENABLE_KEEP_ALIVE, ACCESS_CONTROL_LIST,
   EXTRA_MIME_TYPES, LISTENING_PORTS, DOCUMENT_ROOT, SSL_CERTIFICATE,
   NUM_THREADS, RUN_AS_USER, REWRITE, HIDE_FILES, REQUEST_TIMEOUT,
+  MAX_DETACHED_THREADS,
   NUM_OPTIONS
 };
 
@@ -473,6 +505,7 @@ static const char *config_options[] = {
   "url_rewrite_patterns", NULL,
   "hide_files_patterns", NULL,
   "request_timeout_ms", "30000",
+  "max_detached_threads", "64",
   NULL
 };
 
@@ -487,6 +520,7 @@ struct mg_context {
   int num_listening_sockets;
 
   volatile int num_threads;  // Number of threads
+  volatile int num_detached; // Threads that left the pool, mg_detach_worker()
   pthread_mutex_t mutex;     // Protects (max|num)_threads
   pthread_cond_t  cond;      // Condvar for tracking workers terminations
 
@@ -495,6 +529,16 @@ struct mg_context {
   volatile int sq_tail;      // Tail of the socket queue
   pthread_cond_t sq_full;    // Signaled when socket is produced
   pthread_cond_t sq_empty;   // Signaled when socket is consumed
+
+#if defined(USE_EPOLL)
+  int epoll_fd;                  // Listening sockets, parked connections
+                                 // and web sockets
+  int wakeup_fd;                 // Signalled by mg_wakeup_websocket()
+  struct parked_socket *parked_head; // Parked connections, oldest first
+  struct parked_socket *parked_tail;
+  struct mg_connection *wakeups; // Web sockets woken up, to be queued
+  struct mg_connection *websockets; // All detached web sockets
+#endif
 };
 
 struct mg_connection {
@@ -517,6 +561,17 @@ struct mg_connection {
   int throttle;               // Throttling, bytes/sec. <= 0 means no throttle
   time_t last_throttle_time;  // Last time throttled data was sent
   int64_t last_throttle_bytes;// Bytes sent this second
+  char ws_extensions[100];    // Sec-WebSocket-Extensions of the handshake
+  int leave_pool;             // Worker exits after this connection
+  int wakeup;                 // mg_wakeup_websocket() was called
+#if defined(USE_EPOLL)
+  struct parked_socket ws;    // Epoll registration of a detached web socket
+  int ws_queued;              // Held by a worker, or on its way to one
+  struct mg_connection *next_wakeup;
+  struct mg_connection *prev_ws, *next_ws; // ctx->websockets list
+  char *out;                  // Web socket output not sent yet
+  int out_len, out_size;
+#endif
 };
 
 // Directory entry
@@ -833,6 +888,11 @@ const char *mg_get_header(const struct mg_connection *conn, const char *name) {
   return get_header(&conn->request_info, name);
 }
 
+void mg_set_websocket_extensions(struct mg_connection *conn,
+                                 const char *extensions) {
+  mg_strlcpy(conn->ws_extensions, extensions, sizeof(conn->ws_extensions));
+}
+
 // A helper function for traversing a comma separated list of values.
 // It returns a list pointer shifted to the next value, or NULL if the end
 // of the list found.
@@ -1573,10 +1633,71 @@ int mg_read(struct mg_connection *conn, void *buf, size_t len) {
   return nread;
 }
 
+#if defined(USE_EPOLL)
+// Sends as much of a detached web socket's pending output as the socket
+// takes without blocking. Returns 0 if the connection failed.
+static int flush_websocket_output(struct mg_connection *conn) {
+  int n;
+
+  while (conn->out_len > 0) {
+    n = send(conn->client.sock, conn->out, (size_t) conn->out_len,
+             MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n < 0 && ERRNO == EINTR) continue;
+    if (n < 0 && (ERRNO == EAGAIN || ERRNO == EWOULDBLOCK)) break;
+    if (n <= 0) return 0;
+    memmove(conn->out, conn->out + n, conn->out_len - n);
+    conn->out_len -= n;
+  }
+  return 1;
+}
+
+// Writes to a detached web socket never block. Whatever the socket doesn't
+// take right away is kept, and sent once the socket becomes writable.
+static int write_websocket(struct mg_connection *conn, const char *buf,
+                           int len) {
+  char *p;
+  int n = 0, size;
+
+  if (conn->out_len == 0) {
+    n = send(conn->client.sock, buf, (size_t) len, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n < 0 && ERRNO != EAGAIN && ERRNO != EWOULDBLOCK && ERRNO != EINTR) {
+      return -1;
+    }
+    if (n < 0) n = 0;
+  }
+
+  if (n < len) {
+    if (conn->out_len + len - n > MAX_WEBSOCKET_OUTPUT) {
+      return -1;
+    }
+    if (conn->out_len + len - n > conn->out_size) {
+      size = (conn->out_len + len - n) * 2;
+      if (size < MG_BUF_LEN) size = MG_BUF_LEN;
+      if ((p = (char *) realloc(conn->out, size)) == NULL) {
+        return -1;
+      }
+      conn->out = p;
+      conn->out_size = size;
+    }
+    memcpy(conn->out + conn->out_len, buf + n, len - n);
+    conn->out_len += len - n;
+  }
+  return len;
+}
+#endif
+
 int mg_write(struct mg_connection *conn, const void *buf, size_t len) {
   time_t now;
   int64_t n, total, allowed;
 
+#if defined(USE_EPOLL)
+  // SSL writes can't be split up like this, those block like on any
+  // other connection
+  if (conn->ws.conn != NULL && conn->ssl == NULL) {
+    return write_websocket(conn, (const char *) buf, (int) len);
+  }
+#endif
+
   if (conn->throttle > 0) {
     if ((now = time(NULL)) != conn->last_throttle_time) {
       conn->last_throttle_time = now;
@@ -1611,6 +1732,152 @@ int mg_write(struct mg_connection *conn, const void *buf, size_t len) {
   return (int) total;
 }
 
+// Whether a write that didn't get anything out should be tried again. A
+// client that hasn't read anything for the request timeout is given up on
+static int retry_write(struct mg_connection *conn, time_t last_progress) {
+  if (conn->ctx->stop_flag || (ERRNO != EAGAIN && ERRNO != EINTR) ||
+      (time(NULL) - last_progress) * 1000 >=
+      atoi(conn->ctx->config[REQUEST_TIMEOUT])) {
+    return 0;
+  }
+  mg_sleep(100);
+  return 1;
+}
+
+int64_t mg_write_file(struct mg_connection *conn, int fd, int64_t offset,
+                      int64_t len) {
+  char buf[MG_BUF_LEN];
+  int64_t sent = 0;
+  time_t last_progress = time(NULL);
+  int n, k;
+
+#if defined(__linux__)
+  // Without SSL or throttling the data can go straight from the page
+  // cache to the socket
+  if (conn->ssl == NULL && conn->throttle <= 0) {
+    off_t off = (off_t) offset;
+    ssize_t ret;
+    while (sent < len && conn->ctx->stop_flag == 0) {
+      k = len - sent > INT_MAX ? INT_MAX : (int) (len - sent);
+      ret = sendfile(conn->client.sock, fd, &off, (size_t) k);
+      if (ret < 0 && retry_write(conn, last_progress)) {
+        continue;
+      }
+      if (ret <= 0) break;
+      sent += ret;
+      last_progress = time(NULL);
+    }
+    conn->num_bytes_sent += sent;
+    return sent > 0 || len == 0 ? sent : -1;
+  }
+#endif
+
+  while (sent < len && conn->ctx->stop_flag == 0) {
+    k = len - sent > (int64_t) sizeof(buf) ? (int) sizeof(buf) : (int) (len - sent);
+    n = (int) pread(fd, buf, (size_t) k, (off_t) (offset + sent));
+    if (n < 0 && ERRNO == EINTR) continue;
+    if (n <= 0) break;
+    if ((n = mg_write(conn, buf, (size_t) n)) <= 0) {
+      if (n == 0 && retry_write(conn, last_progress)) {
+        continue;
+      }
+      break;
+    }
+    sent += n;
+    last_progress = time(NULL);
+  }
+  conn->num_bytes_sent += sent;
+  return sent > 0 || len == 0 ? sent : -1;
+}
+
+int mg_write_pending(struct mg_connection *conn) {
+#if defined(USE_EPOLL)
+  return conn->out_len;
+#else
+  (void) conn;
+  return 0;
+#endif
+}
+
+static void *worker_thread(void *thread_func_param);
+
+int mg_detach_worker(struct mg_connection *conn) {
+  struct mg_context *ctx = conn->ctx;
+
+  if (conn->leave_pool) {
+    return 1;
+  }
+
+  // Count the new thread before it starts, so the master thread can't see
+  // the pool empty while we're handing over
+  (void) pthread_mutex_lock(&ctx->mutex);
+  if (ctx->stop_flag ||
+      ctx->num_detached >= atoi(ctx->config[MAX_DETACHED_THREADS])) {
+    (void) pthread_mutex_unlock(&ctx->mutex);
+    return 0;
+  }
+  ctx->num_threads++;
+  ctx->num_detached++;
+  (void) pthread_mutex_unlock(&ctx->mutex);
+
+  if (mg_start_thread(worker_thread, ctx) != 0) {
+    cry(conn, "Cannot start worker thread: %ld", (long) ERRNO);
+    (void) pthread_mutex_lock(&ctx->mutex);
+    ctx->num_threads--;
+    ctx->num_detached--;
+    (void) pthread_cond_signal(&ctx->cond);
+    (void) pthread_mutex_unlock(&ctx->mutex);
+    return 0;
+  }
+  conn->leave_pool = 1;
+  return 1;
+}
+
+void mg_wakeup_websocket(struct mg_connection *conn) {
+  struct mg_context *ctx = conn->ctx;
+#if defined(USE_EPOLL)
+  uint64_t one = 1;
+#endif
+
+  (void) pthread_mutex_lock(&ctx->mutex);
+  conn->wakeup = 1;
+#if defined(USE_EPOLL)
+  if (conn->ws.conn != NULL && !conn->ws_queued) {
+    // It's idle in the epoll set. The master thread queues it for a worker
+    conn->ws_queued = 1;
+    conn->next_wakeup = ctx->wakeups;
+    ctx->wakeups = conn;
+    if (write(ctx->wakeup_fd, &one, sizeof(one)) < 0) {
+      // The counter is already signalled
+    }
+  }
+#endif
+  (void) pthread_mutex_unlock(&ctx->mutex);
+}
+
+int mg_is_connected(struct mg_connection *conn) {
+  struct pollfd pfd;
+  char c;
+
+  if (conn->ctx->stop_flag || conn->client.sock == INVALID_SOCKET) {
+    return 0;
+  }
+
+  pfd.fd = conn->client.sock;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  if (poll(&pfd, 1, 0) <= 0) {
+    // Nothing to read, the connection is idle
+    return 1;
+  }
+  if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) {
+    return 0;
+  }
+
+  // Readable. Either the client sent more data, or it closed its end
+  return recv(conn->client.sock, &c, 1, MSG_PEEK) != 0;
+}
+
 // Print message to buffer. If buffer is large enough to hold the message,
 // return buffer. If buffer is to small, allocate large enough buffer on heap,
 // and return allocated buffer.
@@ -3882,14 +4149,58 @@ static void send_websocket_handshake(struct mg_connection *conn) {
   SHA1Update(&sha_ctx, (unsigned char *) buf, strlen(buf));
   SHA1Final((unsigned char *) sha, &sha_ctx);
   base64_encode((unsigned char *) sha, sizeof(sha), b64_sha);
-  mg_printf(conn, "%s%s%s",
+  mg_printf(conn, "%s%s%s%s%s%s",
             "HTTP/1.1 101 Switching Protocols\r\n"
             "Upgrade: websocket\r\n"
             "Connection: Upgrade\r\n"
-            "Sec-WebSocket-Accept: ", b64_sha, "\r\n\r\n");
+            "Sec-WebSocket-Accept: ", b64_sha, "\r\n",
+            conn->ws_extensions[0] ? "Sec-WebSocket-Extensions: " : "",
+            conn->ws_extensions, conn->ws_extensions[0] ? "\r\n\r\n" : "\r\n");
+}
+
+// Returns 1 if the client sent something that hasn't been read yet. Waits
+// for up to timeout milliseconds for it.
+static int websocket_readable(struct mg_connection *conn, int timeout) {
+  struct pollfd pfd;
+
+#ifndef NO_SSL
+  if (conn->ssl != NULL && SSL_pending(conn->ssl) > 0) {
+    return 1;
+  }
+#endif
+  pfd.fd = conn->client.sock;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  return poll(&pfd, 1, timeout) != 0;
+}
+
+// Waits for a web socket that stays with its worker thread to become
+// readable, calling the websocket_wakeup callback whenever
+// mg_wakeup_websocket() is called in the meantime. Returns 0 if the server
+// is stopping.
+static int wait_websocket(struct mg_connection *conn) {
+  struct mg_context *ctx = conn->ctx;
+  int wakeup;
+
+  while (!websocket_readable(conn, 200)) {
+    if (ctx->stop_flag) {
+      return 0;
+    }
+    (void) pthread_mutex_lock(&ctx->mutex);
+    wakeup = conn->wakeup;
+    conn->wakeup = 0;
+    (void) pthread_mutex_unlock(&ctx->mutex);
+    if (wakeup && ctx->callbacks.websocket_wakeup != NULL) {
+      ctx->callbacks.websocket_wakeup(conn);
+    }
+  }
+  return 1;
 }
 
-static void read_websocket(struct mg_connection *conn) {
+// Reads websocket frames and passes them to the websocket_data callback.
+// Returns 0 once the connection is to be closed. Unless wait is set, it
+// returns 1 as soon as there's nothing left to read without blocking.
+static int read_websocket(struct mg_connection *conn, int wait) {
   unsigned char *buf = (unsigned char *) conn->buf + conn->request_len;
   int bits, n, stop = 0;
   size_t i, len, mask_len, data_len, header_len, body_len;
@@ -3971,31 +4282,203 @@ static void read_websocket(struct mg_connection *conn) {
       // Not breaking the loop, process next websocket frame.
     } else {
       // Buffering websocket request
-      if ((n = pull(NULL, conn, conn->buf + conn->data_len,
+      if (!wait && !websocket_readable(conn, 0)) {
+        return 1;
+      }
+      if ((wait && !wait_websocket(conn)) ||
+          (n = pull(NULL, conn, conn->buf + conn->data_len,
                     conn->buf_size - conn->data_len)) <= 0) {
         break;
       }
       conn->data_len += n;
     }
   }
+  return 0;
+}
+
+#if defined(USE_EPOLL)
+static void close_connection(struct mg_connection *conn);
+
+static const char *rebase(const char *p, const struct mg_connection *from,
+                          const struct mg_connection *to) {
+  return p != NULL && p >= from->buf && p < from->buf + from->buf_size ?
+    to->buf + (p - from->buf) : p;
+}
+
+// Moves a web socket out of the worker's connection struct into one of its
+// own, which lives for as long as the web socket does. Between frames, it
+// waits in the master thread's epoll set rather than in a worker.
+static struct mg_connection *detach_websocket(struct mg_connection *conn) {
+  struct mg_context *ctx = conn->ctx;
+  struct mg_request_info *ri;
+  struct mg_connection *ws;
+  struct epoll_event ev;
+  int i;
+
+  if ((ws = (struct mg_connection *)
+       malloc(sizeof(*ws) + conn->buf_size)) == NULL) {
+    return NULL;
+  }
+  memcpy(ws, conn, sizeof(*ws) + conn->buf_size);
+  ws->buf = (char *) (ws + 1);
+  ws->path_info = NULL;
+  ws->leave_pool = ws->wakeup = 0;
+  ws->ws.conn = ws;
+  ws->ws_queued = 1;
+  ws->next_wakeup = ws->prev_ws = NULL;
+  ws->out = NULL;
+  ws->out_len = ws->out_size = 0;
+
+  // The request, which the application may still look at, points into the
+  // buffer that was copied
+  ri = &ws->request_info;
+  ri->request_method = rebase(ri->request_method, conn, ws);
+  ri->uri = rebase(ri->uri, conn, ws);
+  ri->http_version = rebase(ri->http_version, conn, ws);
+  ri->query_string = rebase(ri->query_string, conn, ws);
+  for (i = 0; i < ri->num_headers; i++) {
+    ri->http_headers[i].name = rebase(ri->http_headers[i].name, conn, ws);
+    ri->http_headers[i].value = rebase(ri->http_headers[i].value, conn, ws);
+  }
+
+  // Registered, but not armed until the worker is done with it
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLONESHOT;
+  ev.data.ptr = &ws->ws;
+  if (epoll_ctl(ctx->epoll_fd, EPOLL_CTL_ADD, ws->client.sock, &ev) != 0) {
+    free(ws);
+    return NULL;
+  }
+
+  (void) pthread_mutex_lock(&ctx->mutex);
+  ws->next_ws = ctx->websockets;
+  if (ws->next_ws != NULL) ws->next_ws->prev_ws = ws;
+  ctx->websockets = ws;
+  (void) pthread_mutex_unlock(&ctx->mutex);
+
+  // The socket, and the user name, belong to the web socket now
+  conn->client.sock = INVALID_SOCKET;
+  conn->ssl = NULL;
+  conn->request_info.remote_user = NULL;
+  return ws;
+}
+
+static void close_websocket(struct mg_connection *conn) {
+  struct mg_context *ctx = conn->ctx;
+
+  if (ctx->callbacks.end_request != NULL) {
+    ctx->callbacks.end_request(conn, conn->status_code);
+  }
+
+  (void) pthread_mutex_lock(&ctx->mutex);
+  if (conn->prev_ws != NULL) conn->prev_ws->next_ws = conn->next_ws;
+  else ctx->websockets = conn->next_ws;
+  if (conn->next_ws != NULL) conn->next_ws->prev_ws = conn->prev_ws;
+  (void) pthread_mutex_unlock(&ctx->mutex);
+
+  epoll_ctl(ctx->epoll_fd, EPOLL_CTL_DEL, conn->client.sock, NULL);
+  if (conn->ssl == NULL) {
+    // Whatever still fits, like a close frame
+    flush_websocket_output(conn);
+  }
+  close_connection(conn);
+  free(conn->out);
+  free((void *) conn->request_info.remote_user);
+  free(conn);
+}
+
+// Runs on a worker whenever a detached web socket has something to do:
+// frames to read, output to flush or a wakeup. Afterwards the web socket
+// goes back to the master thread's epoll set, or it's closed.
+static void serve_websocket(struct mg_connection *conn) {
+  struct mg_context *ctx = conn->ctx;
+  struct epoll_event ev;
+  int pending, wakeup, armed;
+
+  for (;;) {
+    pending = conn->out_len;
+    if ((conn->ssl == NULL && !flush_websocket_output(conn)) ||
+        !read_websocket(conn, 0)) {
+      break;
+    }
+
+    (void) pthread_mutex_lock(&ctx->mutex);
+    wakeup = conn->wakeup;
+    conn->wakeup = 0;
+    (void) pthread_mutex_unlock(&ctx->mutex);
+
+    // Let the application send more, either because it asked to, or
+    // because the client has caught up with what it was sent before
+    if ((wakeup || (pending > 0 && conn->out_len == 0)) &&
+        ctx->callbacks.websocket_wakeup != NULL) {
+      ctx->callbacks.websocket_wakeup(conn);
+      continue;
+    }
+
+    // Wakeups that come in after this are handled by the master thread
+    (void) pthread_mutex_lock(&ctx->mutex);
+    if (conn->wakeup) {
+      (void) pthread_mutex_unlock(&ctx->mutex);
+      continue;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT |
+      (conn->out_len > 0 ? EPOLLOUT : 0);
+    ev.data.ptr = &conn->ws;
+    armed = epoll_ctl(ctx->epoll_fd, EPOLL_CTL_MOD, conn->client.sock,
+                      &ev) == 0;
+    if (armed) conn->ws_queued = 0;
+    (void) pthread_mutex_unlock(&ctx->mutex);
+    if (armed) return;
+    break;
+  }
+  close_websocket(conn);
 }
+#endif
 
 static void handle_websocket_request(struct mg_connection *conn) {
   const char *version = mg_get_header(conn, "Sec-WebSocket-Version");
+#if defined(USE_EPOLL)
+  struct mg_connection *ws;
+#endif
+
   if (version == NULL || strcmp(version, "13") != 0) {
     send_http_error(conn, 426, "Upgrade Required", "%s", "Upgrade Required");
-  } else if (conn->ctx->callbacks.websocket_connect != NULL &&
-             conn->ctx->callbacks.websocket_connect(conn) != 0) {
+    return;
+  }
+
+#if defined(USE_EPOLL)
+  if ((ws = detach_websocket(conn)) == NULL) {
+    send_http_error(conn, 500, "Server Error", "%s", "Out of memory");
+    return;
+  }
+  conn = ws;
+#endif
+
+  if (conn->ctx->callbacks.websocket_connect != NULL &&
+      conn->ctx->callbacks.websocket_connect(conn) != 0) {
     // Callback has returned non-zero, do not proceed with handshake
-  } else {
-    send_websocket_handshake(conn);
-    if (conn->ctx->callbacks.websocket_ready != NULL) {
-      conn->ctx->callbacks.websocket_ready(conn);
-    }
-    read_websocket(conn);
+#if defined(USE_EPOLL)
+    close_websocket(conn);
+#endif
+    return;
   }
+
+  send_websocket_handshake(conn);
+  if (conn->ctx->callbacks.websocket_ready != NULL) {
+    conn->ctx->callbacks.websocket_ready(conn);
+  }
+#if defined(USE_EPOLL)
+  serve_websocket(conn);
+#else
+  // The web socket keeps this thread, but not a place in the pool, unless
+  // too many threads have left it already
+  mg_detach_worker(conn);
+  read_websocket(conn, 1);
+#endif
 }
 
+
 static int is_websocket_request(const struct mg_connection *conn) {
   const char *host, *upgrade, *connection, *version, *key;
 
@@ -4650,6 +5133,7 @@ static void reset_per_request_attributes(struct mg_connection *conn) {
   conn->num_bytes_sent = conn->consumed_content = 0;
   conn->status_code = -1;
   conn->must_close = conn->request_len = conn->throttle = 0;
+  conn->ws_extensions[0] = '\0';
 }
 
 static void close_socket_gracefully(struct mg_connection *conn) {
@@ -4812,7 +5296,9 @@ struct mg_connection *mg_download(const char *host, int port, int use_ssl,
   return conn;
 }
 
-static void process_new_connection(struct mg_connection *conn) {
+// Returns 1 if the connection is idle between keep-alive requests and
+// should be handed back to the master thread, 0 if it should be closed.
+static int process_new_connection(struct mg_connection *conn) {
   struct mg_request_info *ri = &conn->request_info;
   int keep_alive_enabled, keep_alive, discard_len;
   char ebuf[100];
@@ -4838,6 +5324,12 @@ static void process_new_connection(struct mg_connection *conn) {
 
     if (ebuf[0] == '\0') {
       handle_request(conn);
+#if defined(USE_EPOLL)
+      if (conn->client.sock == INVALID_SOCKET) {
+        // It became a web socket, which has taken the socket with it
+        return 0;
+      }
+#endif
       if (conn->ctx->callbacks.end_request != NULL) {
         conn->ctx->callbacks.end_request(conn, conn->status_code);
       }
@@ -4864,7 +5356,17 @@ static void process_new_connection(struct mg_connection *conn) {
     conn->data_len -= discard_len;
     assert(conn->data_len >= 0);
     assert(conn->data_len <= conn->buf_size);
+
+#if defined(USE_EPOLL)
+    // If the client hasn't sent its next request yet, don't block this
+    // thread waiting for it. SSL connections may have buffered data we
+    // can't see, so they stay with the worker.
+    if (keep_alive && conn->data_len == 0 && conn->ssl == NULL) {
+      return 1;
+    }
+#endif
   } while (keep_alive);
+  return 0;
 }
 
 // Worker threads take accepted socket from the queue
@@ -4897,9 +5399,145 @@ static int consume_socket(struct mg_context *ctx, struct socket *sp) {
   return !ctx->stop_flag;
 }
 
+#if defined(USE_EPOLL)
+static void unlink_parked_socket(struct mg_context *ctx,
+                                 struct parked_socket *p) {
+  if (p->prev != NULL) p->prev->next = p->next;
+  else ctx->parked_head = p->next;
+  if (p->next != NULL) p->next->prev = p->prev;
+  else ctx->parked_tail = p->prev;
+}
+
+// Hands an idle keep-alive connection to the master thread. It's queued
+// for a worker again once the next request arrives.
+static void park_socket(struct mg_context *ctx, const struct socket *sp) {
+  struct epoll_event ev;
+  struct parked_socket *p;
+
+  if ((p = (struct parked_socket *) calloc(1, sizeof(*p))) == NULL) {
+    closesocket(sp->sock);
+    return;
+  }
+  p->so = *sp;
+  p->since = time(NULL);
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN | EPOLLRDHUP;
+  ev.data.ptr = p;
+
+  // Registered under the lock, so the master thread can't expire it before
+  // it's in the list. Connections are appended as they're parked, which
+  // keeps the list ordered by age.
+  (void) pthread_mutex_lock(&ctx->mutex);
+  if (epoll_ctl(ctx->epoll_fd, EPOLL_CTL_ADD, sp->sock, &ev) == 0) {
+    p->prev = ctx->parked_tail;
+    if (p->prev != NULL) p->prev->next = p;
+    else ctx->parked_head = p;
+    ctx->parked_tail = p;
+    p = NULL;
+  }
+  (void) pthread_mutex_unlock(&ctx->mutex);
+
+  if (p != NULL) {
+    closesocket(sp->sock);
+    free(p);
+  }
+}
+
+// Takes a connection out of the parked set, once it has sent its next
+// request. Only the master thread removes parked connections.
+static void unpark_socket(struct mg_context *ctx, struct parked_socket *p,
+                          struct socket *sp) {
+  (void) pthread_mutex_lock(&ctx->mutex);
+  unlink_parked_socket(ctx, p);
+  (void) pthread_mutex_unlock(&ctx->mutex);
+  epoll_ctl(ctx->epoll_fd, EPOLL_CTL_DEL, p->so.sock, NULL);
+  *sp = p->so;
+  free(p);
+}
+
+// Closes parked connections that have been idle for longer than the
+// request timeout, or all of them if timeout is 0. The oldest ones are at
+// the head of the list, so it stops at the first one that hasn't expired.
+static void expire_parked_sockets(struct mg_context *ctx, int timeout) {
+  time_t now = time(NULL);
+  struct parked_socket *p;
+
+  (void) pthread_mutex_lock(&ctx->mutex);
+  while ((p = ctx->parked_head) != NULL &&
+         (timeout == 0 || now - p->since >= timeout)) {
+    unlink_parked_socket(ctx, p);
+    epoll_ctl(ctx->epoll_fd, EPOLL_CTL_DEL, p->so.sock, NULL);
+    closesocket(p->so.sock);
+    free(p);
+  }
+  (void) pthread_mutex_unlock(&ctx->mutex);
+}
+
+static void produce_socket(struct mg_context *ctx, const struct socket *sp);
+
+static void produce_websocket(struct mg_context *ctx,
+                              struct mg_connection *conn) {
+  struct socket so = conn->client;
+  so.conn = conn;
+  produce_socket(ctx, &so);
+}
+
+// A web socket in the epoll set has input, or room for its pending output
+static void queue_websocket(struct mg_context *ctx,
+                            struct mg_connection *conn) {
+  int queued;
+
+  (void) pthread_mutex_lock(&ctx->mutex);
+  queued = conn->ws_queued;
+  conn->ws_queued = 1;
+  (void) pthread_mutex_unlock(&ctx->mutex);
+
+  // If it's been woken up, it's queued along with the others that were
+  if (!queued) {
+    produce_websocket(ctx, conn);
+  }
+}
+
+// Queues the web sockets mg_wakeup_websocket() was called for. This must
+// be done after all other events returned by epoll_wait(), as a worker may
+// close a web socket as soon as it has it.
+static void queue_woken_websockets(struct mg_context *ctx) {
+  struct mg_connection *conn, *next;
+  struct epoll_event ev;
+  uint64_t n;
+
+  if (read(ctx->wakeup_fd, &n, sizeof(n)) < 0) {
+    // Nothing new
+  }
+
+  (void) pthread_mutex_lock(&ctx->mutex);
+  conn = ctx->wakeups;
+  ctx->wakeups = NULL;
+  (void) pthread_mutex_unlock(&ctx->mutex);
+
+  for (; conn != NULL; conn = next) {
+    next = conn->next_wakeup;
+
+    // They're still armed, epoll mustn't report them while a worker has them
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLONESHOT;
+    ev.data.ptr = &conn->ws;
+    epoll_ctl(ctx->epoll_fd, EPOLL_CTL_MOD, conn->client.sock, &ev);
+    produce_websocket(ctx, conn);
+  }
+}
+#else
+static void park_socket(struct mg_context *ctx, const struct socket *sp) {
+  (void) ctx;
+  closesocket(sp->sock);
+}
+#endif
+
 static void *worker_thread(void *thread_func_param) {
   struct mg_context *ctx = thread_func_param;
   struct mg_connection *conn;
+  int detached = 0;
 
   conn = (struct mg_connection *) calloc(1, sizeof(*conn) + MAX_REQUEST_SIZE);
   if (conn == NULL) {
@@ -4913,6 +5551,13 @@ static void *worker_thread(void *thread_func_param) {
     // Call consume_socket() even when ctx->stop_flag > 0, to let it signal
     // sq_empty condvar to wake up the master waiting in produce_socket()
     while (consume_socket(ctx, &conn->client)) {
+#if defined(USE_EPOLL) && defined(USE_WEBSOCKET)
+      if (conn->client.conn != NULL) {
+        // Not a new connection, a web socket with something to do
+        serve_websocket(conn->client.conn);
+        continue;
+      }
+#endif
       conn->birth_time = time(NULL);
 
       // Fill in IP, port info early so even if SSL setup below fails,
@@ -4925,15 +5570,22 @@ static void *worker_thread(void *thread_func_param) {
       conn->request_info.remote_ip = ntohl(conn->request_info.remote_ip);
       conn->request_info.is_ssl = conn->client.is_ssl;
 
-      if (!conn->client.is_ssl
+      if ((!conn->client.is_ssl
 #ifndef NO_SSL
           || sslize(conn, conn->ctx->ssl_ctx, SSL_accept)
 #endif
-         ) {
-        process_new_connection(conn);
+          ) && process_new_connection(conn)) {
+        park_socket(ctx, &conn->client);
+        conn->client.sock = INVALID_SOCKET;
       }
 
       close_connection(conn);
+
+      // Another thread has taken this one's place in the pool
+      if (conn->leave_pool) {
+        detached = 1;
+        break;
+      }
     }
     free(conn);
   }
@@ -4941,6 +5593,7 @@ static void *worker_thread(void *thread_func_param) {
   // Signal master that we're done with connection and exiting
   (void) pthread_mutex_lock(&ctx->mutex);
   ctx->num_threads--;
+  ctx->num_detached -= detached;
   (void) pthread_cond_signal(&ctx->cond);
   assert(ctx->num_threads >= 0);
   (void) pthread_mutex_unlock(&ctx->mutex);
@@ -4999,6 +5652,9 @@ static void accept_new_connection(const struct socket *listener,
     DEBUG_TRACE(("Accepted socket %d", (int) so.sock));
     so.is_ssl = listener->is_ssl;
     so.ssl_redir = listener->ssl_redir;
+#if defined(USE_EPOLL)
+    so.conn = NULL;
+#endif
     getsockname(so.sock, &so.lsa.sa, &len);
     // Set TCP keep-alive. This is needed because if HTTP-level keep-alive
     // is enabled, and client resets the connection, server won't get
@@ -5014,7 +5670,15 @@ static void accept_new_connection(const struct socket *listener,
 
 static void *master_thread(void *thread_func_param) {
   struct mg_context *ctx = thread_func_param;
+#if defined(USE_EPOLL)
+  struct epoll_event events[64];
+  struct parked_socket *p;
+  struct socket so;
+  time_t last_expire = time(NULL);
+  int n, j, woken, timeout = atoi(ctx->config[REQUEST_TIMEOUT]) / 1000;
+#else
   struct pollfd *pfd;
+#endif
   int i;
 
   // Increase priority of the master thread
@@ -5028,6 +5692,50 @@ static void *master_thread(void *thread_func_param) {
   pthread_setschedparam(pthread_self(), SCHED_RR, &sched_param);
 #endif
 
+#if defined(USE_EPOLL)
+  for (i = 0; i < ctx->num_listening_sockets; i++) {
+    memset(&events[0], 0, sizeof(events[0]));
+    events[0].events = EPOLLIN;
+    events[0].data.ptr = &ctx->listening_sockets[i];
+    epoll_ctl(ctx->epoll_fd, EPOLL_CTL_ADD, ctx->listening_sockets[i].sock,
+              &events[0]);
+  }
+  memset(&events[0], 0, sizeof(events[0]));
+  events[0].events = EPOLLIN;
+  events[0].data.ptr = &ctx->wakeup_fd;
+  epoll_ctl(ctx->epoll_fd, EPOLL_CTL_ADD, ctx->wakeup_fd, &events[0]);
+
+  while (ctx->stop_flag == 0) {
+    n = epoll_wait(ctx->epoll_fd, events, ARRAY_SIZE(events), 200);
+    woken = 0;
+    for (i = 0; i < n && ctx->stop_flag == 0; i++) {
+      for (j = 0; j < ctx->num_listening_sockets; j++) {
+        if (&ctx->listening_sockets[j] == events[i].data.ptr) break;
+      }
+      if (j < ctx->num_listening_sockets) {
+        accept_new_connection(&ctx->listening_sockets[j], ctx);
+      } else if (events[i].data.ptr == &ctx->wakeup_fd) {
+        woken = 1;
+      } else if ((p = (struct parked_socket *) events[i].data.ptr)->conn !=
+                 NULL) {
+        queue_websocket(ctx, p->conn);
+      } else {
+        // The client sent its next request, or hung up. Either way a
+        // worker will read it
+        unpark_socket(ctx, p, &so);
+        produce_socket(ctx, &so);
+      }
+    }
+    if (woken) {
+      queue_woken_websockets(ctx);
+    }
+
+    if (time(NULL) - last_expire >= 1) {
+      last_expire = time(NULL);
+      expire_parked_sockets(ctx, timeout > 0 ? timeout : 1);
+    }
+  }
+#else
   pfd = calloc(ctx->num_listening_sockets, sizeof(pfd[0]));
   while (pfd != NULL && ctx->stop_flag == 0) {
     for (i = 0; i < ctx->num_listening_sockets; i++) {
@@ -5048,6 +5756,7 @@ static void *master_thread(void *thread_func_param) {
     }
   }
   free(pfd);
+#endif
   DEBUG_TRACE(("stopping workers"));
 
   // Stop signal received: somebody called mg_stop. Quit.
@@ -5063,6 +5772,17 @@ static void *master_thread(void *thread_func_param) {
   }
   (void) pthread_mutex_unlock(&ctx->mutex);
 
+#if defined(USE_EPOLL)
+  expire_parked_sockets(ctx, 0);
+#if defined(USE_WEBSOCKET)
+  while (ctx->websockets != NULL) {
+    close_websocket(ctx->websockets);
+  }
+#endif
+  close(ctx->wakeup_fd);
+  close(ctx->epoll_fd);
+#endif
+
   // All threads exited, no sync is needed. Destroy mutex and condvars
   (void) pthread_mutex_destroy(&ctx->mutex);
   (void) pthread_cond_destroy(&ctx->cond);
@@ -5194,6 +5914,20 @@ struct mg_context *mg_start(const struct mg_callbacks *callbacks,
   (void) pthread_cond_init(&ctx->sq_empty, NULL);
   (void) pthread_cond_init(&ctx->sq_full, NULL);
 
+#if defined(USE_EPOLL)
+  if ((ctx->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    cry(fc(ctx), "epoll_create1: %s", strerror(ERRNO));
+    free_context(ctx);
+    return NULL;
+  }
+  if ((ctx->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+    cry(fc(ctx), "eventfd: %s", strerror(ERRNO));
+    close(ctx->epoll_fd);
+    free_context(ctx);
+    return NULL;
+  }
+#endif
+
   // Start master (listening) thread
   mg_start_thread(master_thread, ctx);
 
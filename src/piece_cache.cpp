@@ -0,0 +1,117 @@
+/*
+
+Copyright (c) 2015, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "piece_cache.hpp"
+
+namespace libtorrent
+{
+	piece_cache::piece_cache(std::int64_t max_size)
+		: m_size(0)
+		, m_max_size(max_size)
+	{}
+
+	bool piece_cache::find(sha1_hash const& ih, int piece
+		, boost::shared_array<char>& buffer, int& size)
+	{
+		std::unique_lock<std::mutex> l(m_mutex);
+		index_t::iterator i = m_index.find(std::make_pair(ih, piece));
+		if (i == m_index.end()) return false;
+
+		m_lru.splice(m_lru.end(), m_lru, i->second);
+		buffer = i->second->buffer;
+		size = i->second->size;
+		return true;
+	}
+
+	void piece_cache::insert(sha1_hash const& ih, int piece
+		, boost::shared_array<char> const& buffer, int size)
+	{
+		std::unique_lock<std::mutex> l(m_mutex);
+		std::pair<index_t::iterator, bool> ret = m_index.insert(
+			std::make_pair(std::make_pair(ih, piece), m_lru.end()));
+		if (!ret.second)
+		{
+			// we already have it. Just mark it as used
+			m_lru.splice(m_lru.end(), m_lru, ret.first->second);
+			return;
+		}
+
+		cached_piece cp;
+		cp.info_hash = ih;
+		cp.piece = piece;
+		cp.size = size;
+		cp.buffer = buffer;
+		ret.first->second = m_lru.insert(m_lru.end(), cp);
+		m_size += size;
+
+		evict_lru();
+	}
+
+	void piece_cache::evict(sha1_hash const& ih)
+	{
+		std::unique_lock<std::mutex> l(m_mutex);
+		index_t::iterator i = m_index.lower_bound(std::make_pair(ih, 0));
+		while (i != m_index.end() && i->first.first == ih)
+		{
+			m_size -= i->second->size;
+			m_lru.erase(i->second);
+			m_index.erase(i++);
+		}
+	}
+
+	std::int64_t piece_cache::size() const
+	{
+		std::unique_lock<std::mutex> l(m_mutex);
+		return m_size;
+	}
+
+	void piece_cache::evict_lru()
+	{
+		lru_t::iterator i = m_lru.begin();
+		while (m_size > m_max_size && i != m_lru.end())
+		{
+			// someone is still sending this piece. Evicting it wouldn't
+			// free any memory, and the next stream would have to read it
+			// again
+			if (!i->buffer.unique())
+			{
+				++i;
+				continue;
+			}
+
+			m_size -= i->size;
+			m_index.erase(std::make_pair(i->info_hash, i->piece));
+			i = m_lru.erase(i);
+		}
+	}
+}
+
@@ -0,0 +1,96 @@
+/*
+
+Copyright (c) 2015, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_PIECE_CACHE_HPP
+#define TORRENT_PIECE_CACHE_HPP
+
+#include "libtorrent/peer_id.hpp" // for sha1_hash
+#include <boost/shared_array.hpp>
+#include <list>
+#include <map>
+#include <mutex>
+#include <cstdint>
+
+namespace libtorrent
+{
+	// piece buffers read through read_piece, shared by everything serving
+	// torrent data over HTTP. A piece that's read once can be served to any
+	// number of streams without going back to disk.
+	// Buffers are reference counted. A piece that's being sent by a stream
+	// is never evicted, the rest are evicted least recently used first when
+	// the cache grows past its budget.
+	struct piece_cache
+	{
+		piece_cache(std::int64_t max_size = 64 * 1024 * 1024);
+
+		// returns true and sets buffer and size if the piece is in the
+		// cache. The piece is moved to the most recently used end
+		bool find(sha1_hash const& ih, int piece
+			, boost::shared_array<char>& buffer, int& size);
+
+		void insert(sha1_hash const& ih, int piece
+			, boost::shared_array<char> const& buffer, int size);
+
+		// drops all pieces of the torrent, e.g. when it's removed
+		void evict(sha1_hash const& ih);
+
+		// the number of bytes of piece buffers held by the cache
+		std::int64_t size() const;
+
+	private:
+
+		void evict_lru();
+
+		struct cached_piece
+		{
+			sha1_hash info_hash;
+			int piece;
+			int size;
+			boost::shared_array<char> buffer;
+		};
+
+		typedef std::list<cached_piece> lru_t;
+		typedef std::map<std::pair<sha1_hash, int>, lru_t::iterator> index_t;
+
+		mutable std::mutex m_mutex;
+
+		// the least recently used piece is at the front
+		lru_t m_lru;
+		index_t m_index;
+
+		std::int64_t m_size;
+		std::int64_t m_max_size;
+	};
+}
+
+#endif
+
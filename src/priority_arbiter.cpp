@@ -0,0 +1,221 @@
+/*
+
+Copyright (c) 2015, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "priority_arbiter.hpp"
+
+#include "libtorrent/torrent.hpp"
+#include "libtorrent/aux_/session_interface.hpp"
+#include <boost/bind.hpp>
+#include <algorithm> // for max
+
+namespace libtorrent
+{
+	namespace
+	{
+		// the number of piece priority levels
+		int const num_levels = 8;
+	}
+
+	int priority_arbiter::piece_claims::effective_priority() const
+	{
+		for (int k = num_levels - 1; k > user_priority; --k)
+		{
+			if (levels[k] > 0) return k;
+		}
+		return user_priority;
+	}
+
+	bool priority_arbiter::piece_claims::claimed() const
+	{
+		return std::count(levels.begin(), levels.end(), 0) != num_levels;
+	}
+
+	priority_arbiter::priority_arbiter()
+		: m_state(new state)
+	{}
+
+	void priority_arbiter::maybe_remove(state& s
+		, std::map<sha1_hash, torrent_claims>::iterator i)
+	{
+		if (!i->second.pieces.empty() || !i->second.deadlines.empty()) return;
+		s.torrents.erase(i);
+	}
+
+	void priority_arbiter::post(torrent_handle const& h
+		, std::vector<int> const& pieces)
+	{
+		if (pieces.empty()) return;
+		shared_ptr<torrent> t = h.native_handle();
+		if (!t) return;
+		t->session().get_io_service().post(boost::bind(&priority_arbiter::apply
+			, m_state, h, pieces));
+	}
+
+	void priority_arbiter::apply(boost::shared_ptr<state> s
+		, torrent_handle const& h, std::vector<int> const& pieces)
+	{
+		shared_ptr<torrent> t = h.native_handle();
+		if (!t) return;
+
+		std::vector<std::pair<int, int> > changes;
+		{
+			std::unique_lock<std::mutex> l(s->mutex);
+			std::map<sha1_hash, torrent_claims>::iterator ti
+				= s->torrents.find(t->info_hash());
+			if (ti == s->torrents.end()) return;
+			torrent_claims& tc = ti->second;
+
+			for (int i = 0; i < int(pieces.size()); ++i)
+			{
+				int const p = pieces[i];
+				std::map<int, piece_claims>::iterator pi = tc.pieces.find(p);
+				if (pi == tc.pieces.end()) continue;
+				piece_claims& pc = pi->second;
+
+				// the first time we see the piece, or the user changed it
+				// while we held a claim on it
+				int const current = t->piece_priority(p);
+				if (!pc.known || current != pc.applied)
+					pc.user_priority = current;
+
+				int const target = pc.effective_priority();
+				if (target != current) changes.push_back(std::make_pair(p, target));
+				pc.applied = target;
+				pc.known = true;
+
+				if (!pc.claimed()) tc.pieces.erase(pi);
+			}
+			maybe_remove(*s, ti);
+		}
+
+		// libtorrent may post alerts from here, and plugins handling them
+		// may call into the arbiter. Don't hold the lock over it
+		if (!changes.empty()) t->prioritize_piece_list(changes);
+	}
+
+	void priority_arbiter::claim(torrent_handle const& h
+		, std::vector<int> const& pieces, int priority)
+	{
+		priority = (std::max)(0, (std::min)(priority, num_levels - 1));
+
+		std::vector<int> changed;
+		{
+			std::unique_lock<std::mutex> l(m_state->mutex);
+			torrent_claims& t = m_state->torrents[h.info_hash()];
+			for (int i = 0; i < int(pieces.size()); ++i)
+			{
+				int const p = pieces[i];
+				piece_claims& pc = t.pieces[p];
+				if (pc.levels.empty()) pc.levels.resize(num_levels, 0);
+				int const before = pc.effective_priority();
+				++pc.levels[priority];
+				if (!pc.known || pc.effective_priority() != before)
+					changed.push_back(p);
+			}
+		}
+		post(h, changed);
+	}
+
+	void priority_arbiter::release(torrent_handle const& h
+		, std::vector<int> const& pieces, int priority)
+	{
+		priority = (std::max)(0, (std::min)(priority, num_levels - 1));
+
+		std::vector<int> changed;
+		{
+			std::unique_lock<std::mutex> l(m_state->mutex);
+			std::map<sha1_hash, torrent_claims>::iterator ti
+				= m_state->torrents.find(h.info_hash());
+			if (ti == m_state->torrents.end()) return;
+			torrent_claims& t = ti->second;
+
+			for (int i = 0; i < int(pieces.size()); ++i)
+			{
+				int const p = pieces[i];
+				std::map<int, piece_claims>::iterator pi = t.pieces.find(p);
+				if (pi == t.pieces.end() || pi->second.levels[priority] == 0) continue;
+
+				int const before = pi->second.effective_priority();
+				--pi->second.levels[priority];
+
+				// the piece is kept until apply() has restored its priority
+				if (pi->second.effective_priority() != before || !pi->second.claimed())
+					changed.push_back(p);
+			}
+		}
+		post(h, changed);
+	}
+
+	void priority_arbiter::claim_deadline(torrent_handle const& h, int piece
+		, int deadline, int flags)
+	{
+		std::unique_lock<std::mutex> l(m_state->mutex);
+		torrent_claims& t = m_state->torrents[h.info_hash()];
+
+		time_point const now = clock_type::now();
+		time_point const due = now + milliseconds(deadline);
+		deadline_claim& d = t.deadlines[piece];
+		if (d.refs == 0 || due < d.due) d.due = due;
+		++d.refs;
+
+		// always pass it on, even when the deadline doesn't change. If we
+		// already have the piece, this is what makes libtorrent read it
+		h.set_piece_deadline(piece, (std::max)(0, int(total_milliseconds(d.due - now)))
+			, flags);
+	}
+
+	void priority_arbiter::release_deadline(torrent_handle const& h, int piece)
+	{
+		std::unique_lock<std::mutex> l(m_state->mutex);
+		std::map<sha1_hash, torrent_claims>::iterator ti
+			= m_state->torrents.find(h.info_hash());
+		if (ti == m_state->torrents.end()) return;
+		torrent_claims& t = ti->second;
+
+		std::map<int, deadline_claim>::iterator i = t.deadlines.find(piece);
+		if (i == t.deadlines.end()) return;
+
+		if (--i->second.refs == 0)
+		{
+			t.deadlines.erase(i);
+			h.reset_piece_deadline(piece);
+		}
+		maybe_remove(*m_state, ti);
+	}
+
+	void priority_arbiter::remove(sha1_hash const& ih)
+	{
+		std::unique_lock<std::mutex> l(m_state->mutex);
+		m_state->torrents.erase(ih);
+	}
+}
+
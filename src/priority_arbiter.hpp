@@ -0,0 +1,144 @@
+/*
+
+Copyright (c) 2015, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_PRIORITY_ARBITER_HPP
+#define TORRENT_PRIORITY_ARBITER_HPP
+
+#include "libtorrent/torrent_handle.hpp"
+#include "libtorrent/peer_id.hpp" // for sha1_hash
+#include "libtorrent/time.hpp"
+#include <boost/shared_ptr.hpp>
+#include <map>
+#include <mutex>
+#include <vector>
+#include <cstdint>
+
+namespace libtorrent
+{
+	// arbitrates piece priorities and deadlines between everything that
+	// streams torrent data. Each consumer claims the priority or deadline it
+	// needs, and releases it when it's done. A piece's priority is the
+	// highest one claimed for it, but never lower than what the user has
+	// set. Once the last claim on a piece is released, the user's priority
+	// is restored. If the user changes the priority of a piece while it's
+	// claimed, that becomes the priority to restore.
+	//
+	// None of the calls block on the network thread, so they may be made
+	// from plugin callbacks. Priorities are read and set by a job posted to
+	// the network thread.
+	struct priority_arbiter
+	{
+		priority_arbiter();
+
+		// raises the pieces to at least the given priority, until the claim
+		// is released. Only pieces whose priority changes are passed on to
+		// libtorrent, in a single call
+		void claim(torrent_handle const& h, std::vector<int> const& pieces
+			, int priority);
+		void release(torrent_handle const& h, std::vector<int> const& pieces
+			, int priority);
+
+		// sets a deadline for the piece, in milliseconds from now. If it
+		// already has an earlier deadline, that one is kept. The deadline
+		// is reset once the last claim on it is released
+		void claim_deadline(torrent_handle const& h, int piece, int deadline
+			, int flags = 0);
+		void release_deadline(torrent_handle const& h, int piece);
+
+		// forgets all claims on the torrent, e.g. when it's removed
+		void remove(sha1_hash const& ih);
+
+	private:
+
+		struct deadline_claim
+		{
+			deadline_claim() : refs(0) {}
+			int refs;
+			time_point due;
+		};
+
+		struct piece_claims
+		{
+			piece_claims() : user_priority(1), applied(1), known(false) {}
+
+			// the number of claims at each priority level
+			std::vector<int> levels;
+
+			// the priority the user set for the piece
+			int user_priority;
+
+			// the priority we last set for the piece. If the torrent has
+			// something else, the user has changed it since
+			int applied;
+
+			// false until the network thread has read the piece's priority
+			bool known;
+
+			int effective_priority() const;
+			bool claimed() const;
+		};
+
+		struct torrent_claims
+		{
+			// pieces stay here after their last claim is released, until
+			// their priority has been restored
+			std::map<int, piece_claims> pieces;
+
+			std::map<int, deadline_claim> deadlines;
+		};
+
+		// the claims are shared with the jobs posted to the network thread,
+		// which may run after the arbiter is gone
+		struct state
+		{
+			std::mutex mutex;
+			std::map<sha1_hash, torrent_claims> torrents;
+		};
+
+		// runs on the network thread. Brings the priorities of the pieces
+		// in line with their claims
+		static void apply(boost::shared_ptr<state> s, torrent_handle const& h
+			, std::vector<int> const& pieces);
+
+		// posts apply() for the pieces
+		void post(torrent_handle const& h, std::vector<int> const& pieces);
+
+		// forgets the torrent once nothing is claimed anymore. Must be
+		// called with the mutex held
+		static void maybe_remove(state& s
+			, std::map<sha1_hash, torrent_claims>::iterator i);
+
+		boost::shared_ptr<state> m_state;
+	};
+}
+
+#endif
@@ -0,0 +1,205 @@
+/*
+
+Copyright (c) 2015, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "stats_sampler.hpp"
+#include "alert_handler.hpp"
+#include "libtorrent/session.hpp"
+#include "libtorrent/session_stats.hpp"
+#include "libtorrent/alert_types.hpp"
+#include <cstring> // for memset, memcpy
+
+namespace libtorrent
+{
+	namespace
+	{
+		char const* const metric_names[] =
+		{
+			"peer.num_peers_connected",
+			"net.has_incoming_connections",
+			"dht.dht_nodes",
+			"net.sent_bytes",
+			"net.recv_bytes",
+			"net.sent_payload_bytes",
+			"net.recv_payload_bytes",
+			"ses.num_checking_torrents",
+			"ses.num_stopped_torrents",
+			"ses.num_upload_only_torrents",
+			"ses.num_downloading_torrents",
+			"ses.num_seeding_torrents",
+			"ses.num_queued_seeding_torrents",
+			"ses.num_queued_download_torrents",
+			"ses.num_error_torrents",
+		};
+	}
+
+	stats_sample::stats_sample()
+		: frame(0)
+		, num_peers(0)
+		, num_torrents(0)
+		, num_paused_torrents(0)
+		, dht_nodes(0)
+		, has_incoming_connections(false)
+		, upload_rate(0)
+		, download_rate(0)
+		, payload_upload_rate(0)
+		, payload_download_rate(0)
+		, total_payload_upload(0)
+		, total_payload_download(0)
+	{
+		memset(values, 0, sizeof(values));
+		memset(changed, 0, sizeof(changed));
+	}
+
+	stats_sampler::stats_sampler(session& s, alert_handler* h
+		, time_duration interval)
+		: m_ses(s)
+		, m_alerts(h)
+		, m_interval(interval)
+		, m_last_post(time_point())
+		, m_in_flight(false)
+		, m_rate_base_time(time_point())
+		, m_has_rate_base(false)
+		, m_sample(std::make_shared<stats_sample>())
+	{
+		static_assert(sizeof(metric_names) / sizeof(metric_names[0]) == num_metrics
+			, "metric_names must match the metric enum");
+		for (int i = 0; i < num_metrics; ++i)
+			m_metric[i] = find_metric_idx(metric_names[i]);
+		memset(m_rate_base, 0, sizeof(m_rate_base));
+
+		// the main loop posts torrent updates at a steady pace, which
+		// drives our own stats requests
+		m_alerts->subscribe(this, 0
+			, session_stats_alert::alert_type
+			, state_update_alert::alert_type
+			, 0);
+	}
+
+	stats_sampler::~stats_sampler()
+	{
+		m_alerts->unsubscribe(this);
+	}
+
+	std::shared_ptr<stats_sample const> stats_sampler::sample() const
+	{
+		return std::atomic_load(&m_sample);
+	}
+
+	void stats_sampler::handle_alert(alert const* a)
+	{
+		session_stats_alert const* ss = alert_cast<session_stats_alert>(a);
+		if (ss == NULL)
+		{
+			time_point const now = time_now();
+
+			// if the last request hasn't been answered in a long time, it
+			// was probably lost (the alert queue may have overflowed)
+			if (m_in_flight && now - m_last_post < m_interval * 10) return;
+			if (now - m_last_post < m_interval) return;
+
+			m_last_post = now;
+			m_in_flight = true;
+			m_ses.post_session_stats();
+			return;
+		}
+
+		// any session_stats_alert is a sample, regardless of who asked for
+		// it
+		m_in_flight = false;
+
+		std::shared_ptr<stats_sample const> prev = sample();
+		std::shared_ptr<stats_sample> s = std::make_shared<stats_sample>();
+		s->frame = prev->frame + 1;
+
+		for (int i = 0; i < counters::num_counters; ++i)
+		{
+			std::int64_t const v = std::int64_t(ss->values[i]);
+			s->values[i] = v;
+			s->changed[i] = (v != prev->values[i] || prev->frame == 0)
+				? s->frame : prev->changed[i];
+		}
+
+#define METRIC(x) (m_metric[x] < 0 ? 0 : s->values[m_metric[x]])
+
+		s->num_peers = METRIC(num_peers_idx);
+		s->has_incoming_connections = METRIC(has_incoming_idx) != 0;
+		s->dht_nodes = METRIC(dht_nodes_idx);
+		s->total_payload_upload = METRIC(sent_payload_idx);
+		s->total_payload_download = METRIC(recv_payload_idx);
+
+		// every torrent is counted in exactly one of these
+		s->num_paused_torrents = METRIC(stopped_torrents_idx)
+			+ METRIC(queued_seeding_idx)
+			+ METRIC(queued_download_idx);
+		s->num_torrents = s->num_paused_torrents
+			+ METRIC(checking_torrents_idx)
+			+ METRIC(upload_only_torrents_idx)
+			+ METRIC(downloading_torrents_idx)
+			+ METRIC(seeding_torrents_idx)
+			+ METRIC(error_torrents_idx);
+
+		// rates are computed over at least one interval, to not make them
+		// jump around when we get samples in quick succession
+		time_point const now = ss->timestamp();
+		if (m_has_rate_base && now - m_rate_base_time >= m_interval
+			&& now > m_rate_base_time)
+		{
+			std::int64_t const ms = total_milliseconds(now - m_rate_base_time);
+#define RATE(x) (m_metric[x] < 0 ? 0 \
+	: int((s->values[m_metric[x]] - m_rate_base[m_metric[x]]) * 1000 / ms))
+
+			s->upload_rate = RATE(sent_bytes_idx);
+			s->download_rate = RATE(recv_bytes_idx);
+			s->payload_upload_rate = RATE(sent_payload_idx);
+			s->payload_download_rate = RATE(recv_payload_idx);
+#undef RATE
+		}
+		else
+		{
+			s->upload_rate = prev->upload_rate;
+			s->download_rate = prev->download_rate;
+			s->payload_upload_rate = prev->payload_upload_rate;
+			s->payload_download_rate = prev->payload_download_rate;
+		}
+#undef METRIC
+
+		if (!m_has_rate_base || now - m_rate_base_time >= m_interval)
+		{
+			memcpy(m_rate_base, s->values, sizeof(m_rate_base));
+			m_rate_base_time = now;
+			m_has_rate_base = true;
+		}
+
+		std::atomic_store(&m_sample, std::shared_ptr<stats_sample const>(s));
+	}
+}
+
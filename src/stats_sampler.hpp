@@ -0,0 +1,143 @@
+/*
+
+Copyright (c) 2015, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_STATS_SAMPLER_HPP
+#define TORRENT_STATS_SAMPLER_HPP
+
+#include "alert_observer.hpp"
+#include "libtorrent/time.hpp"
+#include "libtorrent/performance_counters.hpp" // for counters::num_counters
+#include <memory>
+#include <cstdint>
+
+namespace libtorrent
+{
+	struct alert_handler;
+	class session;
+
+	// the session counters as of one session_stats_alert, along with the
+	// values derived from them that the front-ends report. Samples are
+	// immutable once published.
+	struct stats_sample
+	{
+		stats_sample();
+
+		// incremented for every sample
+		std::uint32_t frame;
+
+		// the counters, indexed by the metric's value_index
+		std::int64_t values[counters::num_counters];
+
+		// the frame each counter last changed in
+		std::uint32_t changed[counters::num_counters];
+
+		int num_peers;
+		int num_torrents;
+		int num_paused_torrents;
+		int dht_nodes;
+		bool has_incoming_connections;
+
+		// bytes per second, averaged over at least the sample interval
+		int upload_rate;
+		int download_rate;
+		int payload_upload_rate;
+		int payload_download_rate;
+
+		std::int64_t total_payload_upload;
+		std::int64_t total_payload_download;
+	};
+
+	// posts session stats on a fixed cadence, and keeps the latest sample
+	// of them. Front-ends read the latest sample instead of each posting
+	// their own request and waiting for it, or calling the synchronous
+	// session::status().
+	struct stats_sampler : alert_observer
+	{
+		stats_sampler(session& s, alert_handler* h
+			, time_duration interval = seconds(1));
+		~stats_sampler();
+
+		// the most recent sample. May be called from any thread
+		std::shared_ptr<stats_sample const> sample() const;
+
+	private:
+
+		void handle_alert(alert const* a);
+
+		session& m_ses;
+		alert_handler* m_alerts;
+
+		// the minimum time between two session stats requests
+		time_duration m_interval;
+
+		// the last time we posted session stats, and whether we're still
+		// waiting for them. Requests are never issued while there's one in
+		// flight, unless it appears to have been lost
+		time_point m_last_post;
+		bool m_in_flight;
+
+		// the counters rates are computed against, and when they were
+		// sampled. This is moved forward once it's at least m_interval old
+		std::int64_t m_rate_base[counters::num_counters];
+		time_point m_rate_base_time;
+		bool m_has_rate_base;
+
+		// indices of the counters the derived values are computed from. -1
+		// if this version of libtorrent doesn't have the counter
+		enum
+		{
+			num_peers_idx,
+			has_incoming_idx,
+			dht_nodes_idx,
+			sent_bytes_idx,
+			recv_bytes_idx,
+			sent_payload_idx,
+			recv_payload_idx,
+			checking_torrents_idx,
+			stopped_torrents_idx,
+			upload_only_torrents_idx,
+			downloading_torrents_idx,
+			seeding_torrents_idx,
+			queued_seeding_idx,
+			queued_download_idx,
+			error_torrents_idx,
+			num_metrics
+		};
+		int m_metric[num_metrics];
+
+		// only accessed through the atomic shared_ptr functions
+		std::shared_ptr<stats_sample const> m_sample;
+	};
+}
+
+#endif
+
@@ -0,0 +1,113 @@
+/*
+
+Copyright (c) 2015, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "timer_wheel.hpp"
+
+#include <algorithm> // for max, min
+
+namespace libtorrent
+{
+	timer_wheel::timer_wheel(time_point start)
+		: m_start(start)
+		, m_tick(0)
+	{}
+
+	std::int64_t timer_wheel::tick(time_point t) const
+	{
+		return total_milliseconds(t - m_start) / slot_ms;
+	}
+
+	void timer_wheel::insert(timer_ptr const& t, time_point expires)
+	{
+		// round up, so a timer never fires early
+		t->expires = (std::max)(tick(expires) + 1, m_tick + 1);
+		place(t);
+	}
+
+	void timer_wheel::extend(timer_ptr const& t, time_point expires)
+	{
+		t->expires = (std::max)(t->expires, tick(expires) + 1);
+	}
+
+	void timer_wheel::place(timer_ptr const& t)
+	{
+		std::int64_t const delta = t->expires - m_tick;
+		if (delta < num_slots)
+		{
+			m_level0[t->expires % num_slots].push_back(t);
+			return;
+		}
+
+		// timers too far out are parked in the last level 1 slot, and placed
+		// again when it comes up
+		std::int64_t const block = (std::min)(t->expires / num_slots
+			, m_tick / num_slots + num_slots - 1);
+		m_level1[block % num_slots].push_back(t);
+	}
+
+	void timer_wheel::expire(time_point now, std::vector<timer_ptr>& due)
+	{
+		std::int64_t const target = tick(now);
+		while (m_tick < target)
+		{
+			++m_tick;
+
+			// at the start of every block, the level 1 slot for it is spread
+			// out over level 0
+			if (m_tick % num_slots == 0)
+			{
+				std::vector<timer_ptr> cascade;
+				cascade.swap(m_level1[(m_tick / num_slots) % num_slots]);
+				for (int i = 0; i < int(cascade.size()); ++i)
+				{
+					if (cascade[i]->done) continue;
+					place(cascade[i]);
+				}
+			}
+
+			std::vector<timer_ptr>& slot = m_level0[m_tick % num_slots];
+			for (int i = 0; i < int(slot.size()); ++i)
+			{
+				if (slot[i]->done) continue;
+				// the timeout was extended after it was placed
+				if (slot[i]->expires > m_tick)
+				{
+					place(slot[i]);
+					continue;
+				}
+				due.push_back(slot[i]);
+			}
+			slot.clear();
+		}
+	}
+}
+
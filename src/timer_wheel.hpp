@@ -0,0 +1,96 @@
+/*
+
+Copyright (c) 2015, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_TIMER_WHEEL_HPP
+#define TORRENT_TIMER_WHEEL_HPP
+
+#include "libtorrent/time.hpp" // for time_point
+#include <memory>
+#include <vector>
+#include <cstdint>
+
+namespace libtorrent
+{
+	// something that times out, held in a timer_wheel
+	struct wheel_timer
+	{
+		wheel_timer() : expires(0), done(false) {}
+
+		// the timer_wheel tick this times out at. It may be pushed out with
+		// timer_wheel::extend()
+		std::int64_t expires;
+
+		// set once the timer isn't needed anymore. It's still in the wheel
+		// until its slot comes up, and is skipped then
+		bool done;
+	};
+
+	// a two level hierarchical timer wheel. Adding a timer is O(1), and
+	// expiring them is O(1) amortized per timer. Timers are not removed
+	// when they're done, they're skipped once they come up
+	struct timer_wheel
+	{
+		typedef std::shared_ptr<wheel_timer> timer_ptr;
+
+		// ticks are counted from start
+		timer_wheel(time_point start);
+
+		void insert(timer_ptr const& t, time_point expires);
+
+		// pushes the timeout of a timer in the wheel out to expires.
+		// It's moved lazily, when its current slot comes up
+		void extend(timer_ptr const& t, time_point expires);
+
+		// moves the wheel forward to now, appending the timers that
+		// timed out to due
+		void expire(time_point now, std::vector<timer_ptr>& due);
+
+		enum { slot_ms = 100, num_slots = 64 };
+
+	private:
+
+		std::int64_t tick(time_point t) const;
+		void place(timer_ptr const& t);
+
+		time_point m_start;
+
+		// the last tick that was expired
+		std::int64_t m_tick;
+
+		// level 0 has one slot per tick, level 1 one slot per num_slots
+		// ticks
+		std::vector<timer_ptr> m_level0[num_slots];
+		std::vector<timer_ptr> m_level1[num_slots];
+	};
+}
+
+#endif
@@ -33,14 +33,25 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "torrent_history.hpp"
 #include "libtorrent/alert_types.hpp"
 #include "alert_handler.hpp"
+#include <cstring> // for memcpy, memset
+#include <algorithm> // for sort, unique
+#include <atomic> // for atomic_thread_fence
+
+#if defined __SSE2__
+#include <emmintrin.h>
+#endif
 
 namespace libtorrent
 {
-	torrent_history::torrent_history(alert_handler* h)
-		: m_alerts(h)
+	torrent_history::torrent_history(alert_handler* h, int journal_budget)
+		: m_journal_size(0)
+		, m_journal_budget(journal_budget)
+		, m_alerts(h)
 		, m_frame(1)
-		, m_deferred_frame_count(false)
 	{
+		m_pending = std::make_shared<torrent_history_frame>(m_frame + 1);
+		publish();
+
 		m_alerts->subscribe(this, 0
 			, add_torrent_alert::alert_type
 			, torrent_removed_alert::alert_type
@@ -54,6 +65,31 @@ namespace libtorrent
 		m_alerts->unsubscribe(this);
 	}
 
+	void torrent_history::publish()
+	{
+		std::shared_ptr<torrent_history_snapshot> s
+			= std::make_shared<torrent_history_snapshot>();
+		s->frame = m_frame;
+		s->torrents = m_torrents;
+		if (!m_journal.empty()) s->journal = m_journal.back();
+		std::atomic_store(&m_snapshot
+			, std::shared_ptr<torrent_history_snapshot const>(s));
+	}
+
+	void torrent_history::trim_journal()
+	{
+		while (m_journal_size > m_journal_budget && m_journal.size() > 1)
+		{
+			m_journal_size -= m_journal.front()->memory();
+			m_journal.pop_front();
+			// readers may be walking the journal while we unlink the
+			// frame. The ones that have already made it past this frame
+			// keep it alive until they're done with it
+			std::atomic_store(&m_journal.front()->prev
+				, std::shared_ptr<torrent_history_frame const>());
+		}
+	}
+
 	void torrent_history::handle_alert(alert const* a)
 	{
 		add_torrent_alert const* ta = alert_cast<add_torrent_alert>(a);
@@ -62,27 +98,12 @@ namespace libtorrent
 		torrent_update_alert const* tu = alert_cast<torrent_update_alert>(a);
 		if (tu)
 		{
-			std::unique_lock<std::mutex> l(m_mutex);
-
 			// first remove the old hash
-			m_removed.push_front(std::make_pair(m_frame + 1, tu->old_ih));
-			torrent_history_entry st;
-			st.status.info_hash = tu->old_ih;
-			queue_t::right_iterator it = m_queue.right.find(st);
-			if (it == m_queue.right.end()) return;
-
-			st = it->first;
-			m_queue.right.erase(st);
+			m_pending->removed.push_back(tu->old_ih);
 
 			// then add the torrent under the new inf-hash
-			st.status.info_hash = tu->new_ih;
-			m_queue.left.push_front(std::make_pair(m_frame + 1, st));
-
-			// weed out torrents that were removed a long time ago
-			while (m_removed.size() > 1000 && m_removed.back().first < m_frame - 10)
-				m_removed.pop_back();
-
-			m_deferred_frame_count = true;
+			int const slot = m_torrents.rename(tu->old_ih, tu->new_ih, m_frame + 1);
+			if (slot >= 0) m_pending->updated.push_back(slot);
 		}
 		else if (ta)
 		{
@@ -90,188 +111,631 @@ namespace libtorrent
 			TORRENT_ASSERT(st.info_hash == st.handle.info_hash());
 			TORRENT_ASSERT(st.handle == ta->handle);
 
-			std::unique_lock<std::mutex> l(m_mutex);
-			m_queue.left.push_front(std::make_pair(m_frame + 1, torrent_history_entry(st, m_frame + 1)));
-			m_deferred_frame_count = true;
+			m_pending->updated.push_back(m_torrents.add(st, m_frame + 1));
 		}
 		else if (td)
 		{
-			std::unique_lock<std::mutex> l(m_mutex);
-
-			m_removed.push_front(std::make_pair(m_frame + 1, td->info_hash));
-			torrent_history_entry st;
-			st.status.info_hash = td->info_hash;
-			m_queue.right.erase(st);
-			// weed out torrents that were removed a long time ago
-			while (m_removed.size() > 1000 && m_removed.back().first < m_frame - 10)
-				m_removed.pop_back();
-
-			m_deferred_frame_count = true;
+			if (m_torrents.remove(td->info_hash))
+				m_pending->removed.push_back(td->info_hash);
 		}
 		else if (su)
 		{
-			std::unique_lock<std::mutex> l(m_mutex);
-
 			++m_frame;
-			m_deferred_frame_count = false;
+			TORRENT_ASSERT(m_pending->frame == m_frame);
 
 			std::vector<torrent_status> const& st = su->status;
 			for (std::vector<torrent_status>::const_iterator i = st.begin()
 				, end(st.end()); i != end; ++i)
 			{
-				torrent_history_entry e;
-				e.status.info_hash = i->info_hash;
-
-				queue_t::right_iterator it = m_queue.right.find(e);
-				if (it == m_queue.right.end()) continue;
-				const_cast<torrent_history_entry&>(it->first).update_status(*i, m_frame);
-				m_queue.right.replace_data(it, m_frame);
-				// bump this torrent to the beginning of the list
-				m_queue.left.relocate(m_queue.left.begin(), m_queue.project_left(it));
+				int const slot = m_torrents.update(*i, m_frame);
+				if (slot >= 0) m_pending->updated.push_back(slot);
 			}
-/*
-			printf("===== frame: %d =====\n", m_frame);
-			for (queue_t::left_iterator i = m_queue.left.begin()
-				, end(m_queue.left.end()); i != end; ++i)
+
+			// this frame is complete, add it to the journal and make it
+			// visible to readers
+			if (!m_journal.empty()) m_pending->prev = m_journal.back();
+			m_journal.push_back(m_pending);
+			m_journal_size += m_pending->memory();
+			trim_journal();
+
+			publish();
+
+			m_pending = std::make_shared<torrent_history_frame>(m_frame + 1);
+		}
+	}
+
+	std::shared_ptr<torrent_history_snapshot const> torrent_history::snapshot() const
+	{
+		return std::atomic_load(&m_snapshot);
+	}
+
+	std::size_t torrent_history_frame::memory() const
+	{
+		return sizeof(*this)
+			+ updated.capacity() * sizeof(updated[0])
+			+ removed.capacity() * sizeof(removed[0]);
+	}
+
+	bool torrent_history_snapshot::changes_since(int f
+		, std::vector<int>& slots, std::vector<sha1_hash>& removed) const
+	{
+		// there's nothing to collect
+		if (f >= frame) return true;
+
+		std::shared_ptr<torrent_history_frame const> i = journal;
+		while (i)
+		{
+			if (i->frame <= f) return true;
+
+			slots.insert(slots.end(), i->updated.begin(), i->updated.end());
+			removed.insert(removed.end(), i->removed.begin(), i->removed.end());
+
+			// the frame right after the one the client has seen is the
+			// last one we need
+			if (i->frame == f + 1) return true;
+
+			i = std::atomic_load(&i->prev);
+		}
+		return false;
+	}
+
+	bool torrent_history_snapshot::updated_since(int f
+		, std::vector<torrent_status>& st, std::vector<sha1_hash>& removed) const
+	{
+		std::vector<int> slots;
+		if (f > 0 && changes_since(f, slots, removed))
+		{
+			// if most torrents have changed, it's cheaper to just scan
+			// through all of them
+			if (int(slots.size()) < torrents.size())
 			{
-				i->second.debug_print(m_frame);
-//				printf("%3d: (%s) %s\n", i->first, i->second.error.c_str(), i->second.name.c_str());
+				std::sort(slots.begin(), slots.end());
+				slots.erase(std::unique(slots.begin(), slots.end()), slots.end());
+				torrents.updated_since(f, slots, st);
 			}
-*/
+			else
+			{
+				torrents.updated_since(f, st);
+			}
+			return false;
 		}
+
+		removed.clear();
+		torrents.updated_since(0, st);
+		return f > 0;
 	}
 
-	void torrent_history::removed_since(int frame, std::vector<sha1_hash>& torrents) const
+	bool torrent_history_snapshot::updated_fields_since(int f
+		, torrent_history_entry::field_mask const& fields
+		, std::vector<torrent_history_entry>& st
+		, std::vector<sha1_hash>& removed) const
 	{
-		torrents.clear();
-		std::unique_lock<std::mutex> l(m_mutex);
-		for (std::deque<std::pair<int, sha1_hash> >::const_iterator i = m_removed.begin()
-			, end(m_removed.end()); i != end; ++i)
+		std::vector<int> slots;
+		if (f > 0 && changes_since(f, slots, removed))
 		{
-			if (i->first <= frame) break;
-			torrents.push_back(i->second);
+			if (int(slots.size()) < torrents.size())
+			{
+				std::sort(slots.begin(), slots.end());
+				slots.erase(std::unique(slots.begin(), slots.end()), slots.end());
+				torrents.updated_fields_since(f, fields, slots, st);
+			}
+			else
+			{
+				torrents.updated_fields_since(f, fields, st);
+			}
+			return false;
 		}
+
+		removed.clear();
+		torrents.updated_fields_since(0, fields, st);
+		return f > 0;
+	}
+
+	torrent_status torrent_history::get_torrent_status(sha1_hash const& ih) const
+	{
+		torrent_status st;
+		st.info_hash = ih;
+		snapshot()->torrents.get(ih, st);
+		return st;
+	}
+
+	int torrent_history::frame() const
+	{
+		return snapshot()->frame;
+	}
+
+	torrent_history_columns::torrent_history_columns()
+		: m_index(std::make_shared<boost::unordered_map<sha1_hash, int> >())
+	{}
+
+	torrent_history_columns::torrent_history_columns(torrent_history_columns const& c)
+		: m_chunks(c.m_chunks)
+		, m_index(c.m_index)
+	{}
+
+	torrent_history_columns& torrent_history_columns::operator=(
+		torrent_history_columns const& c)
+	{
+		m_chunks = c.m_chunks;
+		m_index = c.m_index;
+		m_free_slots.clear();
+		m_spare.clear();
+		return *this;
+	}
+
+	int torrent_history_columns::find_slot(sha1_hash const& ih) const
+	{
+		boost::unordered_map<sha1_hash, int>::const_iterator i = m_index->find(ih);
+		if (i == m_index->end()) return -1;
+		return i->second;
 	}
 
-	void torrent_history::updated_since(int frame, std::vector<torrent_status>& torrents) const
+	namespace
 	{
-		std::unique_lock<std::mutex> l(m_mutex);
-		for (queue_t::left_const_iterator i = m_queue.left.begin()
-			, end(m_queue.left.end()); i != end; ++i)
+		// no snapshot can get hold of an object we're the only owner of,
+		// since they're only ever created from this copy. It's safe to
+		// modify without copying it. The fence orders our writes after the
+		// reads of the last snapshot that released it
+		template <class T>
+		bool exclusive(std::shared_ptr<T> const& p)
 		{
-			if (i->first <= frame) break;
-			torrents.push_back(i->second.status);
+			if (p.use_count() != 1) return false;
+			std::atomic_thread_fence(std::memory_order_acquire);
+			return true;
 		}
 	}
 
-	void torrent_history::updated_fields_since(int frame, std::vector<torrent_history_entry>& torrents) const
+	void torrent_history_columns::sync_chunk(torrent_history_chunk& dst
+		, torrent_history_chunk const& src)
 	{
-		std::unique_lock<std::mutex> l(m_mutex);
-		for (queue_t::left_const_iterator i = m_queue.left.begin()
-			, end(m_queue.left.end()); i != end; ++i)
+		// every modification made after dst was last written to is marked
+		// with a later frame than any modification dst has seen
+		int const since = dst.last_update;
+		int num_changed = 0;
+		for (int i = 0; i < torrent_history_chunk::size; ++i)
+		{
+			if (src.slot_update[i] <= since) continue;
+			memcpy(dst.lanes[i], src.lanes[i], sizeof(src.lanes[i]));
+			++num_changed;
+		}
+
+		// the frame numbers are stored by field, so each slot's are spread
+		// out over the whole array. Past a few slots it's cheaper to copy
+		// all of it
+		if (num_changed > torrent_history_chunk::size / 8)
 		{
-			if (i->first <= frame) break;
-			torrents.push_back(i->second);
+			memcpy(dst.frame, src.frame, sizeof(src.frame));
 		}
+		else if (num_changed > 0)
+		{
+			for (int i = 0; i < torrent_history_chunk::size; ++i)
+			{
+				if (src.slot_update[i] <= since) continue;
+				for (int k = 0; k < torrent_history_entry::num_fields; ++k)
+					dst.frame[k][i] = src.frame[k][i];
+			}
+		}
+		memcpy(dst.slot_update, src.slot_update, sizeof(src.slot_update));
+		dst.used = src.used;
+		dst.last_update = src.last_update;
+		dst.cold = src.cold;
 	}
 
-	torrent_status torrent_history::get_torrent_status(sha1_hash const& ih) const
+	torrent_history_chunk& torrent_history_columns::writable_chunk(int slot)
 	{
-		torrent_history_entry st;
-		st.status.info_hash = ih;
+		int const n = slot / torrent_history_chunk::size;
+		std::shared_ptr<torrent_history_chunk>& c = m_chunks[n];
+		if (exclusive(c)) return *c;
+
+		// c is shared with a copy of the store. Rather than copying all of
+		// it, reuse the version before it if nothing refers to that anymore,
+		// and only copy the slots that have changed since
+		if (int(m_spare.size()) < int(m_chunks.size())) m_spare.resize(m_chunks.size());
+		std::shared_ptr<torrent_history_chunk>& spare = m_spare[n];
+		if (spare && exclusive(spare))
+		{
+			sync_chunk(*spare, *c);
+			c.swap(spare);
+		}
+		else
+		{
+			spare = c;
+			c = std::make_shared<torrent_history_chunk>(*c);
+		}
+		return *c;
+	}
 
-		std::unique_lock<std::mutex> l(m_mutex);
+	torrent_history_chunk::cold_data& torrent_history_columns::writable_cold(
+		torrent_history_chunk& c)
+	{
+		if (!exclusive(c.cold))
+			c.cold = std::make_shared<torrent_history_chunk::cold_data>(*c.cold);
+		return *c.cold;
+	}
 
-		queue_t::right_const_iterator it = m_queue.right.find(st);
-		if (it != m_queue.right.end()) return it->first.status;
-		return st.status;
+	boost::unordered_map<sha1_hash, int>& torrent_history_columns::writable_index()
+	{
+		if (!exclusive(m_index))
+			m_index = std::make_shared<boost::unordered_map<sha1_hash, int> >(*m_index);
+		return *m_index;
 	}
 
-	int torrent_history::frame() const
+	int torrent_history_columns::allocate_slot()
 	{
-		std::unique_lock<std::mutex> l(m_mutex);
-		if (m_deferred_frame_count)
+		if (m_free_slots.empty())
 		{
-			m_deferred_frame_count = false;
-			++m_frame;
+			int const base = int(m_chunks.size()) * torrent_history_chunk::size;
+			m_chunks.push_back(std::make_shared<torrent_history_chunk>());
+			m_chunks.back()->cold = std::make_shared<torrent_history_chunk::cold_data>();
+			// push them in reverse order to hand out the lowest slot first
+			for (int i = torrent_history_chunk::size - 1; i >= 0; --i)
+				m_free_slots.push_back(base + i);
+		}
+		int const slot = m_free_slots.back();
+		m_free_slots.pop_back();
+		return slot;
+	}
+
+	int torrent_history_columns::add(torrent_status const& st, int f)
+	{
+		int slot = find_slot(st.info_hash);
+		if (slot < 0)
+		{
+			slot = allocate_slot();
+			writable_index()[st.info_hash] = slot;
+		}
+
+		torrent_history_chunk& c = writable_chunk(slot);
+		torrent_history_chunk::cold_data& cold = writable_cold(c);
+		int const i = slot % torrent_history_chunk::size;
+
+		c.used |= std::uint64_t(1) << i;
+		cold.info_hash[i] = st.info_hash;
+		cold.handle[i] = st.handle;
+		cold.torrent_file[i] = st.torrent_file;
+
+		pack(st, c.lanes[i]);
+#define SET_COLUMN(x) cold.x[i] = st.x;
+		TORRENT_HISTORY_STRING_FIELDS(SET_COLUMN)
+#undef SET_COLUMN
+
+		for (int k = 0; k < torrent_history_entry::num_fields; ++k)
+			c.frame[k][i] = f;
+		c.slot_update[i] = f;
+		c.last_update = (std::max)(c.last_update, f);
+		return slot;
+	}
+
+	bool torrent_history_columns::remove(sha1_hash const& ih)
+	{
+		int const slot = find_slot(ih);
+		if (slot < 0) return false;
+		writable_index().erase(ih);
+
+		torrent_history_chunk& c = writable_chunk(slot);
+		torrent_history_chunk::cold_data& cold = writable_cold(c);
+		int const i = slot % torrent_history_chunk::size;
+
+		c.used &= ~(std::uint64_t(1) << i);
+		cold.handle[i] = torrent_handle();
+		cold.torrent_file[i].reset();
+		// release the memory held by the strings
+#define CLEAR_COLUMN(x) std::string().swap(cold.x[i]);
+		TORRENT_HISTORY_STRING_FIELDS(CLEAR_COLUMN)
+#undef CLEAR_COLUMN
+
+		m_free_slots.push_back(slot);
+		return true;
+	}
+
+	int torrent_history_columns::rename(sha1_hash const& old_ih
+		, sha1_hash const& new_ih, int f)
+	{
+		int const slot = find_slot(old_ih);
+		if (slot < 0) return -1;
+		boost::unordered_map<sha1_hash, int>& index = writable_index();
+		index.erase(old_ih);
+		index[new_ih] = slot;
+
+		torrent_history_chunk& c = writable_chunk(slot);
+		int const i = slot % torrent_history_chunk::size;
+
+		writable_cold(c).info_hash[i] = new_ih;
+
+		// to anyone keeping track of torrents by info-hash, this is a new
+		// torrent. All of its fields need to be sent again
+		for (int k = 0; k < torrent_history_entry::num_fields; ++k)
+			c.frame[k][i] = f;
+		c.slot_update[i] = f;
+		c.last_update = (std::max)(c.last_update, f);
+		return slot;
+	}
+
+	namespace
+	{
+		// sets the bits in mask for every lane where a and b differ. num_lanes
+		// must be a multiple of 4
+		void diff_lanes(std::uint32_t const* a, std::uint32_t const* b
+			, int num_lanes, std::uint64_t* mask)
+		{
+			for (int i = 0; i < num_lanes; i += 4)
+			{
+#if defined __SSE2__
+				__m128i const eq = _mm_cmpeq_epi32(
+					_mm_loadu_si128(reinterpret_cast<__m128i const*>(a + i))
+					, _mm_loadu_si128(reinterpret_cast<__m128i const*>(b + i)));
+				std::uint64_t const diff = ~_mm_movemask_ps(_mm_castsi128_ps(eq)) & 0xf;
+#else
+				std::uint64_t const diff = (a[i] != b[i] ? 1 : 0)
+					| (a[i+1] != b[i+1] ? 2 : 0)
+					| (a[i+2] != b[i+2] ? 4 : 0)
+					| (a[i+3] != b[i+3] ? 8 : 0);
+#endif
+				mask[i / 64] |= diff << (i % 64);
+			}
+		}
+
+		// this hash is only used to detect changes to strings, it's
+		// meant to be cheap rather than good
+		std::uint64_t string_hash(std::string const& str)
+		{
+			char const* p = str.data();
+			std::size_t n = str.size();
+			std::uint64_t h = n * 0x9e3779b97f4a7c15ULL;
+			std::uint64_t v;
+			for (; n >= 8; n -= 8, p += 8)
+			{
+				memcpy(&v, p, 8);
+				h = (h ^ v) * 0xff51afd7ed558ccdULL;
+				h ^= h >> 32;
+			}
+			v = 0;
+			for (; n > 0; --n, ++p)
+				v = (v << 8) | std::uint8_t(*p);
+			h = (h ^ v) * 0xc4ceb9fe1a85ec53ULL;
+			return h ^ (h >> 29);
+		}
+
+		bool any_lane(std::uint64_t const* mask, int first, int last)
+		{
+			for (int i = first; i <= last; ++i)
+				if (mask[i / 64] & (std::uint64_t(1) << (i % 64))) return true;
+			return false;
+		}
+	}
+
+	void torrent_history_columns::pack(torrent_status const& st
+		, std::uint32_t* lanes)
+	{
+		memset(lanes, 0, torrent_history_chunk::num_lanes * sizeof(lanes[0]));
+
+		std::uint32_t flags = 0;
+#define PACK_FLAG(x) flags |= std::uint32_t(st.x) << torrent_history_chunk::flag_##x;
+		TORRENT_HISTORY_FLAG_FIELDS(PACK_FLAG)
+#undef PACK_FLAG
+		lanes[torrent_history_chunk::lane_flags] = flags;
+
+#define PACK_LANES(x) memcpy(&lanes[torrent_history_chunk::lane_##x], &st.x, sizeof(st.x));
+		TORRENT_HISTORY_NUMERIC_FIELDS(PACK_LANES)
+#undef PACK_LANES
+
+#define PACK_STRING(x) { \
+		lanes[torrent_history_chunk::lane_##x##_size] = std::uint32_t(st.x.size()); \
+		std::uint64_t const h = string_hash(st.x); \
+		memcpy(&lanes[torrent_history_chunk::lane_##x##_hash], &h, sizeof(h)); }
+		TORRENT_HISTORY_STRING_FIELDS(PACK_STRING)
+#undef PACK_STRING
+	}
+
+	int torrent_history_columns::update(torrent_status const& st, int f)
+	{
+		int const slot = find_slot(st.info_hash);
+		if (slot < 0) return -1;
+
+		int const i = slot % torrent_history_chunk::size;
+
+		std::uint32_t incoming[torrent_history_chunk::num_lanes];
+		pack(st, incoming);
+
+		std::uint64_t lane_mask[(torrent_history_chunk::num_lanes + 63) / 64] = { 0 };
+		diff_lanes(m_chunks[slot / torrent_history_chunk::size]->lanes[i]
+			, incoming, torrent_history_chunk::num_lanes, lane_mask);
+
+		bool changed = false;
+		for (int k = 0; k < int(sizeof(lane_mask) / sizeof(lane_mask[0])); ++k)
+			if (lane_mask[k]) changed = true;
+
+		// this is the common case, and we get away with only
+		// having touched the packed row of this torrent
+		if (!changed) return -1;
+
+		torrent_history_chunk& c = writable_chunk(slot);
+
+		std::uint32_t const flags = c.lanes[i][torrent_history_chunk::lane_flags]
+			^ incoming[torrent_history_chunk::lane_flags];
+#define FLAG_CHANGED(x) if (flags & (1 << torrent_history_chunk::flag_##x)) \
+		c.frame[torrent_history_entry::x][i] = f;
+		TORRENT_HISTORY_FLAG_FIELDS(FLAG_CHANGED)
+#undef FLAG_CHANGED
+
+#define LANES_CHANGED(x) if (any_lane(lane_mask, torrent_history_chunk::lane_##x \
+		, torrent_history_chunk::lane_##x##_last)) \
+		c.frame[torrent_history_entry::x][i] = f;
+		TORRENT_HISTORY_NUMERIC_FIELDS(LANES_CHANGED)
+#undef LANES_CHANGED
+
+		// strings are only compared by length and hash. The stored copy is
+		// only touched if it has to be replaced
+#define STRING_CHANGED(x) if (any_lane(lane_mask, torrent_history_chunk::lane_##x##_size \
+		, torrent_history_chunk::lane_##x##_hash_last)) { \
+		writable_cold(c).x[i] = st.x; \
+		c.frame[torrent_history_entry::x][i] = f; }
+		TORRENT_HISTORY_STRING_FIELDS(STRING_CHANGED)
+#undef STRING_CHANGED
+
+		memcpy(c.lanes[i], incoming, sizeof(incoming));
+
+		// the torrent file is not tracked, but it may have been received
+		// since the torrent was added
+		if (c.cold->torrent_file[i].expired() && !st.torrent_file.expired())
+			writable_cold(c).torrent_file[i] = st.torrent_file;
+
+		c.slot_update[i] = f;
+		c.last_update = (std::max)(c.last_update, f);
+		return slot;
+	}
+
+	void torrent_history_columns::copy_field(int field
+		, torrent_history_chunk const& c, int i, torrent_status& st) const
+	{
+		std::uint32_t const* lanes = c.lanes[i];
+		switch (field)
+		{
+#define COPY_FLAG(x) case torrent_history_entry::x: \
+			st.x = (lanes[torrent_history_chunk::lane_flags] \
+				>> torrent_history_chunk::flag_##x) & 1; break;
+			TORRENT_HISTORY_FLAG_FIELDS(COPY_FLAG)
+#undef COPY_FLAG
+#define COPY_LANES(x) case torrent_history_entry::x: \
+			memcpy(static_cast<void*>(&st.x), &lanes[torrent_history_chunk::lane_##x], sizeof(st.x)); break;
+			TORRENT_HISTORY_NUMERIC_FIELDS(COPY_LANES)
+#undef COPY_LANES
+#define COPY_STRING(x) case torrent_history_entry::x: st.x = c.cold->x[i]; break;
+			TORRENT_HISTORY_STRING_FIELDS(COPY_STRING)
+#undef COPY_STRING
+			default: break;
+		}
+	}
+
+	bool torrent_history_columns::get(sha1_hash const& ih, torrent_status& st) const
+	{
+		int const slot = find_slot(ih);
+		if (slot < 0) return false;
+
+		torrent_history_chunk const& c = *m_chunks[slot / torrent_history_chunk::size];
+		int const i = slot % torrent_history_chunk::size;
+
+		st.info_hash = c.cold->info_hash[i];
+		st.handle = c.cold->handle[i];
+		st.torrent_file = c.cold->torrent_file[i];
+		for (int k = 0; k < torrent_history_entry::num_fields; ++k)
+			copy_field(k, c, i, st);
+		return true;
+	}
+
+	void torrent_history_columns::updated_since(int frame
+		, std::vector<torrent_status>& torrents) const
+	{
+		for (int k = 0; k < int(m_chunks.size()); ++k)
+		{
+			torrent_history_chunk const& c = *m_chunks[k];
+			if (c.last_update <= frame) continue;
+
+			for (int i = 0; i < torrent_history_chunk::size; ++i)
+			{
+				if ((c.used & (std::uint64_t(1) << i)) == 0) continue;
+				if (c.slot_update[i] <= frame) continue;
+
+				torrents.push_back(torrent_status());
+				get(c.cold->info_hash[i], torrents.back());
+			}
+		}
+	}
+
+	void torrent_history_columns::updated_fields_since(int frame
+		, field_mask const& fields, std::vector<torrent_history_entry>& torrents) const
+	{
+		for (int k = 0; k < int(m_chunks.size()); ++k)
+		{
+			torrent_history_chunk const& c = *m_chunks[k];
+			if (c.last_update <= frame) continue;
+
+			// scan the frame column of each requested field, building a
+			// bitmask of the slots that have changed
+			std::uint64_t changed = 0;
+			for (int f = 0; f < torrent_history_entry::num_fields; ++f)
+			{
+				if (!fields[f]) continue;
+				int const* col = c.frame[f];
+				for (int i = 0; i < torrent_history_chunk::size; ++i)
+					changed |= std::uint64_t(col[i] > frame) << i;
+			}
+			changed &= c.used;
+
+			for (int i = 0; changed != 0; ++i, changed >>= 1)
+			{
+				if ((changed & 1) == 0) continue;
+
+				torrents.push_back(torrent_history_entry());
+				copy_fields(fields, c, i, torrents.back());
+			}
+		}
+	}
+
+	void torrent_history_columns::updated_since(int frame
+		, std::vector<int> const& slots
+		, std::vector<torrent_status>& torrents) const
+	{
+		for (std::vector<int>::const_iterator s = slots.begin()
+			, end(slots.end()); s != end; ++s)
+		{
+			torrent_history_chunk const& c = *m_chunks[*s / torrent_history_chunk::size];
+			int const i = *s % torrent_history_chunk::size;
+
+			// the slot may have been removed, or been re-used by a torrent
+			// added since
+			if ((c.used & (std::uint64_t(1) << i)) == 0) continue;
+			if (c.slot_update[i] <= frame) continue;
+
+			torrents.push_back(torrent_status());
+			get(c.cold->info_hash[i], torrents.back());
+		}
+	}
+
+	void torrent_history_columns::updated_fields_since(int frame
+		, field_mask const& fields, std::vector<int> const& slots
+		, std::vector<torrent_history_entry>& torrents) const
+	{
+		for (std::vector<int>::const_iterator s = slots.begin()
+			, end(slots.end()); s != end; ++s)
+		{
+			torrent_history_chunk const& c = *m_chunks[*s / torrent_history_chunk::size];
+			int const i = *s % torrent_history_chunk::size;
+
+			if ((c.used & (std::uint64_t(1) << i)) == 0) continue;
+
+			bool changed = false;
+			for (int f = 0; f < torrent_history_entry::num_fields; ++f)
+			{
+				if (fields[f] && c.frame[f][i] > frame)
+				{
+					changed = true;
+					break;
+				}
+			}
+			if (!changed) continue;
+
+			torrents.push_back(torrent_history_entry());
+			copy_fields(fields, c, i, torrents.back());
+		}
+	}
+
+	void torrent_history_columns::copy_fields(field_mask const& fields
+		, torrent_history_chunk const& c, int i, torrent_history_entry& e) const
+	{
+		e.status.info_hash = c.cold->info_hash[i];
+		e.status.handle = c.cold->handle[i];
+		e.status.torrent_file = c.cold->torrent_file[i];
+		for (int f = 0; f < torrent_history_entry::num_fields; ++f)
+		{
+			if (!fields[f])
+			{
+				e.frame[f] = 0;
+				continue;
+			}
+			e.frame[f] = c.frame[f][i];
+			copy_field(f, c, i, e.status);
 		}
-		return m_frame;
-	}
-
-	void torrent_history_entry::update_status(torrent_status const& s, int f)
-	{
-#define CMP_SET(x) if (s.x != status.x) frame[int(x)] = f
-
-		CMP_SET(state);
-		CMP_SET(paused);
-		CMP_SET(auto_managed);
-		CMP_SET(sequential_download);
-		CMP_SET(is_seeding);
-		CMP_SET(is_finished);
-		CMP_SET(is_loaded);
-		CMP_SET(has_metadata);
-		CMP_SET(progress);
-		CMP_SET(progress_ppm);
-		CMP_SET(error);
-		CMP_SET(save_path);
-		CMP_SET(name);
-		CMP_SET(next_announce);
-		CMP_SET(current_tracker);
-		CMP_SET(total_download);
-		CMP_SET(total_upload);
-		CMP_SET(total_payload_download);
-		CMP_SET(total_payload_upload);
-		CMP_SET(total_failed_bytes);
-		CMP_SET(total_redundant_bytes);
-		CMP_SET(download_rate);
-		CMP_SET(upload_rate);
-		CMP_SET(download_payload_rate);
-		CMP_SET(upload_payload_rate);
-		CMP_SET(num_seeds);
-		CMP_SET(num_peers);
-		CMP_SET(num_complete);
-		CMP_SET(num_incomplete);
-		CMP_SET(list_seeds);
-		CMP_SET(list_peers);
-		CMP_SET(connect_candidates);
-		CMP_SET(num_pieces);
-		CMP_SET(total_done);
-		CMP_SET(total_wanted_done);
-		CMP_SET(total_wanted);
-		CMP_SET(distributed_full_copies);
-		CMP_SET(distributed_fraction);
-		CMP_SET(distributed_copies);
-		CMP_SET(block_size);
-		CMP_SET(num_uploads);
-		CMP_SET(num_connections);
-		CMP_SET(uploads_limit);
-		CMP_SET(connections_limit);
-		CMP_SET(storage_mode);
-		CMP_SET(up_bandwidth_queue);
-		CMP_SET(down_bandwidth_queue);
-		CMP_SET(all_time_upload);
-		CMP_SET(all_time_download);
-		CMP_SET(active_time);
-		CMP_SET(finished_time);
-		CMP_SET(seeding_time);
-		CMP_SET(seed_rank);
-		CMP_SET(last_scrape);
-		CMP_SET(has_incoming);
-		CMP_SET(seed_mode);
-		CMP_SET(upload_mode);
-		CMP_SET(share_mode);
-		CMP_SET(super_seeding);
-		CMP_SET(priority);
-		CMP_SET(added_time);
-		CMP_SET(completed_time);
-		CMP_SET(last_seen_complete);
-		CMP_SET(time_since_upload);
-		CMP_SET(time_since_download);
-		CMP_SET(queue_position);
-		CMP_SET(need_save_resume);
-		CMP_SET(ip_filter_applies);
-
-		status = s;
 	}
 
 	char const* fmt(std::string const& s) { return s.c_str(); }
@@ -35,29 +35,109 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include "alert_observer.hpp"
 #include "libtorrent/torrent_status.hpp"
-#include <mutex> // for mutex
-#include <boost/bimap.hpp>
-#include <boost/bimap/list_of.hpp>
-#include <boost/bimap/unordered_set_of.hpp>
+#include <boost/unordered_map.hpp>
+#include <bitset>
+#include <memory>
 #include <deque>
 
 namespace libtorrent
 {
 	struct alert_handler;
 
+	// these are the torrent_status fields whose changes are tracked by
+	// torrent_history, split by how they are stored. The boolean fields
+	// are packed into a single word, the other numeric fields are packed
+	// into 32 bit lanes and strings are kept in their own columns, see
+	// torrent_history_chunk.
+#define TORRENT_HISTORY_FLAG_FIELDS(X) \
+	X(paused) \
+	X(auto_managed) \
+	X(sequential_download) \
+	X(is_seeding) \
+	X(is_finished) \
+	X(is_loaded) \
+	X(has_metadata) \
+	X(has_incoming) \
+	X(seed_mode) \
+	X(upload_mode) \
+	X(share_mode) \
+	X(super_seeding) \
+	X(need_save_resume) \
+	X(ip_filter_applies)
+
+#define TORRENT_HISTORY_NUMERIC_FIELDS(X) \
+	X(state) \
+	X(progress) \
+	X(progress_ppm) \
+	X(next_announce) \
+	X(total_download) \
+	X(total_upload) \
+	X(total_payload_download) \
+	X(total_payload_upload) \
+	X(total_failed_bytes) \
+	X(total_redundant_bytes) \
+	X(download_rate) \
+	X(upload_rate) \
+	X(download_payload_rate) \
+	X(upload_payload_rate) \
+	X(num_seeds) \
+	X(num_peers) \
+	X(num_complete) \
+	X(num_incomplete) \
+	X(list_seeds) \
+	X(list_peers) \
+	X(connect_candidates) \
+	X(num_pieces) \
+	X(total_done) \
+	X(total_wanted_done) \
+	X(total_wanted) \
+	X(distributed_full_copies) \
+	X(distributed_fraction) \
+	X(distributed_copies) \
+	X(block_size) \
+	X(num_uploads) \
+	X(num_connections) \
+	X(uploads_limit) \
+	X(connections_limit) \
+	X(storage_mode) \
+	X(up_bandwidth_queue) \
+	X(down_bandwidth_queue) \
+	X(all_time_upload) \
+	X(all_time_download) \
+	X(active_time) \
+	X(finished_time) \
+	X(seeding_time) \
+	X(seed_rank) \
+	X(last_scrape) \
+	X(priority) \
+	X(added_time) \
+	X(completed_time) \
+	X(last_seen_complete) \
+	X(time_since_upload) \
+	X(time_since_download) \
+	X(queue_position)
+
+#define TORRENT_HISTORY_STRING_FIELDS(X) \
+	X(error) \
+	X(save_path) \
+	X(name) \
+	X(current_tracker)
+
+#define TORRENT_HISTORY_FIELDS(X) \
+	TORRENT_HISTORY_FLAG_FIELDS(X) \
+	TORRENT_HISTORY_NUMERIC_FIELDS(X) \
+	TORRENT_HISTORY_STRING_FIELDS(X)
+
 	// this is the type that keeps track of frame counters for each
 	// field in torrent_status. The frame counters indicate which frame
 	// they were last modified in. This is used to send minimal updates
 	// of changes to torrents.
 	struct torrent_history_entry
 	{
-		// this is the current state of the torrent
+		// this is the current state of the torrent. Only the fields
+		// that were asked for are filled in
 		torrent_status status;
 
-		void update_status(torrent_status const& s, int frame);
-
-		bool operator==(torrent_history_entry const& e) const { return e.status.info_hash == status.info_hash; }
-
 		enum
 		{
 			state,
@@ -136,39 +216,259 @@ namespace libtorrent
 			num_fields,
 		};
 
+		// a set of fields, indexed by the enum above
+		typedef std::bitset<num_fields> field_mask;
+
 		// these are the frames each individual field was last changed
 		int frame[num_fields];
 
 		torrent_history_entry() {}
 
-		torrent_history_entry(torrent_status const& st, int f)
-			: status(st)
-		{
-			for (int i = 0; i < num_fields; ++i)
-				frame[i] = f;
-		}
-
 		void debug_print(int current_frame) const;
 	};
 
-	inline std::size_t hash_value(torrent_history_entry const& te)
-	{ return hash_value(te.status.info_hash); }
+	// a block of torrent slots. The frame number each tracked field was last
+	// modified in is stored in its own dense array per field, and so is each
+	// string field. The numeric fields of a torrent, and the length and hash
+	// of its strings, are packed into one row of 32 bit lanes. This lets
+	// changes be detected with a few wide compares.
+	// Slots never move once they've been assigned, growing the store just
+	// allocates another chunk.
+	// Chunks are shared between the snapshots torrent_history publishes,
+	// and copied before they're modified.
+	struct torrent_history_chunk
+	{
+		enum { size = 64 };
 
-	struct torrent_history : alert_observer
+		// the bit each boolean field has in the flags lane
+		enum
+		{
+#define TORRENT_HISTORY_FLAG(x) flag_##x,
+			TORRENT_HISTORY_FLAG_FIELDS(TORRENT_HISTORY_FLAG)
+#undef TORRENT_HISTORY_FLAG
+			num_flags
+		};
+
+		// the first lane of each numeric field. Fields wider than 32 bits
+		// occupy more than one lane
+		enum
+		{
+			lane_flags,
+#define TORRENT_HISTORY_LANE(x) lane_##x, lane_##x##_last = lane_##x \
+			+ (sizeof(decltype(torrent_status::x)) + 3) / 4 - 1,
+			TORRENT_HISTORY_NUMERIC_FIELDS(TORRENT_HISTORY_LANE)
+#undef TORRENT_HISTORY_LANE
+
+			// strings are represented by their length and a hash of
+			// their content
+#define TORRENT_HISTORY_LANE(x) lane_##x##_size, lane_##x##_hash, lane_##x##_hash_last \
+			= lane_##x##_hash + 1,
+			TORRENT_HISTORY_STRING_FIELDS(TORRENT_HISTORY_LANE)
+#undef TORRENT_HISTORY_LANE
+			num_used_lanes,
+
+			// rows are padded to a whole number of 128 bit vectors
+			num_lanes = (num_used_lanes + 3) & ~3
+		};
+
+		torrent_history_chunk() : used(0), last_update(0) {}
+
+		// one bit per slot, set if the slot holds a torrent
+		std::uint64_t used;
+
+		// the highest frame any torrent in this chunk was modified in
+		int last_update;
+
+		// the frame each torrent was last modified in
+		int slot_update[size];
+
+		// the columns that rarely change. These are kept in a separate
+		// block, to not have to copy them along with the rest of the chunk
+		struct cold_data
+		{
+			sha1_hash info_hash[size];
+			torrent_handle handle[size];
+			decltype(torrent_status::torrent_file) torrent_file[size];
+
+			// the string fields are only touched when their lanes change
+#define TORRENT_HISTORY_COLUMN(x) std::string x[size];
+			TORRENT_HISTORY_STRING_FIELDS(TORRENT_HISTORY_COLUMN)
+#undef TORRENT_HISTORY_COLUMN
+		};
+
+		std::shared_ptr<cold_data> cold;
+
+		std::uint32_t lanes[size][num_lanes];
+
+		// indexed by field, then by slot
+		int frame[torrent_history_entry::num_fields][size];
+	};
+
+	// the column store backing torrent_history. Torrents are assigned a
+	// stable slot when they're added, and queries only touch the columns
+	// of the fields they ask for. Copying it is cheap, the copies share
+	// all chunks until they're modified. Each copy may be read from any
+	// number of threads, as long as that copy isn't modified.
+	// The bookkeeping only needed to modify the store (free slots and
+	// recycled chunks) is not copied. A copy that is modified allocates
+	// new slots rather than reusing the ones freed in the original.
+	struct torrent_history_columns
 	{
+		typedef torrent_history_entry::field_mask field_mask;
 
-		torrent_history(alert_handler* h);
-		~torrent_history();
+		// adds a torrent with all its fields marked as modified in frame f.
+		// returns the slot it was put in
+		int add(torrent_status const& st, int f);
+
+		// returns false if the torrent wasn't found
+		bool remove(sha1_hash const& ih);
 
-		// returns the info-hashes of the torrents that have been
-		// removed since the specified frame number
-		void removed_since(int frame, std::vector<sha1_hash>& torrents) const;
+		// returns the slot of the renamed torrent, or -1 if it wasn't found
+		int rename(sha1_hash const& old_ih, sha1_hash const& new_ih, int f);
+
+		// records the fields that differ from the stored ones as modified
+		// in frame f. Returns the slot of the torrent if anything changed,
+		// otherwise -1
+		int update(torrent_status const& st, int f);
+
+		// fills in st with all tracked fields of the specified torrent.
+		// returns false if it wasn't found
+		bool get(sha1_hash const& ih, torrent_status& st) const;
 
-		// returns the torrent_status structures for the torrents
-		// that have changed since the specified frame number
 		void updated_since(int frame, std::vector<torrent_status>& torrents) const;
 
-		void updated_fields_since(int frame, std::vector<torrent_history_entry>& torrents) const;
+		// returns the torrents where any of the fields in the mask have
+		// changed since the specified frame. Only those fields (and their
+		// frame numbers) are filled in
+		void updated_fields_since(int frame, field_mask const& fields
+			, std::vector<torrent_history_entry>& torrents) const;
+
+		// the same as the above, but only the specified slots are looked at.
+		// The slots must be sorted and unique
+		void updated_since(int frame, std::vector<int> const& slots
+			, std::vector<torrent_status>& torrents) const;
+		void updated_fields_since(int frame, field_mask const& fields
+			, std::vector<int> const& slots
+			, std::vector<torrent_history_entry>& torrents) const;
+
+		torrent_history_columns();
+		torrent_history_columns(torrent_history_columns const& c);
+		torrent_history_columns& operator=(torrent_history_columns const& c);
+
+		int size() const { return int(m_index->size()); }
+
+	private:
+
+		int find_slot(sha1_hash const& ih) const;
+		int allocate_slot();
+
+		// these make sure the returned object isn't shared with any
+		// other copy before it's modified
+		torrent_history_chunk& writable_chunk(int slot);
+		torrent_history_chunk::cold_data& writable_cold(torrent_history_chunk& c);
+		boost::unordered_map<sha1_hash, int>& writable_index();
+
+		void copy_field(int field, torrent_history_chunk const& c, int i
+			, torrent_status& st) const;
+		void copy_fields(field_mask const& fields, torrent_history_chunk const& c
+			, int i, torrent_history_entry& e) const;
+
+		static void pack(torrent_status const& st, std::uint32_t* lanes);
+
+		// brings dst up to date with src, by copying the slots that have
+		// been modified since dst was last written to. dst must be an
+		// older version of src
+		static void sync_chunk(torrent_history_chunk& dst
+			, torrent_history_chunk const& src);
+
+		std::vector<std::shared_ptr<torrent_history_chunk> > m_chunks;
+
+		// the previous version of each chunk, the one the last copy of the
+		// store was made with. Once no copy holds on to it anymore, it's
+		// brought up to date and reused instead of copying the chunk whole.
+		std::vector<std::shared_ptr<torrent_history_chunk> > m_spare;
+
+		// slots that have been released by removed torrents. New torrents
+		// are put in the lowest free slot.
+		std::vector<int> m_free_slots;
+
+		// info-hash -> slot
+		std::shared_ptr<boost::unordered_map<sha1_hash, int> > m_index;
+	};
+
+	// the changes made to the torrents in one frame. torrent_history keeps a
+	// journal of these, linked together newest first, to be able to answer
+	// what changed since a frame without looking at every torrent.
+	struct torrent_history_frame
+	{
+		torrent_history_frame(int f) : frame(f) {}
+
+		int frame;
+
+		// the slots of the torrents that were added or modified
+		std::vector<int> updated;
+
+		// torrents that were removed (or renamed)
+		std::vector<sha1_hash> removed;
+
+		// the frame before this one. This is cleared once that frame is
+		// dropped from the journal, so it must only be accessed through
+		// the atomic shared_ptr functions
+		std::shared_ptr<torrent_history_frame const> prev;
+
+		// the number of bytes this frame takes up in the journal
+		std::size_t memory() const;
+	};
+
+	// an immutable view of all torrents as of a specific frame. Snapshots
+	// are published once per frame by torrent_history, and may be held on
+	// to and read from without any locking.
+	struct torrent_history_snapshot
+	{
+		// the frame this is a snapshot of
+		int frame;
+
+		torrent_history_columns torrents;
+
+		// the changes made in this frame, linking to the ones before it
+		std::shared_ptr<torrent_history_frame const> journal;
+
+		// returns the torrents that have changed since the specified frame,
+		// and the info-hashes of the ones that have been removed. If the
+		// frame is no longer in the journal, all torrents are returned, no
+		// removed ones, and true is returned to indicate that the client
+		// needs to do a full resync, forgetting any torrent it knows of
+		// that isn't in this update.
+		bool updated_since(int frame, std::vector<torrent_status>& torrents
+			, std::vector<sha1_hash>& removed) const;
+
+		// the same as updated_since(), but only returns the torrents where
+		// any of the fields in the mask have changed.
+		bool updated_fields_since(int frame
+			, torrent_history_entry::field_mask const& fields
+			, std::vector<torrent_history_entry>& torrents
+			, std::vector<sha1_hash>& removed) const;
+
+	private:
+
+		// collects the changes since frame from the journal. Returns false
+		// if the journal doesn't go back that far.
+		bool changes_since(int frame, std::vector<int>& slots
+			, std::vector<sha1_hash>& removed) const;
+	};
+
+	struct torrent_history : alert_observer
+	{
+
+		// journal_budget is the number of bytes the journal of changes
+		// may use. Clients asking for changes since a frame that has been
+		// dropped from the journal are told to do a full resync.
+		torrent_history(alert_handler* h, int journal_budget = 8 * 1024 * 1024);
+		~torrent_history();
+
+		// returns the latest published state, to query changes from.
+		// everything read from one snapshot refers to the same frame
+		std::shared_ptr<torrent_history_snapshot const> snapshot() const;
 
 		torrent_status get_torrent_status(sha1_hash const& ih) const;
 
@@ -179,33 +479,39 @@ namespace libtorrent
 
 	private:	
 
-		// first is the frame this torrent was last
-		// seen modified in, second is the information
-		// about the torrent that was modified
-		typedef boost::bimap<boost::bimaps::list_of<int>
-			, boost::bimaps::unordered_set_of<torrent_history_entry> > queue_t;
+		void publish();
 
-		mutable std::mutex m_mutex;
+		// drop the oldest frames from the journal until it fits
+		// the budget
+		void trim_journal();
 
-		queue_t m_queue;
+		// the following members are only touched by the thread
+		// dispatching alerts. Readers only ever see the snapshots
+		// published from them.
 
-		std::deque<std::pair<int, sha1_hash> > m_removed;
+		torrent_history_columns m_torrents;
+
+		// the changes that will make up the next frame
+		std::shared_ptr<torrent_history_frame> m_pending;
+
+		// the frames in the journal, oldest first
+		std::deque<std::shared_ptr<torrent_history_frame> > m_journal;
+
+		// the number of bytes used by the frames in m_journal
+		std::size_t m_journal_size;
+		std::size_t m_journal_budget;
 
 		alert_handler* m_alerts;
 
-		// frame counter. This is incremented every
-		// time we get a status update for torrents
-		mutable int m_frame;
-
-		// if we haven't gotten any status updates
-		// but we have received add or delete alerts,
-		// we increment the frame counter on access,
-		// in order to make added and deleted event also
-		// fall into distinct time-slots, instead of being
-		// potentially returned twice, once when they
-		// happen and once after we've received an
-		// update and increment the frame counter
-		mutable bool m_deferred_frame_count;
+		// frame counter. This is incremented every time we get a status
+		// update for torrents. Torrents added and removed in between
+		// updates are recorded as belonging to the next frame, and
+		// become visible to readers once that frame is published.
+		int m_frame;
+
+		// the latest published snapshot. It's only accessed through
+		// the atomic shared_ptr functions
+		std::shared_ptr<torrent_history_snapshot const> m_snapshot;
 	};
 }
 
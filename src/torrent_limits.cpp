@@ -0,0 +1,291 @@
+/*
+
+Copyright (c) 2015, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "torrent_limits.hpp"
+
+#include "libtorrent/session.hpp"
+#include "libtorrent/extensions.hpp"
+#include "libtorrent/torrent.hpp"
+#include "libtorrent/announce_entry.hpp"
+#include <boost/unordered_map.hpp>
+#include <mutex>
+
+namespace libtorrent
+{
+	struct torrent_limits_plugin : plugin
+	{
+		struct entry
+		{
+			entry() : valid(false), fresh(false) {}
+			weak_ptr<torrent> torrent_ref;
+			torrent_limits::limits limits;
+			std::vector<torrent_limits::tracker> trackers;
+
+			// set once limits and trackers have been filled in
+			bool valid;
+
+			// set when the values were just changed through torrent_limits.
+			// The next tick may still see the torrent's old values, since
+			// the change is only applied on the network thread, so it's
+			// skipped
+			bool fresh;
+		};
+
+		// one per torrent. It only keeps the torrent's entry around for as
+		// long as the torrent is
+		struct torrent_entry : torrent_plugin
+		{
+			torrent_entry(torrent_limits_plugin* owner, sha1_hash const& ih
+				, weak_ptr<torrent> const& t)
+				: m_owner(owner)
+				, m_info_hash(ih)
+				, m_torrent(t)
+			{}
+
+			~torrent_entry()
+			{
+				m_owner->remove(m_info_hash, m_torrent);
+			}
+
+		private:
+			// the session destroys its torrents before its plugins
+			torrent_limits_plugin* m_owner;
+			sha1_hash m_info_hash;
+
+			// the torrent we belong to. A torrent added with the same
+			// info-hash after this one was removed has its own entry
+			weak_ptr<torrent> m_torrent;
+		};
+
+		boost::shared_ptr<torrent_plugin> new_torrent(torrent_handle const& h, void*)
+		{
+			shared_ptr<torrent> t = h.native_handle();
+			sha1_hash const ih = t->info_hash();
+			std::unique_lock<std::mutex> l(m_mutex);
+			m_torrents[ih].torrent_ref = t;
+			return boost::shared_ptr<torrent_plugin>(new torrent_entry(this, ih, t));
+		}
+
+		// called once a second on the network thread, which is where the
+		// torrents can be read from. All of them are copied in one pass
+		// under the lock
+		void on_tick()
+		{
+			// if the last reference to a torrent were dropped while the lock
+			// is held, its torrent_entry would deadlock removing itself. The
+			// torrents are kept alive until the lock is released
+			std::vector<shared_ptr<torrent> > alive;
+
+			std::unique_lock<std::mutex> l(m_mutex);
+			alive.reserve(m_torrents.size());
+			for (boost::unordered_map<sha1_hash, entry>::iterator i = m_torrents.begin()
+				, end(m_torrents.end()); i != end; ++i)
+			{
+				entry& e = i->second;
+				shared_ptr<torrent> t = e.torrent_ref.lock();
+				if (!t) continue;
+				alive.push_back(t);
+				if (e.fresh)
+				{
+					e.fresh = false;
+					continue;
+				}
+				update(e, *t);
+			}
+		}
+
+		void update(entry& e, torrent& t)
+		{
+			e.limits.download_limit = t.download_limit();
+			e.limits.upload_limit = t.upload_limit();
+			e.limits.max_connections = t.max_connections();
+			e.valid = true;
+
+			// only copy the tracker list when it has changed
+			std::vector<announce_entry> const& trackers = t.trackers();
+			bool changed = e.trackers.size() != trackers.size();
+			for (int i = 0; !changed && i < int(trackers.size()); ++i)
+			{
+				changed = e.trackers[i].url != trackers[i].url
+					|| e.trackers[i].tier != trackers[i].tier;
+			}
+			if (!changed) return;
+
+			e.trackers.resize(trackers.size());
+			for (int i = 0; i < int(trackers.size()); ++i)
+			{
+				e.trackers[i].url = trackers[i].url;
+				e.trackers[i].tier = trackers[i].tier;
+			}
+		}
+
+		// records a limit that was just set on the torrent
+		void set_limit(sha1_hash const& ih, int torrent_limits::limits::* field
+			, int value)
+		{
+			std::unique_lock<std::mutex> l(m_mutex);
+			boost::unordered_map<sha1_hash, entry>::iterator i = m_torrents.find(ih);
+			if (i == m_torrents.end() || !i->second.valid) return;
+			i->second.limits.*field = value;
+			i->second.fresh = true;
+		}
+
+		// records a tracker list that was just set on the torrent
+		void set_trackers(sha1_hash const& ih, std::vector<announce_entry> const& trackers)
+		{
+			std::unique_lock<std::mutex> l(m_mutex);
+			boost::unordered_map<sha1_hash, entry>::iterator i = m_torrents.find(ih);
+			if (i == m_torrents.end() || !i->second.valid) return;
+			entry& e = i->second;
+			e.trackers.resize(trackers.size());
+			for (int k = 0; k < int(trackers.size()); ++k)
+			{
+				e.trackers[k].url = trackers[k].url;
+				e.trackers[k].tier = trackers[k].tier;
+			}
+			e.fresh = true;
+		}
+
+		// removes the entry of the torrent t, unless it has been taken
+		// over by another torrent with the same info-hash
+		void remove(sha1_hash const& ih, weak_ptr<torrent> const& t)
+		{
+			std::unique_lock<std::mutex> l(m_mutex);
+			boost::unordered_map<sha1_hash, entry>::iterator i = m_torrents.find(ih);
+			if (i == m_torrents.end()) return;
+			weak_ptr<torrent> const& owner = i->second.torrent_ref;
+			if (!owner.expired() && (owner.owner_before(t) || t.owner_before(owner)))
+				return;
+			m_torrents.erase(i);
+		}
+
+		bool get(sha1_hash const& ih, torrent_limits::limits& ret) const
+		{
+			std::unique_lock<std::mutex> l(m_mutex);
+			boost::unordered_map<sha1_hash, entry>::const_iterator i = m_torrents.find(ih);
+			if (i == m_torrents.end() || !i->second.valid) return false;
+			ret = i->second.limits;
+			return true;
+		}
+
+		bool trackers(sha1_hash const& ih, std::vector<torrent_limits::tracker>& ret) const
+		{
+			std::unique_lock<std::mutex> l(m_mutex);
+			boost::unordered_map<sha1_hash, entry>::const_iterator i = m_torrents.find(ih);
+			if (i == m_torrents.end() || !i->second.valid) return false;
+			ret = i->second.trackers;
+			return true;
+		}
+
+	private:
+
+		mutable std::mutex m_mutex;
+		boost::unordered_map<sha1_hash, entry> m_torrents;
+	};
+
+	torrent_limits::torrent_limits(session& s)
+		: m_plugin(new torrent_limits_plugin)
+	{
+		s.add_extension(boost::static_pointer_cast<plugin>(m_plugin));
+	}
+
+	torrent_limits::~torrent_limits() {}
+
+	torrent_limits::limits torrent_limits::get(torrent_limits const* l
+		, torrent_handle const& h)
+	{
+		limits ret;
+		if (l && l->m_plugin->get(h.info_hash(), ret)) return ret;
+		return query(h);
+	}
+
+	std::vector<torrent_limits::tracker> torrent_limits::trackers(
+		torrent_limits const* l, torrent_handle const& h)
+	{
+		std::vector<tracker> ret;
+		if (l && l->m_plugin->trackers(h.info_hash(), ret)) return ret;
+		return query_trackers(h);
+	}
+
+	// the change is posted to the network thread before the cache is
+	// updated, so a query that misses the cache sees it too
+	void torrent_limits::set_download_limit(torrent_limits* l
+		, torrent_handle const& h, int limit)
+	{
+		h.set_download_limit(limit);
+		if (l) l->m_plugin->set_limit(h.info_hash(), &limits::download_limit, limit);
+	}
+
+	void torrent_limits::set_upload_limit(torrent_limits* l
+		, torrent_handle const& h, int limit)
+	{
+		h.set_upload_limit(limit);
+		if (l) l->m_plugin->set_limit(h.info_hash(), &limits::upload_limit, limit);
+	}
+
+	void torrent_limits::set_max_connections(torrent_limits* l
+		, torrent_handle const& h, int limit)
+	{
+		h.set_max_connections(limit);
+		if (l) l->m_plugin->set_limit(h.info_hash(), &limits::max_connections, limit);
+	}
+
+	void torrent_limits::replace_trackers(torrent_limits* l
+		, torrent_handle const& h, std::vector<announce_entry> const& trackers)
+	{
+		h.replace_trackers(trackers);
+		if (l) l->m_plugin->set_trackers(h.info_hash(), trackers);
+	}
+
+	torrent_limits::limits torrent_limits::query(torrent_handle const& h)
+	{
+		limits ret;
+		ret.download_limit = h.download_limit();
+		ret.upload_limit = h.upload_limit();
+		ret.max_connections = h.max_connections();
+		return ret;
+	}
+
+	std::vector<torrent_limits::tracker> torrent_limits::query_trackers(
+		torrent_handle const& h)
+	{
+		std::vector<announce_entry> trackers = h.trackers();
+		std::vector<tracker> ret(trackers.size());
+		for (int i = 0; i < int(trackers.size()); ++i)
+		{
+			ret[i].url = trackers[i].url;
+			ret[i].tier = trackers[i].tier;
+		}
+		return ret;
+	}
+}
+
@@ -0,0 +1,104 @@
+/*
+
+Copyright (c) 2015, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_TORRENT_LIMITS_HPP
+#define TORRENT_TORRENT_LIMITS_HPP
+
+#include "libtorrent/peer_id.hpp" // for sha1_hash
+#include "libtorrent/torrent_handle.hpp"
+#include "libtorrent/announce_entry.hpp"
+#include <boost/shared_ptr.hpp>
+#include <vector>
+#include <string>
+
+namespace libtorrent
+{
+	class session;
+	struct torrent_limits_plugin;
+
+	// per-torrent settings that torrent_status doesn't carry, and that
+	// torrent_handle only hands out through blocking calls to the network
+	// thread. A session plugin copies them for every torrent once a
+	// second, on the network thread, so listing N torrents doesn't take N
+	// round trips. Values can be up to a second old, unless they were
+	// changed through the setters below.
+	struct torrent_limits
+	{
+		struct limits
+		{
+			limits() : download_limit(0), upload_limit(0), max_connections(0) {}
+			int download_limit;
+			int upload_limit;
+			int max_connections;
+		};
+
+		struct tracker
+		{
+			std::string url;
+			int tier;
+		};
+
+		torrent_limits(session& s);
+		~torrent_limits();
+
+		// these take the cache, which may be NULL. They return the cached
+		// values of the torrent. Without a cache, or for torrents that
+		// haven't been picked up by the plugin yet, the torrent is asked
+		// directly, blocking until the network thread answers
+		static limits get(torrent_limits const* l, torrent_handle const& h);
+		static std::vector<tracker> trackers(torrent_limits const* l
+			, torrent_handle const& h);
+
+		// these set the value on the torrent, and in the cache right away,
+		// if there is one, so the next listing doesn't show the old value
+		static void set_download_limit(torrent_limits* l
+			, torrent_handle const& h, int limit);
+		static void set_upload_limit(torrent_limits* l
+			, torrent_handle const& h, int limit);
+		static void set_max_connections(torrent_limits* l
+			, torrent_handle const& h, int limit);
+		static void replace_trackers(torrent_limits* l, torrent_handle const& h
+			, std::vector<announce_entry> const& trackers);
+
+	private:
+
+		// these ask the torrent, blocking until the network thread answers
+		static limits query(torrent_handle const& h);
+		static std::vector<tracker> query_trackers(torrent_handle const& h);
+
+		// the plugin is owned by the session, which may outlive us
+		boost::shared_ptr<torrent_limits_plugin> m_plugin;
+	};
+}
+
+#endif
+
@@ -58,7 +58,7 @@ extern "C" {
 #include "libtorrent/announce_entry.hpp"
 #include "libtorrent/torrent_handle.hpp"
 #include "libtorrent/session.hpp"
-#include "libtorrent/session_status.hpp"
+#include "stats_sampler.hpp"
 #include "libtorrent/peer_info.hpp"
 #include "libtorrent/socket_io.hpp" // for print_address
 #include "libtorrent/io.hpp" // for read_int32
@@ -66,6 +66,9 @@ extern "C" {
 #include "response_buffer.hpp" // for appendf
 #include "torrent_post.hpp" // for parse_torrent_post
 #include "escape_json.hpp" // for escape_json
+#include "json_writer.hpp"
+#include "command_batcher.hpp"
+#include "chunked_response.hpp"
 #include "save_settings.hpp"
 
 namespace libtorrent
@@ -88,7 +91,7 @@ void return_failure(std::vector<char>& buf, char const* msg, std::int64_t tag)
 struct method_handler
 {
 	char const* method_name;
-	void (transmission_webui::*fun)(std::vector<char>&, jsmntok_t* args, std::int64_t tag
+	void (transmission_webui::*fun)(chunked_response& out, jsmntok_t* args, std::int64_t tag
 		, char* buffer, permissions_interface const* p);
 };
 
@@ -108,14 +111,14 @@ static method_handler handlers[] =
 	{"session-set", &transmission_webui::set_session},
 };
 
-void transmission_webui::handle_json_rpc(std::vector<char>& buf, jsmntok_t* tokens
+void transmission_webui::handle_json_rpc(chunked_response& out, jsmntok_t* tokens
 	, char* buffer, permissions_interface const* p)
 {
 	// we expect a "method" in the top level
 	jsmntok_t* method = find_key(tokens, buffer, "method", JSMN_STRING);
 	if (method == NULL)
 	{
-		return_failure(buf, "missing method in request", -1);
+		return_failure(out.buffer(), "missing method in request", -1);
 		return;
 	}
 
@@ -123,6 +126,7 @@ void transmission_webui::handle_json_rpc(std::vector<char>& buf, jsmntok_t* toke
 	buffer[method->end] = 0;
 	char const* m = &buffer[method->start];
 	jsmntok_t* args = NULL;
+
 	for (int i = 0; i < sizeof(handlers)/sizeof(handlers[0]); ++i)
 	{
 		if (strcmp(m, handlers[i].method_name)) continue;
@@ -134,16 +138,17 @@ void transmission_webui::handle_json_rpc(std::vector<char>& buf, jsmntok_t* toke
 		if (args) buffer[args->end] = 0;
 //		printf("%s: %s\n", m, args ? buffer + args->start : "{}");
 
-		(this->*handlers[i].fun)(buf, args, tag, buffer, p);
+		(this->*handlers[i].fun)(out, args, tag, buffer, p);
 		break;
 	}
 	if (!handled)
 		printf("Unhandled: %s: %s\n", m, args ? buffer + args->start : "{}");
 }
 
-void transmission_webui::add_torrent(std::vector<char>& buf, jsmntok_t* args
+void transmission_webui::add_torrent(chunked_response& out, jsmntok_t* args
 	, std::int64_t tag, char* buffer, permissions_interface const* p)
 {
+	std::vector<char>& buf = out.buffer();
 	if (!p->allow_add())
 	{
 		return_failure(buf, "permission denied", tag);
@@ -224,10 +229,10 @@ bool all_torrents(torrent_status const& s)
 	return true;
 }
 
-std::uint32_t tracker_id(announce_entry const& ae)
+std::uint32_t tracker_id(std::string const& url, int tier)
 {
-	sha1_hash urlhash = hasher(ae.url.c_str(), ae.url.size()).final();
-	return ae.tier
+	sha1_hash urlhash = hasher(url.c_str(), url.size()).final();
+	return tier
 		+ (std::uint32_t(urlhash[0]) << 8)
 		+ (std::uint32_t(urlhash[1]) << 16)
 		+ (std::uint32_t(urlhash[2]) << 24);
@@ -324,9 +329,10 @@ void transmission_webui::parse_ids(std::set<std::uint32_t>& torrent_ids, jsmntok
 	}
 }
 
-void transmission_webui::get_torrent(std::vector<char>& buf, jsmntok_t* args
+void transmission_webui::get_torrent(chunked_response& out, jsmntok_t* args
 	, std::int64_t tag, char* buffer, permissions_interface const* p)
 {
+	std::vector<char>& buf = out.buffer();
 	if (!p->allow_list())
 	{
 		return_failure(buf, "permission denied", tag);
@@ -353,15 +359,15 @@ void transmission_webui::get_torrent(std::vector<char>& buf, jsmntok_t* args
 	std::vector<torrent_status> t;
 	m_ses.get_torrent_status(&t, &all_torrents);
 
-	appendf(buf, "{ \"result\": \"success\", \"arguments\": { \"torrents\": [");
+	json_writer w(out);
+	w.begin_object()
+		.key("result").string("success")
+		.key("arguments").begin_object()
+		.key("torrents").begin_array();
 
-#define TORRENT_PROPERTY(name, format_code, prop) \
-	if (fields.count(name)) { \
-		appendf(buf, ", \"" name "\": " format_code "" + (count?0:2), prop); \
-		++count; \
-	}
+#define TORRENT_PROPERTY(name, type, prop) \
+	if (fields.count(name)) w.key(name).type(prop)
 
-	int returned_torrents = 0;
 	error_code ec;
 	torrent_info empty("", ec);
 	for (int i = 0; i < t.size(); ++i)
@@ -378,76 +384,69 @@ void transmission_webui::get_torrent(std::vector<char>& buf, jsmntok_t* args
 		if (!torrent_ids.empty() && torrent_ids.count(ts.handle.id()) == 0)
 			continue;
 
-		// skip comma on any item that's not the first one
-		appendf(buf, ", {" + (returned_torrents?0:2));
-		int count = 0;
-		TORRENT_PROPERTY("activityDate", "%" PRId64, time(0) - (std::min)(ts.time_since_download
+		w.begin_object();
+		TORRENT_PROPERTY("activityDate", integer, time(0) - (std::min)(ts.time_since_download
 			, ts.time_since_upload));
-		TORRENT_PROPERTY("addedDate", "%" PRId64, ts.added_time);
-		TORRENT_PROPERTY("comment", "\"%s\"", escape_json(ti->comment()).c_str());
-		TORRENT_PROPERTY("creator", "\"%s\"", escape_json(ti->creator()).c_str());
-		TORRENT_PROPERTY("dateCreated", "%" PRId64, ti->creation_date() ? ti->creation_date().get() : 0);
-		TORRENT_PROPERTY("doneDate", "%" PRId64, ts.completed_time);
-		TORRENT_PROPERTY("downloadDir", "\"%s\"", escape_json(ts.save_path).c_str());
-		TORRENT_PROPERTY("error", "%d", ts.errc ? 0 : 1);
-		TORRENT_PROPERTY("errorString", "\"%s\"", escape_json(ts.errc.message()).c_str());
-		TORRENT_PROPERTY("eta", "%d", ts.download_payload_rate <= 0 ? -1
+		TORRENT_PROPERTY("addedDate", integer, ts.added_time);
+		TORRENT_PROPERTY("comment", string, ti->comment());
+		TORRENT_PROPERTY("creator", string, ti->creator());
+		TORRENT_PROPERTY("dateCreated", integer, ti->creation_date() ? ti->creation_date().get() : 0);
+		TORRENT_PROPERTY("doneDate", integer, ts.completed_time);
+		TORRENT_PROPERTY("downloadDir", string, ts.save_path);
+		TORRENT_PROPERTY("error", integer, ts.errc ? 0 : 1);
+		TORRENT_PROPERTY("errorString", string, ts.errc.message());
+		TORRENT_PROPERTY("eta", integer, ts.download_payload_rate <= 0 ? -1
 			: (ts.total_wanted - ts.total_wanted_done) / ts.download_payload_rate);
-		TORRENT_PROPERTY("hashString", "\"%s\"", to_hex(ts.handle.info_hash().to_string()).c_str());
-		TORRENT_PROPERTY("downloadedEver", "%" PRId64, ts.all_time_download);
-		TORRENT_PROPERTY("downloadLimit", "%d", ts.handle.download_limit());
-		TORRENT_PROPERTY("downloadLimited", "%s", to_bool(ts.handle.download_limit() > 0));
-		TORRENT_PROPERTY("haveValid", "%d", ts.num_pieces);
-		TORRENT_PROPERTY("id", "%u", ts.handle.id());
-		TORRENT_PROPERTY("isFinished", "%s", to_bool(ts.is_finished));
-		TORRENT_PROPERTY("isPrivate", "%s", to_bool(ti->priv()));
-		TORRENT_PROPERTY("isStalled", "%s", to_bool(ts.download_payload_rate == 0));
-		TORRENT_PROPERTY("leftUntilDone", "%" PRId64, ts.total_wanted - ts.total_wanted_done);
-		TORRENT_PROPERTY("magnetLink", "\"%s\"", ti == &empty ? "" : make_magnet_uri(*ti).c_str());
-		TORRENT_PROPERTY("metadataPercentComplete", "%f", ts.has_metadata ? 1.f : ts.progress_ppm / 1000000.f);
-		TORRENT_PROPERTY("name", "\"%s\"", escape_json(ts.name).c_str());
-		TORRENT_PROPERTY("peer-limit", "%d", ts.handle.max_connections());
-		TORRENT_PROPERTY("peersConnected", "%d", ts.num_peers);
+		TORRENT_PROPERTY("hashString", hex, ts.handle.info_hash());
+		TORRENT_PROPERTY("downloadedEver", integer, ts.all_time_download);
+		TORRENT_PROPERTY("downloadLimit", integer, torrent_limits::get(m_limits, ts.handle).download_limit);
+		TORRENT_PROPERTY("downloadLimited", boolean, torrent_limits::get(m_limits, ts.handle).download_limit > 0);
+		TORRENT_PROPERTY("haveValid", integer, ts.num_pieces);
+		TORRENT_PROPERTY("id", integer, ts.handle.id());
+		TORRENT_PROPERTY("isFinished", boolean, ts.is_finished);
+		TORRENT_PROPERTY("isPrivate", boolean, ti->priv());
+		TORRENT_PROPERTY("isStalled", boolean, ts.download_payload_rate == 0);
+		TORRENT_PROPERTY("leftUntilDone", integer, ts.total_wanted - ts.total_wanted_done);
+		TORRENT_PROPERTY("magnetLink", string, ti == &empty ? std::string() : make_magnet_uri(*ti));
+		TORRENT_PROPERTY("metadataPercentComplete", number, ts.has_metadata ? 1.f : ts.progress_ppm / 1000000.f);
+		TORRENT_PROPERTY("name", string, ts.name);
+		TORRENT_PROPERTY("peer-limit", integer, torrent_limits::get(m_limits, ts.handle).max_connections);
+		TORRENT_PROPERTY("peersConnected", integer, ts.num_peers);
 		// even though this is called "percentDone", it's really expecting the
 		// progress in the range [0, 1]
-		TORRENT_PROPERTY("percentDone", "%f", ts.progress_ppm / 1000000.f);
-		TORRENT_PROPERTY("pieceCount", "%d", ti != &empty ? ti->num_pieces() : 0);
-		TORRENT_PROPERTY("pieceSize", "%d", ti != &empty ? ti->piece_length() : 0);
-		TORRENT_PROPERTY("queuePosition", "%d", ts.queue_position);
-		TORRENT_PROPERTY("rateDownload", "%d", ts.download_rate);
-		TORRENT_PROPERTY("rateUpload", "%d", ts.upload_rate);
-		TORRENT_PROPERTY("recheckProgress", "%f", ts.progress_ppm / 1000000.f);
-		TORRENT_PROPERTY("secondsDownloading", "%" PRId64 , ts.active_time);
-		TORRENT_PROPERTY("secondsSeeding", "%" PRId64, ts.finished_time);
-		TORRENT_PROPERTY("sizeWhenDone", "%" PRId64, ti != &empty ? ti->total_size() : 0);
-		TORRENT_PROPERTY("totalSize", "%" PRId64, ts.total_done);
-		TORRENT_PROPERTY("uploadedEver", "%" PRId64, ts.all_time_upload);
-		TORRENT_PROPERTY("uploadLimit", "%d", ts.handle.upload_limit());
-		TORRENT_PROPERTY("uploadLimited", "%s", to_bool(ts.handle.upload_limit() > 0));
-		TORRENT_PROPERTY("uploadedRatio", "%ld", ts.all_time_download == 0
+		TORRENT_PROPERTY("percentDone", number, ts.progress_ppm / 1000000.f);
+		TORRENT_PROPERTY("pieceCount", integer, ti != &empty ? ti->num_pieces() : 0);
+		TORRENT_PROPERTY("pieceSize", integer, ti != &empty ? ti->piece_length() : 0);
+		TORRENT_PROPERTY("queuePosition", integer, ts.queue_position);
+		TORRENT_PROPERTY("rateDownload", integer, ts.download_rate);
+		TORRENT_PROPERTY("rateUpload", integer, ts.upload_rate);
+		TORRENT_PROPERTY("recheckProgress", number, ts.progress_ppm / 1000000.f);
+		TORRENT_PROPERTY("secondsDownloading", integer, ts.active_time);
+		TORRENT_PROPERTY("secondsSeeding", integer, ts.finished_time);
+		TORRENT_PROPERTY("sizeWhenDone", integer, ti != &empty ? ti->total_size() : 0);
+		TORRENT_PROPERTY("totalSize", integer, ts.total_done);
+		TORRENT_PROPERTY("uploadedEver", integer, ts.all_time_upload);
+		TORRENT_PROPERTY("uploadLimit", integer, torrent_limits::get(m_limits, ts.handle).upload_limit);
+		TORRENT_PROPERTY("uploadLimited", boolean, torrent_limits::get(m_limits, ts.handle).upload_limit > 0);
+		TORRENT_PROPERTY("uploadedRatio", integer, ts.all_time_download == 0
 			? -2 : ts.all_time_upload / ts.all_time_download);
-
-		if (fields.count("status"))
-		{
-			appendf(buf, ", \"status\": %d" + (count?0:2), torrent_tr_status(ts));
-			++count;
-		}
+		TORRENT_PROPERTY("status", integer, torrent_tr_status(ts));
 
 		if (fields.count("files"))
 		{
 			file_storage const& files = ti->files();
 			std::vector<std::int64_t> progress;
 			ts.handle.file_progress(progress);
-			appendf(buf, ", \"files\": [" + (count?0:2));
+			w.key("files").begin_array();
 			for (int i = 0; i < files.num_files(); ++i)
 			{
-				appendf(buf, ", { \"bytesCompleted\": %" PRId64 ","
-					"\"length\": %" PRId64 ","
-					"\"name\": \"%s\" }" + (i?0:2)
-					, progress[i], files.file_size(i), escape_json(files.file_path(i)).c_str());
+				w.begin_object()
+					.key("bytesCompleted").integer(progress[i])
+					.key("length").integer(files.file_size(i))
+					.key("name").string(files.file_path(i))
+					.end_object();
 			}
-			appendf(buf, "]");
-			++count;
+			w.end_array();
 		}
 
 		if (fields.count("fileStats"))
@@ -455,137 +454,104 @@ void transmission_webui::get_torrent(std::vector<char>& buf, jsmntok_t* args
 			file_storage const& files = ti->files();
 			std::vector<std::int64_t> progress;
 			ts.handle.file_progress(progress);
-			appendf(buf, ", \"fileStats\": [" + (count?0:2));
+			w.key("fileStats").begin_array();
 			for (int i = 0; i < files.num_files(); ++i)
 			{
 				int prio = ts.handle.file_priority(i);
-				appendf(buf, ", { \"bytesCompleted\": %" PRId64 ","
-					"\"wanted\": %s,"
-					"\"priority\": %d }" + (i?0:2)
-					, progress[i], to_bool(prio), tr_file_priority(prio));
+				w.begin_object()
+					.key("bytesCompleted").integer(progress[i])
+					.key("wanted").boolean(prio)
+					.key("priority").integer(tr_file_priority(prio))
+					.end_object();
 			}
-			appendf(buf, "]");
-			++count;
+			w.end_array();
 		}
 
 		if (fields.count("wanted"))
 		{
 			file_storage const& files = ti->files();
-			appendf(buf, ", \"wanted\": [" + (count?0:2));
+			w.key("wanted").begin_array();
 			for (int i = 0; i < files.num_files(); ++i)
-			{
-				appendf(buf, ", %s" + (i?0:2)
-					, to_bool(ts.handle.file_priority(i)));
-			}
-			appendf(buf, "]");
-			++count;
+				w.boolean(ts.handle.file_priority(i));
+			w.end_array();
 		}
 
 		if (fields.count("priorities"))
 		{
 			file_storage const& files = ti->files();
-			appendf(buf, ", \"priorities\": [" + (count?0:2));
+			w.key("priorities").begin_array();
 			for (int i = 0; i < files.num_files(); ++i)
-			{
-				appendf(buf, ", %d" + (i?0:2)
-					, tr_file_priority(ts.handle.file_priority(i)));
-			}
-			appendf(buf, "]");
-			++count;
+				w.integer(tr_file_priority(ts.handle.file_priority(i)));
+			w.end_array();
 		}
 
 		if (fields.count("webseeds"))
 		{
 			std::vector<web_seed_entry> const& webseeds = ti->web_seeds();
-			appendf(buf, ", \"webseeds\": [" + (count?0:2));
+			w.key("webseeds").begin_array();
 			for (int i = 0; i < webseeds.size(); ++i)
-			{
-				appendf(buf, ", \"%s\"" + (i?0:2)
-					, escape_json(webseeds[i].url).c_str());
-			}
-			appendf(buf, "]");
-			++count;
+				w.string(webseeds[i].url);
+			w.end_array();
 		}
 
 		if (fields.count("pieces"))
 		{
 			std::string encoded_pieces = base64encode(
 				std::string(ts.pieces.data(), (ts.pieces.size() + 7) / 8));
-			appendf(buf, ", \"pieces\": \"%s\"" + (count?0:2)
-				, encoded_pieces.c_str());
-			++count;
+			w.key("pieces").string(encoded_pieces);
 		}
 
 		if (fields.count("peers"))
 		{
 			std::vector<peer_info> peers;
 			ts.handle.get_peer_info(peers);
-			appendf(buf, ", \"peers\": [" + (count?0:2));
+			w.key("peers").begin_array();
 			for (int i = 0; i < peers.size(); ++i)
 			{
 				peer_info const& p = peers[i];
-				appendf(buf, ", { \"address\": \"%s\""
-					", \"clientName\": \"%s\""
-					", \"clientIsChoked\": %s"
-					", \"clientIsInterested\": %s"
-					", \"flagStr\": \"\""
-					", \"isDownloadingFrom\": %s"
-					", \"isEncrypted\": %s"
-					", \"isIncoming\": %s"
-					", \"isUploadingTo\": %s"
-					", \"isUTP\": %s"
-					", \"peerIsChoked\": %s"
-					", \"peerIsInterested\": %s"
-					", \"port\": %d"
-					", \"progress\": %f"
-					", \"rateToClient\": %d"
-					", \"rateToPeer\": %d"
-					"}"
-					+ (i?0:2)
-					, print_address(p.ip.address()).c_str()
-					, escape_json(p.client).c_str()
-					, to_bool(p.flags & peer_info::choked)
-					, to_bool(p.flags & peer_info::interesting)
-					, to_bool(p.downloading_piece_index != -1)
-					, to_bool(p.flags & (peer_info::rc4_encrypted | peer_info::plaintext_encrypted))
-					, to_bool(p.source & peer_info::incoming)
-					, to_bool(p.used_send_buffer)
-					, to_bool(p.flags & peer_info::utp_socket)
-					, to_bool(p.flags & peer_info::remote_choked)
-					, to_bool(p.flags & peer_info::remote_interested)
-					, p.ip.port()
-					, p.progress
-					, p.down_speed
-					, p.up_speed
-					);
+				w.begin_object()
+					.key("address").string(print_address(p.ip.address()))
+					.key("clientName").string(p.client)
+					.key("clientIsChoked").boolean(p.flags & peer_info::choked)
+					.key("clientIsInterested").boolean(p.flags & peer_info::interesting)
+					.key("flagStr").string("", 0)
+					.key("isDownloadingFrom").boolean(p.downloading_piece_index != -1)
+					.key("isEncrypted").boolean(p.flags & (peer_info::rc4_encrypted | peer_info::plaintext_encrypted))
+					.key("isIncoming").boolean(p.source & peer_info::incoming)
+					.key("isUploadingTo").boolean(p.used_send_buffer)
+					.key("isUTP").boolean(p.flags & peer_info::utp_socket)
+					.key("peerIsChoked").boolean(p.flags & peer_info::remote_choked)
+					.key("peerIsInterested").boolean(p.flags & peer_info::remote_interested)
+					.key("port").integer(p.ip.port())
+					.key("progress").number(p.progress)
+					.key("rateToClient").integer(p.down_speed)
+					.key("rateToPeer").integer(p.up_speed)
+					.end_object();
 			}
-			appendf(buf, "]");
-			++count;
+			w.end_array();
 		}
 
 		if (fields.count("trackers"))
 		{
-			std::vector<announce_entry> trackers = ts.handle.trackers();
-			appendf(buf, ", \"trackers\": [" + (count?0:2));
+			std::vector<torrent_limits::tracker> const trackers = torrent_limits::trackers(m_limits, ts.handle);
+			w.key("trackers").begin_array();
 			for (int i = 0; i < trackers.size(); ++i)
 			{
-				announce_entry const& a = trackers[i];
-				appendf(buf, ", { \"announce\": \"%s\""
-					", \"id\": %u"
-					", \"scrape\": \"%s\""
-					", \"tier\": %d"
-					"}"
-					+ (i?0:2)
-					, a.url.c_str(), tracker_id(a), a.url.c_str(), a.tier);
+				torrent_limits::tracker const& a = trackers[i];
+				w.begin_object()
+					.key("announce").string(a.url)
+					.key("id").integer(tracker_id(a.url, a.tier))
+					.key("scrape").string(a.url)
+					.key("tier").integer(a.tier)
+					.end_object();
 			}
-			appendf(buf, "]");
-			++count;
+			w.end_array();
 		}
 
 		if (fields.count("trackerStats"))
 		{
 			std::vector<announce_entry> trackers = ts.handle.trackers();
-			appendf(buf, ", \"trackerStats\": [" + (count?0:2));
+			w.key("trackerStats").begin_array();
 			for (int i = 0; i < trackers.size(); ++i)
 			{
 				announce_entry const& a = trackers[i];
@@ -594,71 +560,53 @@ void transmission_webui::get_torrent(std::vector<char>& buf, jsmntok_t* args
 				std::string hostname;
 				boost::tie(ignore, ignore, hostname, ignore, ignore)
 					= parse_url_components(a.url, ec);
-				appendf(buf, ", { \"announce\": \"%s\""
-					", \"announceState\": %u"
-					", \"downloadCount\": %d"
-					", \"hasAnnounced\": %s"
-					", \"hasScraped\": %s"
-					", \"host\": \"%s\""
-					", \"id\": %u"
-					", \"isBackup\": %s"
-					", \"lastAnnouncePeerCount\": %d"
-					", \"lastAnnounceResult\": \"%s\""
-					", \"lastAnnounceStartTime\": %" PRId64
-					", \"lastAnnounceSucceeded\": %" PRId64
-					", \"lastAnnounceTime\": %" PRId64
-					", \"lastAnnounceTimeOut\": %s"
-					", \"lastScrapePeerCount\": %d"
-					", \"lastScrapeResult\": \"%s\""
-					", \"lastScrapeStartTime\": %" PRId64
-					", \"lastScrapeSucceeded\": %" PRId64
-					", \"lastScrapeTime\": %" PRId64
-					", \"lastScrapeTimeOut\": %s"
-					", \"leecherCount\": %d"
-					", \"nextAnnounceTime\": %" PRId64
-					", \"nextScrapeTime\": %" PRId64
-					", \"scrape\": \"%s\""
-					", \"scrapeState\": %d"
-					", \"seederCount\": %d"
-					", \"tier\": %d"
-					"}"
-					+ (i?0:2)
-					, escape_json(a.url).c_str()
-					, tracker_status(a, ts)
-					, 0
-					, to_bool(a.start_sent)
-					, to_bool(false)
-					, hostname.c_str()
-					, tracker_id(a)
-					, to_bool(false)
-					, 0 // lastAnnouncePeerCount
-					, a.last_error.message().c_str() // lastAnnounceResult
-					, 0 // lastAnnounceStartTime
-					, to_bool(!a.last_error) // lastAnnounceSucceeded
-					, 0 // lastAnnounceTime
-					, to_bool(a.last_error == boost::asio::error::timed_out) // lastAnnounceTimeOut
-					, 0, "", 0, "false", 0, "false"
-					, 0 // leecherCount
-					, time(NULL) + a.next_announce_in()
-					, 0
-					, a.url.c_str()
-					, 0
-					, 0 // seederCount
-					, a.tier);
+				w.begin_object()
+					.key("announce").string(a.url)
+					.key("announceState").integer(tracker_status(a, ts))
+					.key("downloadCount").integer(0)
+					.key("hasAnnounced").boolean(a.start_sent)
+					.key("hasScraped").boolean(false)
+					.key("host").string(hostname)
+					.key("id").integer(tracker_id(a.url, a.tier))
+					.key("isBackup").boolean(false)
+					.key("lastAnnouncePeerCount").integer(0)
+					.key("lastAnnounceResult").string(a.last_error.message())
+					.key("lastAnnounceStartTime").integer(0)
+					.key("lastAnnounceSucceeded").boolean(!a.last_error)
+					.key("lastAnnounceTime").integer(0)
+					.key("lastAnnounceTimeOut").boolean(a.last_error == boost::asio::error::timed_out)
+					.key("lastScrapePeerCount").integer(0)
+					.key("lastScrapeResult").string("", 0)
+					.key("lastScrapeStartTime").integer(0)
+					.key("lastScrapeSucceeded").boolean(false)
+					.key("lastScrapeTime").integer(0)
+					.key("lastScrapeTimeOut").boolean(false)
+					.key("leecherCount").integer(0)
+					.key("nextAnnounceTime").integer(time(NULL) + a.next_announce_in())
+					.key("nextScrapeTime").integer(0)
+					.key("scrape").string(a.url)
+					.key("scrapeState").integer(0)
+					.key("seederCount").integer(0)
+					.key("tier").integer(a.tier)
+					.end_object();
 			}
-			appendf(buf, "]");
-			++count;
+			w.end_array();
 		}
-		appendf(buf, "}");
-		++returned_torrents;
+		w.end_object();
 	}
 
-	appendf(buf, "] }, \"tag\": %" PRId64 " }", tag);
+#undef TORRENT_PROPERTY
+
+	w.end_array()
+		.end_object()
+		.key("tag").integer(tag)
+		.end_object();
 }
 
-void transmission_webui::set_torrent(std::vector<char>& buf, jsmntok_t* args
+void transmission_webui::set_torrent(chunked_response& out, jsmntok_t* args
 	, std::int64_t tag, char* buffer, permissions_interface const* p)
 {
+	std::vector<char>& buf = out.buffer();
 	if (!p->allow_set_settings(-1))
 	{
 		return_failure(buf, "permission denied", tag);
@@ -765,40 +713,32 @@ void transmission_webui::set_torrent(std::vector<char>& buf, jsmntok_t* args
 		}
 	}
 
+	command_batcher commands;
 	for (std::vector<torrent_handle>::iterator i = handles.begin()
 		, end(handles.end()); i != end; ++i)
 	{
 		torrent_handle& h = *i;
 
-		if (set_dl_limit) h.set_download_limit(download_limit * 1000);
-		if (set_ul_limit) h.set_upload_limit(upload_limit * 1000);
+		if (set_dl_limit) torrent_limits::set_download_limit(m_limits, h, download_limit * 1000);
+		if (set_ul_limit) torrent_limits::set_upload_limit(m_limits, h, upload_limit * 1000);
 		if (move_storage) h.move_storage(location);
-		if (set_max_conns) h.set_max_connections(max_connections);
+		if (set_max_conns) torrent_limits::set_max_connections(m_limits, h, max_connections);
 		if (!add_trackers.empty())
 		{
 			std::vector<announce_entry> trackers =  h.trackers();
 			trackers.insert(trackers.end(), add_trackers.begin(), add_trackers.end());
-			h.replace_trackers(trackers);
+			torrent_limits::replace_trackers(m_limits, h, trackers);
 		}
 		if (!file_priority.empty())
-		{
-			std::vector<int> prio = h.file_priorities();
-			if (all_file_prio != -1) std::fill(prio.begin(), prio.end(), all_file_prio);
-			for (std::vector<std::pair<int, int> >::iterator
-				i = file_priority.begin(), end(file_priority.end());
-				i != end; ++i)
-			{
-				if (i->first < 0 || i->first >= prio.size()) continue;
-				prio[i->first] = i->second;
-			}
-			h.prioritize_files(prio);
-		}
+			commands.prioritize_files(h, file_priority, all_file_prio);
 	}
+	commands.flush();
 }
 
-void transmission_webui::start_torrent(std::vector<char>& buf, jsmntok_t* args
+void transmission_webui::start_torrent(chunked_response& out, jsmntok_t* args
 	, std::int64_t tag, char* buffer, permissions_interface const* p)
 {
+	std::vector<char>& buf = out.buffer();
 	if (!p->allow_start())
 	{
 		return_failure(buf, "permission denied", tag);
@@ -807,19 +747,22 @@ void transmission_webui::start_torrent(std::vector<char>& buf, jsmntok_t* args
 
 	std::vector<torrent_handle> handles;
 	get_torrents(handles, args, buffer);
+	command_batcher commands;
 	for (std::vector<torrent_handle>::iterator i = handles.begin()
 		, end(handles.end()); i != end; ++i)
 	{
-		i->auto_managed(true);
-		i->resume();
+		commands.add(*i, command_batcher::set_auto_managed
+			| command_batcher::resume_torrent);
 	}
+	commands.flush();
 	appendf(buf, "{ \"result\": \"success\", \"tag\": %" PRId64 ", "
 		"\"arguments\": {} }", tag);
 }
 
-void transmission_webui::start_torrent_now(std::vector<char>& buf, jsmntok_t* args
+void transmission_webui::start_torrent_now(chunked_response& out, jsmntok_t* args
 	, std::int64_t tag, char* buffer, permissions_interface const* p)
 {
+	std::vector<char>& buf = out.buffer();
 	if (!p->allow_start())
 	{
 		return_failure(buf, "permission denied", tag);
@@ -828,19 +771,22 @@ void transmission_webui::start_torrent_now(std::vector<char>& buf, jsmntok_t* ar
 
 	std::vector<torrent_handle> handles;
 	get_torrents(handles, args, buffer);
+	command_batcher commands;
 	for (std::vector<torrent_handle>::iterator i = handles.begin()
 		, end(handles.end()); i != end; ++i)
 	{
-		i->auto_managed(false);
-		i->resume();
+		commands.add(*i, command_batcher::clear_auto_managed
+			| command_batcher::resume_torrent);
 	}
+	commands.flush();
 	appendf(buf, "{ \"result\": \"success\", \"tag\": %" PRId64 ", "
 		"\"arguments\": {} }", tag);
 }
 
-void transmission_webui::stop_torrent(std::vector<char>& buf, jsmntok_t* args
+void transmission_webui::stop_torrent(chunked_response& out, jsmntok_t* args
 	, std::int64_t tag, char* buffer, permissions_interface const* p)
 {
+	std::vector<char>& buf = out.buffer();
 	if (!p->allow_stop())
 	{
 		return_failure(buf, "permission denied", tag);
@@ -849,19 +795,22 @@ void transmission_webui::stop_torrent(std::vector<char>& buf, jsmntok_t* args
 
 	std::vector<torrent_handle> handles;
 	get_torrents(handles, args, buffer);
+	command_batcher commands;
 	for (std::vector<torrent_handle>::iterator i = handles.begin()
 		, end(handles.end()); i != end; ++i)
 	{
-		i->auto_managed(false);
-		i->pause();
+		commands.add(*i, command_batcher::clear_auto_managed
+			| command_batcher::pause_torrent);
 	}
+	commands.flush();
 	appendf(buf, "{ \"result\": \"success\", \"tag\": %" PRId64 ", "
 		"\"arguments\": {} }", tag);
 }
 
-void transmission_webui::verify_torrent(std::vector<char>& buf, jsmntok_t* args
+void transmission_webui::verify_torrent(chunked_response& out, jsmntok_t* args
 	, std::int64_t tag, char* buffer, permissions_interface const* p)
 {
+	std::vector<char>& buf = out.buffer();
 	if (!p->allow_recheck())
 	{
 		return_failure(buf, "permission denied", tag);
@@ -870,18 +819,21 @@ void transmission_webui::verify_torrent(std::vector<char>& buf, jsmntok_t* args
 
 	std::vector<torrent_handle> handles;
 	get_torrents(handles, args, buffer);
+	command_batcher commands;
 	for (std::vector<torrent_handle>::iterator i = handles.begin()
 		, end(handles.end()); i != end; ++i)
 	{
-		i->force_recheck();
+		commands.add(*i, command_batcher::force_recheck);
 	}
+	commands.flush();
 	appendf(buf, "{ \"result\": \"success\", \"tag\": %" PRId64 ", "
 		"\"arguments\": {} }", tag);
 }
 
-void transmission_webui::reannounce_torrent(std::vector<char>& buf, jsmntok_t* args
+void transmission_webui::reannounce_torrent(chunked_response& out, jsmntok_t* args
 	, std::int64_t tag, char* buffer, permissions_interface const* p)
 {
+	std::vector<char>& buf = out.buffer();
 	if (!p->allow_start())
 	{
 		return_failure(buf, "permission denied", tag);
@@ -899,9 +851,10 @@ void transmission_webui::reannounce_torrent(std::vector<char>& buf, jsmntok_t* a
 		"\"arguments\": {} }", tag);
 }
 
-void transmission_webui::remove_torrent(std::vector<char>& buf, jsmntok_t* args
+void transmission_webui::remove_torrent(chunked_response& out, jsmntok_t* args
 	, std::int64_t tag, char* buffer, permissions_interface const* p)
 {
+	std::vector<char>& buf = out.buffer();
 	if (!p->allow_remove())
 	{
 		return_failure(buf, "permission denied", tag);
@@ -912,26 +865,29 @@ void transmission_webui::remove_torrent(std::vector<char>& buf, jsmntok_t* args
 
 	std::vector<torrent_handle> handles;
 	get_torrents(handles, args, buffer);
+	command_batcher commands;
 	for (std::vector<torrent_handle>::iterator i = handles.begin()
 		, end(handles.end()); i != end; ++i)
 	{
-		m_ses.remove_torrent(*i, delete_data ? session::delete_files : 0);
+		commands.add(*i, command_batcher::remove_torrent
+			| (delete_data ? command_batcher::delete_files : 0));
 	}
+	commands.flush();
 	appendf(buf, "{ \"result\": \"success\", \"tag\": %" PRId64 ", "
 		"\"arguments\": {} }", tag);
 }
 
-void transmission_webui::session_stats(std::vector<char>& buf, jsmntok_t* args
+void transmission_webui::session_stats(chunked_response& out, jsmntok_t* args
 	, std::int64_t tag, char* buffer, permissions_interface const* p)
 {
+	std::vector<char>& buf = out.buffer();
 	if (!p->allow_session_status())
 	{
 		return_failure(buf, "permission denied", tag);
 		return;
 	}
 
-	// TODO: post session stats instead, and capture the performance counters
-	session_status st = m_ses.status();
+	std::shared_ptr<stats_sample const> st = m_stats->sample();
 
 	appendf(buf, "{ \"result\": \"success\", \"tag\": %" PRId64 ", "
 		"\"arguments\": { "
@@ -955,35 +911,35 @@ void transmission_webui::session_stats(std::vector<char>& buf, jsmntok_t* args
 			"\"secondsActive\": %d"
 			"}"
 		"}}", tag
-		, st.num_torrents - st.num_paused_torrents
-		, st.payload_download_rate
-		, st.num_paused_torrents
-		, st.num_torrents
-		, st.payload_upload_rate
+		, st->num_torrents - st->num_paused_torrents
+		, st->payload_download_rate
+		, st->num_paused_torrents
+		, st->num_torrents
+		, st->payload_upload_rate
 		// cumulative-stats (not supported)
-		, st.total_payload_upload
-		, st.total_payload_download
-		, st.num_torrents
+		, st->total_payload_upload
+		, st->total_payload_download
+		, st->num_torrents
 		, 1
 		, time(nullptr) - m_start_time
 		// current-stats
-		, st.total_payload_upload
-		, st.total_payload_download
-		, st.num_torrents
+		, st->total_payload_upload
+		, st->total_payload_download
+		, st->num_torrents
 		, 1
 		, time(nullptr) - m_start_time);
 }
 
-void transmission_webui::get_session(std::vector<char>& buf, jsmntok_t* args
+void transmission_webui::get_session(chunked_response& out, jsmntok_t* args
 	, std::int64_t tag, char* buffer, permissions_interface const* p)
 {
+	std::vector<char>& buf = out.buffer();
 	if (!p->allow_get_settings(-1))
 	{
 		return_failure(buf, "permission denied", tag);
 		return;
 	}
 
-	session_status st = m_ses.status();
 	settings_pack sett = m_ses.get_settings();
 
 	pe_settings pes = m_ses.get_pe_settings();
@@ -1047,7 +1003,7 @@ void transmission_webui::get_session(std::vector<char>& buf, jsmntok_t* args
 	);
 }
 
-void transmission_webui::set_session(std::vector<char>& buf, jsmntok_t* args, std::int64_t tag
+void transmission_webui::set_session(chunked_response& out, jsmntok_t* args, std::int64_t tag
 	, char* buffer, permissions_interface const* p)
 {
 	settings_pack pack;
@@ -1276,10 +1232,14 @@ void transmission_webui::get_torrents(std::vector<torrent_handle>& handles, jsmn
 	}
 }
 
-transmission_webui::transmission_webui(session& s, save_settings_interface* sett, auth_interface const* auth)
+transmission_webui::transmission_webui(session& s, save_settings_interface* sett
+	, stats_sampler const* stats, auth_interface const* auth
+	, torrent_limits* limits)
 	: m_ses(s)
-	, m_settings(sett)
+	, m_stats(stats)
 	, m_auth(auth)
+	, m_limits(limits)
+	, m_settings(sett)
 {
 	if (m_auth == NULL)
 	{
@@ -1374,7 +1334,6 @@ bool transmission_webui::handle_http(mg_connection* conn, mg_request_info const*
 //		, request_info->query_string ? "?" : ""
 //		, request_info->query_string ? request_info->query_string : "");
 
-	std::vector<char> response;
 	if (post_body.empty())
 	{
 		return_error(conn, "request with no POST body");
@@ -1406,17 +1365,9 @@ bool transmission_webui::handle_http(mg_connection* conn, mg_request_info const*
 		return true;
 	}
 
-	handle_json_rpc(response, tokens, &post_body[0], perms);
-
-	// we need a null terminator
-	response.push_back('\0');
-	// subtract one from content-length
-	// to not count null terminator
-	mg_printf(conn, "HTTP/1.1 200 OK\r\n"
-		"Content-Type: text/json\r\n"
-		"Content-Length: %d\r\n\r\n", int(response.size()) - 1);
-	mg_write(conn, &response[0], response.size());
-//	printf("%s\n", &response[0]);
+	chunked_response out(conn, request_info, "text/json", &m_compression);
+	handle_json_rpc(out, tokens, &post_body[0], perms);
+	out.finish();
 	return true;
 }
 
@@ -34,6 +34,8 @@ POSSIBILITY OF SUCH DAMAGE.
 #define TORRENT_TRANSMISSION_WEBUI_HPP
 
 #include "webui.hpp"
+#include "chunked_response.hpp"
+#include "torrent_limits.hpp"
 
 extern "C" {
 #include "jsmn.h"
@@ -50,43 +52,56 @@ namespace libtorrent
 	struct save_settings_interface;
 	struct permissions_interface;
 	struct auth_interface;
+	struct stats_sampler;
 
 	struct transmission_webui : http_handler
 	{
-		transmission_webui(session& s, save_settings_interface* sett, auth_interface const* auth = NULL);
+		transmission_webui(session& s, save_settings_interface* sett
+			, stats_sampler const* stats, auth_interface const* auth = NULL
+			, torrent_limits* limits = NULL);
 		~transmission_webui();
 
 		void set_params_model(add_torrent_params const& p)
 		{ m_params_model = p; }
 
+		// how the JSON replies are compressed, for clients that accept it
+		void set_compression(http_compression const& c)
+		{ m_compression = c; }
+
 		virtual bool handle_http(mg_connection* conn,
 			mg_request_info const* request_info);
 
-		void add_torrent(std::vector<char>&, jsmntok_t* args, std::int64_t tag, char* buffer, permissions_interface const* p);
-		void get_torrent(std::vector<char>&, jsmntok_t* args, std::int64_t tag, char* buffer, permissions_interface const* p);
-		void set_torrent(std::vector<char>&, jsmntok_t* args, std::int64_t tag, char* buffer, permissions_interface const* p);
-		void start_torrent(std::vector<char>&, jsmntok_t* args, std::int64_t tag, char* buffer, permissions_interface const* p);
-		void start_torrent_now(std::vector<char>&, jsmntok_t* args, std::int64_t tag, char* buffer, permissions_interface const* p);
-		void stop_torrent(std::vector<char>&, jsmntok_t* args, std::int64_t tag, char* buffer, permissions_interface const* p);
-		void verify_torrent(std::vector<char>&, jsmntok_t* args, std::int64_t tag, char* buffer, permissions_interface const* p);
-		void reannounce_torrent(std::vector<char>&, jsmntok_t* args, std::int64_t tag, char* buffer, permissions_interface const* p);
-		void remove_torrent(std::vector<char>&, jsmntok_t* args, std::int64_t tag, char* buffer, permissions_interface const* p);
-		void session_stats(std::vector<char>&, jsmntok_t* args, std::int64_t tag, char* buffer, permissions_interface const* p);
-		void get_session(std::vector<char>& buf, jsmntok_t* args, std::int64_t tag, char* buffer, permissions_interface const* p);
-		void set_session(std::vector<char>& buf, jsmntok_t* args, std::int64_t tag, char* buffer, permissions_interface const* p);
+		void add_torrent(chunked_response& out, jsmntok_t* args, std::int64_t tag, char* buffer, permissions_interface const* p);
+		// the reply is streamed to the client as it's written
+		void get_torrent(chunked_response& out, jsmntok_t* args, std::int64_t tag, char* buffer, permissions_interface const* p);
+		void set_torrent(chunked_response& out, jsmntok_t* args, std::int64_t tag, char* buffer, permissions_interface const* p);
+		void start_torrent(chunked_response& out, jsmntok_t* args, std::int64_t tag, char* buffer, permissions_interface const* p);
+		void start_torrent_now(chunked_response& out, jsmntok_t* args, std::int64_t tag, char* buffer, permissions_interface const* p);
+		void stop_torrent(chunked_response& out, jsmntok_t* args, std::int64_t tag, char* buffer, permissions_interface const* p);
+		void verify_torrent(chunked_response& out, jsmntok_t* args, std::int64_t tag, char* buffer, permissions_interface const* p);
+		void reannounce_torrent(chunked_response& out, jsmntok_t* args, std::int64_t tag, char* buffer, permissions_interface const* p);
+		void remove_torrent(chunked_response& out, jsmntok_t* args, std::int64_t tag, char* buffer, permissions_interface const* p);
+		void session_stats(chunked_response& out, jsmntok_t* args, std::int64_t tag, char* buffer, permissions_interface const* p);
+		void get_session(chunked_response& out, jsmntok_t* args, std::int64_t tag, char* buffer, permissions_interface const* p);
+		void set_session(chunked_response& out, jsmntok_t* args, std::int64_t tag, char* buffer, permissions_interface const* p);
 
 	private:
 
 		void get_torrents(std::vector<torrent_handle>& handles, jsmntok_t* args
 			, char* buffer);
-		void handle_json_rpc(std::vector<char>& buf, jsmntok_t* tokens, char* buffer, permissions_interface const* p);
+		void handle_json_rpc(chunked_response& out, jsmntok_t* tokens, char* buffer, permissions_interface const* p);
 		void parse_ids(std::set<std::uint32_t>& torrent_ids, jsmntok_t* args, char* buffer);
 
 		time_t m_start_time;
 		session& m_ses;
+		stats_sampler const* m_stats;
 		auth_interface const* m_auth;
+
+		// per-torrent limits, cached by a session plugin. May be NULL
+		torrent_limits* m_limits;
 		save_settings_interface* m_settings;
 		add_torrent_params m_params_model;
+		http_compression m_compression;
 	};
 }
 
@@ -62,6 +62,9 @@ extern "C" {
 #include "response_buffer.hpp" // for appendf
 #include "torrent_post.hpp"
 #include "escape_json.hpp"
+#include "json_writer.hpp"
+#include "command_batcher.hpp"
+#include "chunked_response.hpp"
 #include "auto_load.hpp"
 #include "save_settings.hpp"
 #include "torrent_history.hpp"
@@ -75,10 +78,12 @@ namespace libtorrent
 utorrent_webui::utorrent_webui(session& s, save_settings_interface* sett
 	, auto_load* al, torrent_history* hist
 	, rss_filter_handler* rss_filter
-	, auth_interface const* auth)
+	, auth_interface const* auth
+	, torrent_limits const* limits)
 	: m_ses(s)
 	, m_al(al)
 	, m_auth(auth)
+	, m_limits(limits)
 	, m_settings(sett)
 	, m_rss_filter(rss_filter)
 	, m_hist(hist)
@@ -282,26 +287,22 @@ bool utorrent_webui::handle_http(mg_connection* conn, mg_request_info const* req
 		}
 	}
 
+	// from here on, the reply is sent as it's generated. The torrent
+	// list may be large
+	chunked_response out(conn, request_info, "text/json", &m_compression);
+	out.buffer().insert(out.buffer().end(), response.begin(), response.end());
+
 	char buf[10];
 	if (mg_get_var(request_info->query_string, strlen(request_info->query_string)
 		, "list", buf, sizeof(buf)) > 0
 		&& atoi(buf) > 0)
 	{
-		send_torrent_list(response, request_info->query_string, perms);
+		send_torrent_list(out, request_info->query_string, perms);
 //		send_rss_list(response, request_info->query_string, perms);
 	}
 
-	// we need a null terminator
-	appendf(response, "}");
-	response.push_back('\0');
-
-	// subtract one from content-length
-	// to not count null terminator
-	mg_printf(conn, "HTTP/1.1 200 OK\r\n"
-		"Content-Type: text/json\r\n"
-		"Content-Length: %d\r\n\r\n", int(response.size()) - 1);
-	mg_write(conn, &response[0], response.size()-1);
-//	printf("%s\n", &response[0]);
+	out.buffer().push_back('}');
+	out.finish();
 	return true;
 }
 
@@ -314,95 +315,113 @@ void utorrent_webui::start(std::vector<char>&, char const* args, permissions_int
 {
 	if (!p->allow_start()) return;
 
+	command_batcher commands;
 	TORRENT_APPLY_FUN
 	{
-		i->handle.clear_error();
-		i->handle.set_upload_mode(false);
-		i->handle.auto_managed(true);
-		i->handle.resume();
+		commands.add(i->handle, command_batcher::clear_error
+			| command_batcher::clear_upload_mode
+			| command_batcher::set_auto_managed
+			| command_batcher::resume_torrent);
 	}
+	commands.flush();
 }
 
 void utorrent_webui::stop(std::vector<char>&, char const* args, permissions_interface const* p)
 {
 	if (!p->allow_stop()) return;
 
+	command_batcher commands;
 	TORRENT_APPLY_FUN
 	{
-		i->handle.auto_managed(false);
-		i->handle.pause();
+		commands.add(i->handle, command_batcher::clear_auto_managed
+			| command_batcher::pause_torrent);
 	}
+	commands.flush();
 }
 
 void utorrent_webui::force_start(std::vector<char>&, char const* args, permissions_interface const* p)
 {
 	if (!p->allow_start()) return;
 
+	command_batcher commands;
 	TORRENT_APPLY_FUN
 	{
-		i->handle.auto_managed(false);
-		i->handle.resume();
+		commands.add(i->handle, command_batcher::clear_auto_managed
+			| command_batcher::resume_torrent);
 	}
+	commands.flush();
 }
 
 void utorrent_webui::recheck(std::vector<char>&, char const* args, permissions_interface const* p)
 {
 	if (!p->allow_recheck()) return;
 
+	command_batcher commands;
 	TORRENT_APPLY_FUN
 	{
-		i->handle.force_recheck();
+		commands.add(i->handle, command_batcher::force_recheck);
 	}
+	commands.flush();
 }
 
 void utorrent_webui::queue_up(std::vector<char>&, char const* args, permissions_interface const* p)
 {
 	if (!p->allow_queue_change()) return;
 
+	command_batcher commands;
 	TORRENT_APPLY_FUN
 	{
-		i->handle.queue_position_up();
+		commands.add(i->handle, command_batcher::queue_up);
 	}
+	commands.flush();
 }
 
 void utorrent_webui::queue_down(std::vector<char>&, char const* args, permissions_interface const* p)
 {
 	if (!p->allow_queue_change()) return;
 
+	command_batcher commands;
 	TORRENT_APPLY_FUN
 	{
-		i->handle.queue_position_down();
+		commands.add(i->handle, command_batcher::queue_down);
 	}
+	commands.flush();
 }
 
 void utorrent_webui::queue_top(std::vector<char>&, char const* args, permissions_interface const* p)
 {
 	if (!p->allow_queue_change()) return;
 
+	command_batcher commands;
 	TORRENT_APPLY_FUN
 	{
-		i->handle.queue_position_top();
+		commands.add(i->handle, command_batcher::queue_top);
 	}
+	commands.flush();
 }
 
 void utorrent_webui::queue_bottom(std::vector<char>&, char const* args, permissions_interface const* p)
 {
 	if (!p->allow_queue_change()) return;
 
+	command_batcher commands;
 	TORRENT_APPLY_FUN
 	{
-		i->handle.queue_position_bottom();
+		commands.add(i->handle, command_batcher::queue_bottom);
 	}
+	commands.flush();
 }
 
 void utorrent_webui::remove_torrent(std::vector<char>&, char const* args, permissions_interface const* p)
 {
 	if (!p->allow_remove()) return;
 
+	command_batcher commands;
 	TORRENT_APPLY_FUN
 	{
-		m_ses.remove_torrent(i->handle);
+		commands.add(i->handle, command_batcher::remove_torrent);
 	}
+	commands.flush();
 }
 
 void utorrent_webui::set_file_priority(std::vector<char>&, char const* args, permissions_interface const* p)
@@ -418,7 +437,7 @@ void utorrent_webui::set_file_priority(std::vector<char>&, char const* args, per
 	int prio = atoi(prio_str);
 	prio *= 2;
 
-	std::vector<int> files;
+	std::vector<std::pair<int, int> > files;
 	for (char const* f = strstr(args, "&f="); f; f = strstr(f, "&f="))
 	{
 		f += 3;
@@ -426,26 +445,30 @@ void utorrent_webui::set_file_priority(std::vector<char>&, char const* args, per
 		int idx = strtol(f, &end, 10);
 		if (*end == '&' || *end == '\0')
 		{
-			files.push_back(idx);
+			files.push_back(std::make_pair(idx, prio));
 			f = end;
 		}
 	}
 
+	command_batcher commands;
 	TORRENT_APPLY_FUN
 	{
-		for (std::vector<int>::iterator j = files.begin(), end(files.end()); j != end; ++j)
-			i->handle.file_priority(*j, prio);
+		commands.prioritize_files(i->handle, files);
 	}
+	commands.flush();
 }
 
 void utorrent_webui::remove_torrent_and_data(std::vector<char>&, char const* args, permissions_interface const* p)
 {
 	if (!p->allow_remove() || !p->allow_remove_data()) return;
 
+	command_batcher commands;
 	TORRENT_APPLY_FUN
 	{
-		m_ses.remove_torrent(i->handle, session::delete_files);
+		commands.add(i->handle, command_batcher::remove_torrent
+			| command_batcher::delete_files);
 	}
+	commands.flush();
 }
 
 void utorrent_webui::list_dirs(std::vector<char>& response, char const* args, permissions_interface const* p)
@@ -853,8 +876,8 @@ void utorrent_webui::send_file_list(std::vector<char>& response, char const* arg
 	if (!p->allow_list()) return;
 
 	std::vector<torrent_status> t = parse_torrents(args);
-	appendf(response, ",\"files\":[");
-	int first = 1;
+	json_writer w(response, true);
+	w.key("files").begin_array();
 	std::vector<std::int64_t> progress;
 	std::vector<int> file_prio;
 	for (std::vector<torrent_status>::iterator i = t.begin()
@@ -866,52 +889,43 @@ void utorrent_webui::send_file_list(std::vector<char>& response, char const* arg
 		if (!ti || !ti->is_valid()) continue;
 		file_storage const& files = ti->files();
 
-		appendf(response, ",\"%s\",["+first, to_hex(ti->info_hash().to_string()).c_str());
-		int first_file = 1;
+		w.hex(ti->info_hash()).begin_array();
 		for (int i = 0; i < files.num_files(); ++i)
 		{
 			int first_piece = files.file_offset(i) / files.piece_length();
 			int last_piece = (files.file_offset(i) + files.file_size(i)) / files.piece_length();
 			// don't round 1 down to 0. 0 is special (do-not-download)
 			if (file_prio[i] == 1) file_prio[i] = 2;
-			appendf(response, ",[\"%s\", %" PRId64 ", %" PRId64 ", %d" + first_file
-				, escape_json(files.file_name(i)).c_str()
-				, files.file_size(i)
-				, progress[i]
-				, file_prio[i] / 2 // uTorrent's web UI uses 4 priority levels, libtorrent uses 8
-				);
+			w.begin_array()
+				.string(files.file_name(i))
+				.integer(files.file_size(i))
+				.integer(progress[i])
+				// uTorrent's web UI uses 4 priority levels, libtorrent uses 8
+				.integer(file_prio[i] / 2);
 
 			if (m_version > 0)
 			{
-				appendf(response, ", %d, %d]"
-					, first_piece
-					, last_piece - first_piece);
+				w.integer(first_piece)
+					.integer(last_piece - first_piece);
 			}
-			else
-			{
-				response.push_back(']');
-			}
-			first_file = 0;
+			w.end_array();
 		}
-
-		response.push_back(']');
-		first = 0;
+		w.end_array();
 	}
-	response.push_back(']');
+	w.end_array();
 }
 
-std::string trackers_as_string(torrent_handle h)
+std::string trackers_as_string(std::vector<torrent_limits::tracker> const& trackers)
 {
 	std::string ret;
-	std::vector<announce_entry> trackers = h.trackers();
 	int last_tier = 0;
-	for (std::vector<announce_entry>::iterator i = trackers.begin()
+	for (std::vector<torrent_limits::tracker>::const_iterator i = trackers.begin()
 		, end(trackers.end()); i != end; ++i)
 	{
-		if (last_tier != i->tier) ret += "\\r\\n";
+		if (last_tier != i->tier) ret += "\r\n";
 		last_tier = i->tier;
 		ret += i->url;
-		ret += "\\r\\n";
+		ret += "\r\n";
 	}
 	return ret;
 }
@@ -942,41 +956,31 @@ void utorrent_webui::get_properties(std::vector<char>& response, char const* arg
 	if (!p->allow_list()) return;
 
 	std::vector<torrent_status> t = parse_torrents(args);
-	appendf(response, ",\"props\":[");
-	int first = 1;
+	json_writer w(response, true);
+	w.key("props").begin_array();
 	for (std::vector<torrent_status>::iterator i = t.begin()
 		, end(t.end()); i != end; ++i)
 	{
 		torrent_status const& st = *i;
 		shared_ptr<const torrent_info> ti = st.torrent_file.lock();
-		appendf(response, ",{\"hash\":\"%s\","
-			"\"trackers\":\"%s\","
-			"\"ulrate\":%d,"
-			"\"dlrate\":%d,"
-			"\"superseed\":%d,"
-			"\"dht\":%d,"
-			"\"pex\":%d,"
-			"\"seed_override\":%d,"
-			"\"seed_ratio\": %f,"
-			"\"seed_time\": %d,"
-			"\"ulslots\": %d,"
-			"\"seed_num\": %d}" + first
-			, ti ? to_hex(ti->info_hash().to_string()).c_str() : ""
-			, trackers_as_string(i->handle).c_str()
-			, st.handle.download_limit()
-			, st.handle.upload_limit()
-			, st.super_seeding
-			, ti && ti->priv() ? 0 : m_ses.is_dht_running()
-			, ti && ti->priv() ? 0 : 1
-			, 0
-			, 0
-			, 0
-			, 0
-			, 0
-			);
-		first = 0;
+		w.begin_object().key("hash");
+		if (ti) w.hex(ti->info_hash());
+		else w.string("", 0);
+		torrent_limits::limits const lim = torrent_limits::get(m_limits, st.handle);
+		w.key("trackers").string(trackers_as_string(torrent_limits::trackers(m_limits, st.handle)))
+			.key("ulrate").integer(lim.download_limit)
+			.key("dlrate").integer(lim.upload_limit)
+			.key("superseed").integer(st.super_seeding)
+			.key("dht").integer(ti && ti->priv() ? 0 : m_ses.is_dht_running())
+			.key("pex").integer(ti && ti->priv() ? 0 : 1)
+			.key("seed_override").integer(0)
+			.key("seed_ratio").number(0)
+			.key("seed_time").integer(0)
+			.key("ulslots").integer(0)
+			.key("seed_num").integer(0)
+			.end_object();
 	}
-	response.push_back(']');
+	w.end_array();
 }
 
 std::string utorrent_peer_flags(peer_info const& pi)
@@ -1321,7 +1325,104 @@ std::string utorrent_message(torrent_status const& st)
 	return "??";
 }
 
-void utorrent_webui::send_torrent_list(std::vector<char>& response, char const* args, permissions_interface const* p)
+namespace {
+
+	torrent_history_entry::field_mask make_row_fields()
+	{
+		int const row_fields[] = {
+			torrent_history_entry::state,
+			torrent_history_entry::paused,
+			torrent_history_entry::auto_managed,
+			// the torrent's size comes with its metadata
+			torrent_history_entry::has_metadata,
+			torrent_history_entry::upload_mode,
+			torrent_history_entry::error,
+			torrent_history_entry::name,
+			torrent_history_entry::save_path,
+			torrent_history_entry::progress_ppm,
+			torrent_history_entry::all_time_download,
+			torrent_history_entry::all_time_upload,
+			torrent_history_entry::upload_payload_rate,
+			torrent_history_entry::download_payload_rate,
+			torrent_history_entry::total_wanted,
+			torrent_history_entry::total_wanted_done,
+			torrent_history_entry::num_peers,
+			torrent_history_entry::num_seeds,
+			torrent_history_entry::list_peers,
+			torrent_history_entry::list_seeds,
+			torrent_history_entry::distributed_full_copies,
+			torrent_history_entry::distributed_fraction,
+			torrent_history_entry::queue_position,
+			torrent_history_entry::added_time,
+			torrent_history_entry::completed_time,
+		};
+		torrent_history_entry::field_mask ret;
+		for (int i = 0; i < int(sizeof(row_fields) / sizeof(row_fields[0])); ++i)
+			ret.set(row_fields[i]);
+		return ret;
+	}
+
+	// the torrent_history fields a row of the torrent list is built from
+	torrent_history_entry::field_mask const& torrent_row_fields()
+	{
+		static torrent_history_entry::field_mask const fields = make_row_fields();
+		return fields;
+	}
+
+	// the last frame any of the fields of the row changed in
+	int row_modified(torrent_history_entry const& e)
+	{
+		torrent_history_entry::field_mask const& fields = torrent_row_fields();
+		int ret = 0;
+		for (int f = 0; f < torrent_history_entry::num_fields; ++f)
+			if (fields[f]) ret = (std::max)(ret, e.frame[f]);
+		return ret;
+	}
+}
+
+void utorrent_webui::build_torrent_row(std::vector<char>& row, torrent_status const& st) const
+{
+	shared_ptr<const torrent_info> ti = st.torrent_file.lock();
+	json_writer w(row);
+	w.begin_array()
+		.hex(st.info_hash)
+		.integer(utorrent_status(st))
+		.string(st.name)
+		.integer(ti ? ti->total_size() : 0)
+		.integer(st.progress_ppm / 1000)
+		.integer(st.all_time_download)
+		.integer(st.all_time_upload)
+		.number(st.all_time_download == 0 ? 0 : float(st.all_time_upload) * 1000.f / st.all_time_download)
+		.integer(st.upload_payload_rate)
+		.integer(st.download_payload_rate)
+		.integer(st.download_payload_rate == 0 ? 0 : (st.total_wanted - st.total_wanted_done) / st.download_payload_rate)
+		.string("", 0) // label
+		.integer(st.num_peers - st.num_seeds)
+		.integer(st.list_peers - st.list_seeds)
+		.integer(st.num_seeds)
+		.integer(st.list_seeds)
+		.integer(st.distributed_full_copies < 0 ? 0
+			: int(st.distributed_full_copies << 16) + int(st.distributed_fraction * 65536 / 1000))
+		.integer(st.queue_position)
+		.integer(st.total_wanted - st.total_wanted_done);
+
+	if (m_version > 0)
+	{
+		w.string("", 0) // url this torrent came from
+			.string("", 0) // feed URL this torrent belongs to
+			.string(utorrent_message(st))
+			.hex(st.info_hash)
+			.integer(st.added_time)
+			.integer(st.completed_time)
+			.string("", 0) // app
+			.string(st.save_path)
+			.integer(0)
+			.string("", 0);
+	}
+	w.end_array();
+}
+
+void utorrent_webui::send_torrent_list(chunked_response& out, char const* args, permissions_interface const* p)
 {
 	if (!p->allow_list()) return;
 
@@ -1332,73 +1433,104 @@ void utorrent_webui::send_torrent_list(std::vector<char>& response, char const*
 		, "cid", buf, sizeof(buf));
 	if (ret > 0) cid = atoi(buf);
 
-	appendf(response, cid > 0 ? ",\"torrentp\":[" : ",\"torrents\":[");
+	std::shared_ptr<torrent_history_snapshot const> snapshot = m_hist->snapshot();
 
-	std::vector<torrent_status> torrents;
-	m_hist->updated_since(cid, torrents);
+	std::vector<torrent_history_entry> torrents;
+	std::vector<sha1_hash> removed;
+	bool const resync = snapshot->updated_fields_since(cid, torrent_row_fields()
+		, torrents, removed);
+	// a full list has every torrent in it
+	bool const full = cid <= 0 || resync;
+
+	// pick up the rows that are still current. A row is stale if any of
+	// its fields changed after the frame it was built from
+	typedef std::shared_ptr<std::vector<char> const> row_ptr;
+	std::vector<row_ptr> rows(torrents.size());
+	{
+		std::lock_guard<std::mutex> l(m_rows_mutex);
+		for (int i = 0; i < int(torrents.size()); ++i)
+		{
+			boost::unordered_map<sha1_hash, cached_row>::iterator r
+				= m_rows.find(torrents[i].status.info_hash);
+			if (r == m_rows.end()) continue;
+			if (r->second.version != m_version) continue;
+			if (r->second.frame < row_modified(torrents[i])) continue;
+			rows[i] = r->second.row;
+		}
+	}
 
-	int first = 1;
-	for (std::vector<torrent_status>::iterator i = torrents.begin()
-		, end(torrents.end()); i != end; ++i)
+	// build the rest without holding the lock
+	std::vector<int> built;
+	for (int i = 0; i < int(torrents.size()); ++i)
 	{
-		shared_ptr<const torrent_info> ti = i->torrent_file.lock();
-		appendf(response, ",[\"%s\",%d,\"%s\",%" PRId64 ",%d,%" PRId64 ",%" PRId64 ",%f,%d,%d,%d,\"%s\",%d,%d,%d,%d,%d,%d,%" PRId64 "" + first
-			, to_hex(i->info_hash.to_string()).c_str()
-			, utorrent_status(*i)
-			, escape_json(i->name).c_str()
-			, ti ? ti->total_size() : 0
-			, i->progress_ppm / 1000
-			, i->all_time_download
-			, i->all_time_upload
-			, i->all_time_download == 0 ? 0 : float(i->all_time_upload) * 1000.f / i->all_time_download
-			, i->upload_payload_rate
-			, i->download_payload_rate
-			, i->download_payload_rate == 0 ? 0 : (i->total_wanted - i->total_wanted_done) / i->download_payload_rate
-			, "" // label
-			, i->num_peers - i->num_seeds
-			, i->list_peers - i->list_seeds
-			, i->num_seeds
-			, i->list_seeds
-			, i->distributed_full_copies < 0 ? 0
-				: int(i->distributed_full_copies << 16) + int(i->distributed_fraction * 65536 / 1000)
-			, i->queue_position
-			, i->total_wanted - i->total_wanted_done
-			);
-
-		if (m_version > 0)
+		if (rows[i]) continue;
+		std::shared_ptr<std::vector<char> > row = std::make_shared<std::vector<char> >();
+		build_torrent_row(*row, torrents[i].status);
+		rows[i] = row;
+		built.push_back(i);
+	}
+
+	{
+		std::lock_guard<std::mutex> l(m_rows_mutex);
+		for (int k = 0; k < int(built.size()); ++k)
 		{
-			appendf(response, ",\"%s\",\"%s\",\"%s\",\"%s\",%" PRId64 ",%" PRId64 ",\"%s\",\"%s\",%d,\"%s\"]"
-			, "" // url this torrent came from
-			, "" // feed URL this torrent belongs to
-			, escape_json(utorrent_message(*i)).c_str()
-			, to_hex(i->info_hash.to_string()).c_str()
-			, i->added_time
-			, i->completed_time
-			, "" // app
-			, escape_json(i->save_path).c_str()
-			, 0
-			, "");
+			int const i = built[k];
+			cached_row& c = m_rows[torrents[i].status.info_hash];
+			// another poll may have built it from a later snapshot
+			if (c.row && c.version == m_version && c.frame >= snapshot->frame)
+				continue;
+			c.frame = snapshot->frame;
+			c.version = m_version;
+			c.row = rows[i];
+		}
+
+		if (full)
+		{
+			// forget the rows of torrents that are gone
+			if (int(m_rows.size()) > int(torrents.size()))
+			{
+				boost::unordered_map<sha1_hash, cached_row> keep;
+				for (int i = 0; i < int(torrents.size()); ++i)
+				{
+					boost::unordered_map<sha1_hash, cached_row>::iterator r
+						= m_rows.find(torrents[i].status.info_hash);
+					if (r != m_rows.end()) keep.insert(*r);
+				}
+				m_rows.swap(keep);
+			}
 		}
 		else
 		{
-			response.push_back(']');
+			for (int i = 0; i < int(removed.size()); ++i)
+				m_rows.erase(removed[i]);
 		}
-		first = 0;
 	}
 
-	std::vector<sha1_hash> removed;
-	m_hist->removed_since(cid, removed);
+	json_writer w(out, true);
+	std::size_t total = 0;
+	for (int i = 0; i < int(rows.size()); ++i) total += rows[i]->size() + 1;
+	w.reserve(int(total) + 100 + int(removed.size()) * 43);
 
-	appendf(response, "], \"torrentm\": [");
-	first = 1;
+	// if the cache ID is too old to send a delta against, send the full
+	// list, which replaces the client's list rather than patching it
+	w.key(cid > 0 && !resync ? "torrentp" : "torrents").begin_array();
+	for (int i = 0; i < int(rows.size()); ++i)
+		w.raw(&(*rows[i])[0], int(rows[i]->size()));
+	w.end_array();
+
+	w.key("torrentm").begin_array();
 	for (std::vector<sha1_hash>::iterator i = removed.begin()
 		, end(removed.end()); i != end; ++i)
 	{
-		appendf(response, ",\"%s\"" + first, to_hex(i->to_string()).c_str());
-		first = 0;
+		w.hex(*i);
 	}
+	w.end_array();
+
 	// TODO: support labels
-	appendf(response, "], \"label\": [], \"torrentc\": \"%d\"", m_hist->frame());
+	w.key("label").begin_array().end_array();
+	char frame[20];
+	snprintf(frame, sizeof(frame), "%d", snapshot->frame);
+	w.key("torrentc").string(frame);
 }
 
 void utorrent_webui::send_rss_list(std::vector<char>& response, char const* args, permissions_interface const* p)
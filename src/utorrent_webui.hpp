@@ -34,12 +34,18 @@ POSSIBILITY OF SUCH DAMAGE.
 #define TORRENT_UT_WEBUI_HPP
 
 #include "webui.hpp"
+#include "chunked_response.hpp"
+#include "torrent_limits.hpp"
 #include "libtorrent/torrent_handle.hpp"
 #include "libtorrent/add_torrent_params.hpp"
+#include "libtorrent/torrent_status.hpp"
 #include <boost/cstdint.hpp>
+#include <boost/unordered_map.hpp>
 #include <vector>
 #include <set>
 #include <deque>
+#include <memory>
+#include <mutex>
 
 namespace libtorrent
 {
@@ -55,12 +61,17 @@ namespace libtorrent
 		utorrent_webui(session& s, save_settings_interface* sett = NULL
 			, auto_load* al = NULL, torrent_history* hist = NULL
 			, rss_filter_handler* rss_filter = NULL
-			, auth_interface const* auth = NULL);
+			, auth_interface const* auth = NULL
+			, torrent_limits const* limits = NULL);
 		~utorrent_webui();
 
 		void set_params_model(add_torrent_params const& p)
 		{ m_params_model = p; }
 
+		// how the JSON replies are compressed, for clients that accept it
+		void set_compression(http_compression const& c)
+		{ m_compression = c; }
+
 		virtual bool handle_http(mg_connection* conn
 			, mg_request_info const* request_info);
 
@@ -85,7 +96,8 @@ namespace libtorrent
 		void add_url(std::vector<char>&, char const* args, permissions_interface const* p);
 
 		void send_file_list(std::vector<char>&, char const* args, permissions_interface const* p);
-		void send_torrent_list(std::vector<char>&, char const* args, permissions_interface const* p);
+		// the torrent list is streamed to the client as it's written
+		void send_torrent_list(chunked_response& out, char const* args, permissions_interface const* p);
 		void send_peer_list(std::vector<char>& response, char const* args, permissions_interface const* p);
 
 		void get_version(std::vector<char>& response, char const* args, permissions_interface const* p);
@@ -100,9 +112,13 @@ namespace libtorrent
 
 		std::vector<torrent_status> parse_torrents(char const* args) const;
 
+		// serializes the torrent's row of the torrent list
+		void build_torrent_row(std::vector<char>& row, torrent_status const& st) const;
+
 		time_t m_start_time;
 		session& m_ses;
 		add_torrent_params m_params_model;
+		http_compression m_compression;
 		std::string m_webui_cookie;
 
 		// optional auto loader, controllable
@@ -111,6 +127,9 @@ namespace libtorrent
 
 		auth_interface const* m_auth;
 
+		// per-torrent limits, cached by a session plugin. May be NULL
+		torrent_limits const* m_limits;
+
 		save_settings_interface* m_settings;
 
 		rss_filter_handler* m_rss_filter;
@@ -123,6 +142,20 @@ namespace libtorrent
 		// since last time
 		torrent_history* m_hist;
 
+		// a serialized row of the torrent list, and the torrent_history
+		// frame it was built from
+		struct cached_row
+		{
+			int frame;
+			int version;
+			std::shared_ptr<std::vector<char> const> row;
+		};
+
+		// the rows of the torrent list, by info-hash. A row is reused by
+		// every poll until one of the fields it's built from changes
+		boost::unordered_map<sha1_hash, cached_row> m_rows;
+		std::mutex m_rows_mutex;
+
 		int m_version;
 		std::string m_token;
 		webui_base* m_listener;
@@ -33,9 +33,155 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "websocket_handler.hpp"
 #include "libtorrent/io.hpp"
 #include "local_mongoose.h"
+#include <cstring> // for memcpy
+#include <string>
+#include <vector>
+#include <zlib.h>
 
 namespace libtorrent
 {
+	// the per-message deflate state of a web socket (RFC 7692). The deflate
+	// stream is used by the threads sending on the socket, while holding
+	// mutex. The inflate stream is only used by the thread reading from the
+	// socket.
+	struct websocket_handler::socket_state
+	{
+		socket_state()
+			: closed(false)
+			, deflate(false)
+			, no_context_takeover(false)
+			, window_bits(15)
+		{
+			memset(&deflater, 0, sizeof(deflater));
+			memset(&inflater, 0, sizeof(inflater));
+		}
+
+		~socket_state()
+		{
+			if (!deflate) return;
+			deflateEnd(&deflater);
+			inflateEnd(&inflater);
+		}
+
+		bool init()
+		{
+			// negative window bits means raw deflate, without zlib header
+			if (deflateInit2(&deflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED
+				, -window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+				return false;
+			if (inflateInit2(&inflater, -15) != Z_OK)
+			{
+				deflateEnd(&deflater);
+				return false;
+			}
+			deflate = true;
+			return true;
+		}
+
+		// held while sending a message
+		std::mutex mutex;
+
+		// set, while holding mutex, once the connection has ended. After
+		// that the mg_connection may be gone, or in use by another request
+		bool closed;
+
+		// true if permessage-deflate was negotiated
+		bool deflate;
+
+		// when set, every message we send is compressed on its own
+		bool no_context_takeover;
+
+		// the LZ77 window size we compress with
+		int window_bits;
+
+		z_stream deflater;
+		z_stream inflater;
+
+		std::vector<char> deflate_buf;
+		std::vector<char> inflate_buf;
+	};
+
+	namespace
+	{
+		// parses the Sec-WebSocket-Extensions header of a handshake. If
+		// there's a permessage-deflate offer we can accept, the response to
+		// it is returned and no_context_takeover and window_bits are set
+		std::string negotiate_deflate(char const* header
+			, bool& no_context_takeover, int& window_bits)
+		{
+			if (header == NULL) return std::string();
+
+			std::string offers = header;
+			std::string::size_type start = 0;
+			while (start < offers.size())
+			{
+				std::string::size_type end = offers.find(',', start);
+				if (end == std::string::npos) end = offers.size();
+				std::string offer = offers.substr(start, end - start);
+				start = end + 1;
+
+				// split the offer into the extension name and its
+				// parameters
+				std::vector<std::string> params;
+				std::string::size_type i = 0;
+				while (i <= offer.size())
+				{
+					std::string::size_type e = offer.find(';', i);
+					if (e == std::string::npos) e = offer.size();
+					std::string p = offer.substr(i, e - i);
+					p.erase(0, p.find_first_not_of(" \t"));
+					p.erase(p.find_last_not_of(" \t") + 1);
+					params.push_back(p);
+					i = e + 1;
+				}
+
+				if (params.empty() || params[0] != "permessage-deflate") continue;
+
+				std::string response = "permessage-deflate";
+				bool no_takeover = false;
+				int bits = 15;
+				bool ok = true;
+				for (int k = 1; k < int(params.size()); ++k)
+				{
+					std::string const& p = params[k];
+					if (p == "server_no_context_takeover")
+					{
+						no_takeover = true;
+						response += "; server_no_context_takeover";
+					}
+					else if (p.compare(0, 22, "server_max_window_bits") == 0)
+					{
+						std::string::size_type eq = p.find('=');
+						bits = eq == std::string::npos ? 0
+							: atoi(p.c_str() + eq + 1 + (p[eq + 1] == '"' ? 1 : 0));
+						// zlib doesn't support a raw deflate window of 8 bits
+						if (bits < 9 || bits > 15) ok = false;
+						response += "; server_max_window_bits=" + std::to_string(bits);
+					}
+					else if (p == "client_no_context_takeover"
+						|| p.compare(0, 22, "client_max_window_bits") == 0)
+					{
+						// our inflater can decompress anything the client
+						// sends with these
+					}
+					else
+					{
+						ok = false;
+					}
+				}
+				if (!ok) continue;
+
+				no_context_takeover = no_takeover;
+				window_bits = bits;
+				return response;
+			}
+			return std::string();
+		}
+	}
+
+	websocket_handler::websocket_handler() {}
+	websocket_handler::~websocket_handler() {}
+
 	// TODO: this should be a writev-like function
 	bool websocket_handler::send_packet(mg_connection* conn, int type, char const* buffer, int len)
 	{
@@ -49,14 +195,47 @@ namespace libtorrent
 			fprintf(stderr, "ERROR: send_packet, socket not open\n");
 			return false;
 		}
-		std::mutex& m = *i->second;
-		std::unique_lock<std::mutex> l2(m);
+		std::shared_ptr<socket_state> state = i->second;
 		l.unlock();
 
+		socket_state& s = *state;
+		std::unique_lock<std::mutex> l2(s.mutex);
+		if (s.closed)
+		{
+			fprintf(stderr, "ERROR: send_packet, socket closed\n");
+			return false;
+		}
+
+		bool compressed = false;
+		if (s.deflate && len >= min_deflate_size && (type == 0x1 || type == 0x2))
+		{
+			z_stream& z = s.deflater;
+			s.deflate_buf.resize(deflateBound(&z, len) + 16);
+			z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(buffer));
+			z.avail_in = len;
+			z.next_out = reinterpret_cast<Bytef*>(&s.deflate_buf[0]);
+			z.avail_out = s.deflate_buf.size();
+			int const ret = ::deflate(&z, Z_SYNC_FLUSH);
+			if (ret != Z_OK || z.avail_in != 0 || z.avail_out == 0)
+			{
+				fprintf(stderr, "ERROR: send_packet, deflate failed (%d)\n", ret);
+				return false;
+			}
+			int const size = s.deflate_buf.size() - z.avail_out;
+
+			// the message doesn't include the empty block ending the flush
+			TORRENT_ASSERT(size >= 4);
+			buffer = &s.deflate_buf[0];
+			len = size - 4;
+			compressed = true;
+
+			if (s.no_context_takeover) deflateReset(&z);
+		}
+
 		// header
 		int header_len = 2;
 		std::uint8_t h[20];
-		h[0] = 0x80 | (type & 0xf);
+		h[0] = 0x80 | (compressed ? 0x40 : 0) | (type & 0xf);
 		if (len < 126)
 			h[1] = len;
 		else if (len < 65536)
@@ -74,6 +253,22 @@ namespace libtorrent
 			header_len = 10;
 		}
 
+		// small packets, like most RPC responses, are sent with a single
+		// write rather than one for the header and one for the payload
+		if (len > 0 && len <= 512)
+		{
+			std::uint8_t packet[10 + 512];
+			memcpy(packet, h, header_len);
+			memcpy(packet + header_len, buffer, len);
+			int ret = mg_write(conn, packet, header_len + len);
+			if (ret < header_len + len)
+			{
+				fprintf(stderr, "ERROR: send_packet, short write (%d < %d)\n", ret, header_len + len);
+				return false;
+			}
+			return true;
+		}
+
 		// TODO: it would be nice to have an mg_writev()
 		int ret = mg_write(conn, h, header_len);
 		if (ret < header_len)
@@ -97,8 +292,18 @@ namespace libtorrent
 	bool websocket_handler::handle_websocket_connect(mg_connection* conn
 		, mg_request_info const* request_info)
 	{
+		std::shared_ptr<socket_state> s = std::make_shared<socket_state>();
+
+		// if the client supports compression, negotiate it. The response is
+		// sent by mongoose as part of the handshake
+		std::string const response = negotiate_deflate(
+			mg_get_header(conn, "Sec-WebSocket-Extensions")
+			, s->no_context_takeover, s->window_bits);
+		if (!response.empty() && s->init())
+			mg_set_websocket_extensions(conn, response.c_str());
+
 		std::unique_lock<std::mutex> l(m_mutex);
-		m_open_sockets.insert(std::make_pair(conn, std::unique_ptr<std::mutex>(new std::mutex())));
+		m_open_sockets[conn] = s;
 		return true;
 	}
 
@@ -106,18 +311,82 @@ namespace libtorrent
 	// there need to be a number of fragments per frame limit and
 	// a total size limit per frame
 	// This layer should also handle ping messages
-//	bool libtorrent_webui::handle_websocket_data(mg_connection* conn
-//		, int bits, char* data, size_t length)
-//	{
-//	}
+	bool websocket_handler::handle_websocket_data(mg_connection* conn
+		, int bits, char* data, size_t length)
+	{
+		// compressed messages have RSV1 set
+		if ((bits & 0x40) == 0)
+			return handle_websocket_message(conn, bits, data, length);
+
+		std::shared_ptr<socket_state> s;
+		{
+			std::unique_lock<std::mutex> l(m_mutex);
+			auto i = m_open_sockets.find(conn);
+			if (i != m_open_sockets.end()) s = i->second;
+		}
+
+		if (s == NULL || !s->deflate)
+		{
+			fprintf(stderr, "ERROR: received compressed message without deflate\n");
+			return false;
+		}
+
+		// the sender strips the empty block at the end of every message,
+		// it has to be put back for zlib
+		static char const tail[] = { 0, 0, char(0xff), char(0xff) };
+
+		// don't let a client make us inflate more than this
+		size_t const max_message_size = 16 * 1024 * 1024;
+
+		z_stream& z = s->inflater;
+		std::vector<char>& out = s->inflate_buf;
+		out.resize((std::max)(size_t(4096), length * 4));
+		size_t size = 0;
+		for (int pass = 0; pass < 2; ++pass)
+		{
+			z.next_in = reinterpret_cast<Bytef*>(pass == 0 ? data : const_cast<char*>(tail));
+			z.avail_in = pass == 0 ? length : sizeof(tail);
+			while (z.avail_in > 0)
+			{
+				if (size == out.size())
+				{
+					if (out.size() >= max_message_size)
+					{
+						fprintf(stderr, "ERROR: inflated message too large\n");
+						return false;
+					}
+					out.resize(out.size() * 2);
+				}
+				z.next_out = reinterpret_cast<Bytef*>(&out[size]);
+				z.avail_out = out.size() - size;
+				int const ret = inflate(&z, Z_SYNC_FLUSH);
+				size = out.size() - z.avail_out;
+				if (ret != Z_OK && ret != Z_BUF_ERROR)
+				{
+					fprintf(stderr, "ERROR: inflate failed (%d)\n", ret);
+					return false;
+				}
+			}
+		}
+
+		return handle_websocket_message(conn, bits & ~0x40, size == 0 ? NULL : &out[0], size);
+	}
 
 	void websocket_handler::handle_end_request(mg_connection* conn)
 	{
-		std::unique_lock<std::mutex> l(m_mutex);
-		auto i = m_open_sockets.find(conn);
-		if (i == m_open_sockets.end()) return;
+		std::shared_ptr<socket_state> s;
+		{
+			std::unique_lock<std::mutex> l(m_mutex);
+			auto i = m_open_sockets.find(conn);
+			if (i == m_open_sockets.end()) return;
+			s = i->second;
+			m_open_sockets.erase(i);
+		}
 
-		m_open_sockets.erase(i);
+		// wait for a send in progress to finish, and make sure threads that
+		// already have the state don't write to the connection anymore
+		std::unique_lock<std::mutex> l(s->mutex);
+		s->closed = true;
 	}
 }
 
@@ -43,15 +43,34 @@ namespace libtorrent
 {
 	struct websocket_handler : http_handler
 	{
+		websocket_handler();
+		~websocket_handler();
+
 		bool send_packet(mg_connection* conn, int type, char const* buffer, int len);
 		virtual bool handle_websocket_connect(mg_connection* conn,
 			mg_request_info const* request_info);
+		virtual bool handle_websocket_data(mg_connection* conn
+			, int bits, char* data, size_t length);
 		virtual void handle_end_request(mg_connection* conn);
 
+	protected:
+
+		// called for every message received on a web socket, after it's
+		// been decompressed
+		virtual bool handle_websocket_message(mg_connection* conn
+			, int bits, char* data, size_t length) { return false; }
+
 	private:
 
-		// all currently alive web sockets
-		std::map<mg_connection*, std::unique_ptr<std::mutex>> m_open_sockets;
+		// messages smaller than this are never compressed
+		enum { min_deflate_size = 512 };
+
+		struct socket_state;
+
+		// all currently alive web sockets. The state is reference counted,
+		// so a thread sending on a socket can hold on to it while the
+		// socket is being closed
+		std::map<mg_connection*, std::shared_ptr<socket_state> > m_open_sockets;
 
 		// serialize access to the map itself
 		std::mutex m_mutex;
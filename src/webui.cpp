@@ -34,6 +34,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <getopt.h> // for getopt_long
 #include <stdlib.h> // for daemon()
 #include <syslog.h>
+#include <thread>
 #include <boost/unordered_map.hpp>
 
 #include "libtorrent/session.hpp"
@@ -85,6 +86,14 @@ static int websocket_data(mg_connection* conn, int bits
 		conn, bits, data, data_len) ? 1 : 0;
 }
 
+static void websocket_wakeup(mg_connection* conn)
+{
+	const mg_request_info *request_info = mg_get_request_info(conn);
+	if (request_info->user_data == NULL) return;
+
+	reinterpret_cast<webui_base*>(request_info->user_data)->handle_websocket_wakeup(conn);
+}
+
 static void end_request(mg_connection const* c, int reply_status_code)
 {
 	mg_connection* conn = const_cast<mg_connection*>(c);
@@ -140,6 +149,15 @@ bool webui_base::handle_websocket_data(mg_connection* conn
 	return false;
 }
 
+void webui_base::handle_websocket_wakeup(mg_connection* conn)
+{
+	for (std::vector<http_handler*>::iterator i = m_handlers.begin()
+		, end(m_handlers.end()); i != end; ++i)
+	{
+		(*i)->handle_websocket_wakeup(conn);
+	}
+}
+
 void webui_base::handle_end_request(mg_connection* conn)
 {
 	for (std::vector<http_handler*>::iterator i = m_handlers.begin()
@@ -178,6 +196,9 @@ void webui_base::start(int port, char const* cert_path, int num_threads)
 	options[i++] = "listening_ports";
 	options[i++] = port_str;
 
+	if (num_threads <= 0)
+		num_threads = (std::max)(2u, std::thread::hardware_concurrency());
+
 	char threads_str[20];
 	snprintf(threads_str, sizeof(threads_str), "%d", num_threads);
 	options[i++] = "num_threads";
@@ -190,6 +211,7 @@ void webui_base::start(int port, char const* cert_path, int num_threads)
 	cb.log_message = &log_message;
 	cb.websocket_connect = &websocket_connect;
 	cb.websocket_data = &websocket_data;
+	cb.websocket_wakeup = &websocket_wakeup;
 	cb.end_request = &end_request;
 
 	m_ctx = mg_start(&cb, this, options);
@@ -48,6 +48,9 @@ struct http_handler
 		mg_request_info const* request_info) { return false; }
 	virtual bool handle_websocket_data(mg_connection* conn
 		, int bits, char* data, size_t length) { return false; }
+	// called on the thread serving a web socket, after
+	// mg_wakeup_websocket() or once queued output has been sent
+	virtual void handle_websocket_wakeup(mg_connection* conn) {}
 	virtual void handle_end_request(mg_connection* conn) {}
 };
 
@@ -65,7 +68,10 @@ namespace libtorrent
 
 		void remove_handler(http_handler* h);
 
-		void start(int port, char const* cert_path = 0, int num_threads = 10);
+		// num_threads is the number of threads serving requests. Web
+		// sockets and downloads don't hold on to one, so the default of 0
+		// means one per core
+		void start(int port, char const* cert_path = 0, int num_threads = 0);
 		void stop();
 		bool is_running() const;
 
@@ -74,6 +80,7 @@ namespace libtorrent
 		bool handle_websocket_connect(mg_connection* conn
 			, mg_request_info const* request_info);
 		bool handle_websocket_data(mg_connection* conn, int bits, char* data, size_t length);
+		void handle_websocket_wakeup(mg_connection* conn);
 		void handle_end_request(mg_connection* conn);
 	
 		void set_document_root(std::string r) { m_document_root = r; }
@@ -14,7 +14,11 @@
 #include "libtorrent/session.hpp"
 #include "alert_handler.hpp"
 #include "stats_logging.hpp"
+#include "stats_sampler.hpp"
+#include "piece_cache.hpp"
+#include "priority_arbiter.hpp"
 #include "rss_filter.hpp"
+#include "torrent_limits.hpp"
 
 #include <signal.h>
 
@@ -95,6 +99,7 @@ int main(int argc, char *const argv[])
 	sett.load(ec);
 
 	torrent_history hist(&alerts);
+	stats_sampler stats(ses, &alerts);
 	auth authorizer;
 	ec.clear();
 	authorizer.load_accounts("users.conf", ec);
@@ -112,11 +117,14 @@ int main(int argc, char *const argv[])
 
 	auto_load al(ses, &sett);
 	rss_filter_handler rss_filter(alerts, ses);
-
-	transmission_webui tr_handler(ses, &sett, &authorizer);
-	utorrent_webui ut_handler(ses, &sett, &al, &hist, &rss_filter, &authorizer);
-	file_downloader file_handler(ses, &authorizer);
-	libtorrent_webui lt_handler(ses, &hist, &authorizer, &alerts);
+	torrent_limits limits(ses);
+
+	transmission_webui tr_handler(ses, &sett, &stats, &authorizer, &limits);
+	utorrent_webui ut_handler(ses, &sett, &al, &hist, &rss_filter, &authorizer, &limits);
+	piece_cache pieces;
+	priority_arbiter priorities;
+	file_downloader file_handler(ses, &pieces, &priorities, &authorizer);
+	libtorrent_webui lt_handler(ses, &hist, &stats, &authorizer, &alerts);
 	stats_logging log(ses, &alerts);
 
 	webui_base webport;
@@ -131,7 +139,7 @@ int main(int argc, char *const argv[])
 		return 1;
 	}
 
-	deluge dlg(ses, "server.pem", &authorizer);
+	deluge dlg(ses, "server.pem", &stats, &authorizer, &limits);
 	dlg.start(58846);
 
 	signal(SIGTERM, &sighandler);
@@ -165,6 +173,8 @@ int main(int argc, char *const argv[])
 	// for alerts. Those alerts aren't likely to ever arrive at
 	// this point.
 	alerts.abort();
+	// the same goes for streams waiting for pieces
+	file_handler.cancel_all();
 	fprintf(stderr, "closing web server\n");
 	dlg.stop();
 	webport.stop();
@@ -0,0 +1,172 @@
+/*
+
+Copyright (c) 2015, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "json_writer.hpp"
+
+#include "test.hpp"
+#include <stdio.h>
+#include <string.h>
+
+using namespace libtorrent;
+
+int main_ret = 0;
+
+std::string str(std::vector<char> const& v)
+{
+	return std::string(v.begin(), v.end());
+}
+
+bool check(std::vector<char> const& out, char const* expect)
+{
+	if (str(out) == expect) return true;
+	fprintf(stderr, "got: %s\nexpected: %s\n", str(out).c_str(), expect);
+	return false;
+}
+
+int main(int argc, char* argv[])
+{
+	// commas between members and array items, but not after keys
+	{
+		std::vector<char> out;
+		json_writer w(out);
+		w.begin_object()
+			.key("a").integer(1)
+			.key("b").begin_array()
+				.integer(1).integer(2)
+				.begin_object().end_object()
+				.begin_array().end_array()
+			.end_array()
+			.key("c").boolean(true)
+			.key("d").boolean(false)
+			.end_object();
+		TEST_CHECK(check(out, "{\"a\":1,\"b\":[1,2,{},[]],\"c\":true,\"d\":false}"));
+	}
+
+	// continuing an object someone else has written members to
+	{
+		std::vector<char> out;
+		json_writer w(out, true);
+		w.key("x").integer(0);
+		TEST_CHECK(check(out, ",\"x\":0"));
+	}
+
+	// integers
+	{
+		std::vector<char> out;
+		json_writer w(out);
+		w.begin_array()
+			.integer(0)
+			.integer(-1)
+			.integer(1234567890123LL)
+			.integer(INT64_MAX)
+			.integer(INT64_MIN)
+			.end_array();
+		TEST_CHECK(check(out, "[0,-1,1234567890123"
+			",9223372036854775807,-9223372036854775808]"));
+	}
+
+	// fixed point numbers round like printf's %f
+	{
+		std::vector<char> out;
+		json_writer w(out);
+		w.begin_array()
+			.number(1.5, 1)
+			.number(0.125, 2)
+			.number(-2.25, 3)
+			.number(2.0 / 3.0)
+			.number(1.5, 0)
+			.number(-0.0001, 2)
+			.number(1e30, 1)
+			.end_array();
+		char expect[200];
+		snprintf(expect, sizeof(expect), "[1.5,0.13,-2.250,0.666667,2,0.00,%.1f]", 1e30);
+		TEST_CHECK(check(out, expect));
+	}
+
+	// NaN and infinity have no JSON representation
+	{
+		std::vector<char> out;
+		json_writer w(out);
+		double const zero = 0.;
+		w.begin_array().number(zero / zero).number(1. / zero).end_array();
+		TEST_CHECK(check(out, "[0,0]"));
+	}
+
+	// escaping
+	{
+		std::vector<char> out;
+		json_writer w(out);
+		w.begin_array()
+			.string("plain")
+			.string("\"quoted\" \\ back")
+			.string("\n\r\t\b\f")
+			.string("\x01\x1f", 2)
+			.string(std::string("nul\0byte", 8))
+			.end_array();
+		TEST_CHECK(check(out, "[\"plain\",\"\\\"quoted\\\" \\\\ back\""
+			",\"\\n\\r\\t\\b\\f\",\"\\u0001\\u001f\",\"nul\\u0000byte\"]"));
+	}
+
+	// everything outside of ASCII is escaped, invalid UTF-8 replaced
+	{
+		std::vector<char> out;
+		json_writer w(out);
+		w.begin_array()
+			.string("\xc3\xa5")           // U+00E5
+			.string("\xe2\x82\xac")       // U+20AC
+			.string("\xf0\x9f\x98\x80")   // U+1F600, a surrogate pair
+			.string("a\xff" "b")          // not UTF-8
+			.string("\xc0\xaf")           // overlong
+			.string("\xed\xa0\x80")       // a surrogate
+			.string("\xe2\x82")           // truncated
+			.end_array();
+		TEST_CHECK(check(out, "[\"\\u00e5\",\"\\u20ac\",\"\\ud83d\\ude00\""
+			",\"a\\ufffdb\",\"\\ufffd\\ufffd\",\"\\ufffd\\ufffd\\ufffd\""
+			",\"\\ufffd\\ufffd\"]"));
+	}
+
+	// info-hashes and pre-serialized values
+	{
+		std::vector<char> out;
+		json_writer w(out);
+		sha1_hash h;
+		for (int i = 0; i < 20; ++i) h[i] = i * 13;
+		w.begin_object()
+			.key("ih").hex(h)
+			.key("r").raw("[1,2]", 5)
+			.end_object();
+		TEST_CHECK(check(out, "{\"ih\":\"000d1a2734414e5b6875828f"
+			"9ca9b6c3d0ddeaf7\",\"r\":[1,2]}"));
+	}
+
+	return main_ret;
+}
@@ -0,0 +1,102 @@
+/*
+
+Copyright (c) 2015, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "file_downloader.hpp"
+
+#include "test.hpp"
+#include <stdio.h>
+
+using namespace libtorrent;
+
+int main_ret = 0;
+
+typedef std::vector<std::pair<std::int64_t, std::int64_t> > ranges_t;
+
+bool check(char const* header, std::int64_t size, ranges_t const& expect)
+{
+	ranges_t r;
+	if (!parse_ranges(header, size, r)) return false;
+	if (r == expect) return true;
+	fprintf(stderr, "\"%s\" (%d ranges):", header, int(r.size()));
+	for (int i = 0; i < int(r.size()); ++i)
+		fprintf(stderr, " %d-%d", int(r[i].first), int(r[i].second));
+	fprintf(stderr, "\n");
+	return false;
+}
+
+ranges_t make(std::int64_t first, std::int64_t last)
+{
+	return ranges_t(1, std::make_pair(first, last));
+}
+
+int main(int argc, char* argv[])
+{
+	ranges_t r;
+
+	// not range requests
+	TEST_CHECK(!parse_ranges(NULL, 1000, r));
+	TEST_CHECK(!parse_ranges("", 1000, r));
+	TEST_CHECK(!parse_ranges("items=0-10", 1000, r));
+	TEST_CHECK(!parse_ranges("bytes=10", 1000, r));
+
+	// single ranges
+	TEST_CHECK(check("bytes=0-99", 1000, make(0, 99)));
+	TEST_CHECK(check("bytes=100-", 1000, make(100, 999)));
+	TEST_CHECK(check("bytes=-100", 1000, make(900, 999)));
+
+	// the end and suffix lengths are clamped to the file
+	TEST_CHECK(check("bytes=900-5000", 1000, make(900, 999)));
+	TEST_CHECK(check("bytes=-5000", 1000, make(0, 999)));
+
+	// ranges outside of the file are dropped, but it's still a range
+	// request
+	TEST_CHECK(check("bytes=1000-1100", 1000, ranges_t()));
+	TEST_CHECK(check("bytes=50-10", 1000, ranges_t()));
+
+	// several ranges are sorted, and overlapping or adjacent ones merged
+	ranges_t expect;
+	expect.push_back(std::make_pair(0, 9));
+	expect.push_back(std::make_pair(500, 599));
+	TEST_CHECK(check("bytes=500-599, 0-9", 1000, expect));
+	TEST_CHECK(check("bytes=0-4,500-549,5-9,550-599", 1000, expect));
+	TEST_CHECK(check("bytes=0-9,500-599,520-530", 1000, expect));
+
+	expect.clear();
+	expect.push_back(std::make_pair(0, 9));
+	expect.push_back(std::make_pair(900, 999));
+	TEST_CHECK(check("bytes=0-9,-100", 1000, expect));
+	TEST_CHECK(check("bytes=0-9,2000-3000,900-", 1000, expect));
+
+	TEST_CHECK(check("bytes=0-499,400-", 1000, make(0, 999)));
+
+	return main_ret;
+}
@@ -0,0 +1,184 @@
+/*
+
+Copyright (c) 2015, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "timer_wheel.hpp"
+
+#include "test.hpp"
+#include <stdio.h>
+#include <algorithm>
+
+using namespace libtorrent;
+
+int main_ret = 0;
+
+typedef timer_wheel::timer_ptr timer_ptr;
+
+time_point const start = clock_type::now();
+
+time_point at(int ms)
+{
+	return start + milliseconds(ms);
+}
+
+timer_ptr timer()
+{
+	return std::make_shared<wheel_timer>();
+}
+
+bool contains(std::vector<timer_ptr> const& v, timer_ptr const& t)
+{
+	return std::find(v.begin(), v.end(), t) != v.end();
+}
+
+int main(int argc, char* argv[])
+{
+	int const slot = timer_wheel::slot_ms;
+	int const block = timer_wheel::slot_ms * timer_wheel::num_slots;
+
+	// timers fire in the first tick after their timeout, never before
+	{
+		timer_wheel w(start);
+		timer_ptr a = timer();
+		timer_ptr b = timer();
+		w.insert(a, at(250));
+		w.insert(b, at(slot * 10));
+
+		std::vector<timer_ptr> due;
+		w.expire(at(250), due);
+		TEST_CHECK(due.empty());
+		w.expire(at(300), due);
+		TEST_CHECK(due.size() == 1 && due[0] == a);
+		due.clear();
+		w.expire(at(slot * 10), due);
+		TEST_CHECK(due.empty());
+		w.expire(at(slot * 11), due);
+		TEST_CHECK(due.size() == 1 && due[0] == b);
+		due.clear();
+
+		// each timer only fires once
+		w.expire(at(block * 3), due);
+		TEST_CHECK(due.empty());
+	}
+
+	// a timer in the past fires on the next tick
+	{
+		timer_wheel w(start);
+		std::vector<timer_ptr> due;
+		w.expire(at(1000), due);
+		timer_ptr a = timer();
+		w.insert(a, at(0));
+		w.expire(at(1000), due);
+		TEST_CHECK(due.empty());
+		w.expire(at(1000 + slot), due);
+		TEST_CHECK(due.size() == 1 && due[0] == a);
+	}
+
+	// timers that are done are skipped
+	{
+		timer_wheel w(start);
+		timer_ptr a = timer();
+		timer_ptr b = timer();
+		w.insert(a, at(500));
+		w.insert(b, at(500));
+		a->done = true;
+		std::vector<timer_ptr> due;
+		w.expire(at(1000), due);
+		TEST_CHECK(due.size() == 1 && due[0] == b);
+	}
+
+	// extending a timer moves it out, it doesn't fire at the old timeout
+	{
+		timer_wheel w(start);
+		timer_ptr a = timer();
+		w.insert(a, at(500));
+		w.extend(a, at(2000));
+		// extending to an earlier time doesn't pull it in
+		w.extend(a, at(100));
+		std::vector<timer_ptr> due;
+		w.expire(at(2000), due);
+		TEST_CHECK(due.empty());
+		w.expire(at(2000 + slot), due);
+		TEST_CHECK(due.size() == 1 && due[0] == a);
+	}
+
+	// timers further out than level 0 cascade down, and fire on time.
+	// Including ones beyond the last level 1 slot, and ones extended past
+	// the end of level 0
+	{
+		timer_wheel w(start);
+		timer_ptr soon = timer();
+		timer_ptr mid = timer();
+		timer_ptr latest = timer();
+		timer_ptr ext = timer();
+		w.insert(soon, at(block - slot * 2));
+		w.insert(mid, at(block * 5 + 50));
+		w.insert(latest, at(block * 100 + 50));
+		w.insert(ext, at(slot));
+		w.extend(ext, at(block * 2 + 50));
+
+		std::vector<timer_ptr> due;
+		// step through time a tick at a time, and check that each timer
+		// fires in the first tick after it's due
+		int fired_soon = -1, fired_mid = -1, fired_latest = -1, fired_ext = -1;
+		for (int t = slot; t <= block * 101; t += slot)
+		{
+			due.clear();
+			w.expire(at(t), due);
+			if (contains(due, soon)) fired_soon = t;
+			if (contains(due, mid)) fired_mid = t;
+			if (contains(due, latest)) fired_latest = t;
+			if (contains(due, ext)) fired_ext = t;
+		}
+		TEST_CHECK(fired_soon == block - slot);
+		TEST_CHECK(fired_mid == block * 5 + slot);
+		TEST_CHECK(fired_ext == block * 2 + slot);
+		TEST_CHECK(fired_latest == block * 100 + slot);
+	}
+
+	// expiring a long stretch of time in one call fires everything in it
+	{
+		timer_wheel w(start);
+		std::vector<timer_ptr> timers;
+		for (int i = 0; i < 200; ++i)
+		{
+			timers.push_back(timer());
+			w.insert(timers.back(), at(i * 97));
+		}
+		std::vector<timer_ptr> due;
+		w.expire(at(200 * 97 + slot), due);
+		TEST_CHECK(due.size() == timers.size());
+		for (int i = 0; i < int(timers.size()); ++i)
+			TEST_CHECK(contains(due, timers[i]));
+	}
+
+	return main_ret;
+}